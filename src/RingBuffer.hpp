@@ -127,7 +127,7 @@ public:
         deleteBuffer();
     }
 
-    bool createBuffer(const uint8_t numChannels, const uint32_t numSamples) noexcept
+    bool createBuffer(const uint16_t numChannels, const uint32_t numSamples) noexcept
     {
         DISTRHO_SAFE_ASSERT_RETURN(buffer.buf == nullptr, false);
         DISTRHO_SAFE_ASSERT_RETURN(numChannels > 0, false);
@@ -137,7 +137,7 @@ public:
 
         try {
             buffer.buf = new float*[numChannels];
-            for (uint8_t c=0; c<numChannels; ++c)
+            for (uint16_t c=0; c<numChannels; ++c)
                 buffer.buf[c] = new float[p2samples];
         } DISTRHO_SAFE_EXCEPTION_RETURN("HeapRingBuffer::createBuffer", false);
 
@@ -148,7 +148,7 @@ public:
 
         ::mlock(buffer.buf, sizeof(float*) * numChannels);
 
-        for (uint8_t c=0; c<numChannels; ++c)
+        for (uint16_t c=0; c<numChannels; ++c)
             ::mlock(buffer.buf[c], sizeof(float) * p2samples);
 
         return true;
@@ -159,7 +159,7 @@ public:
     {
         DISTRHO_SAFE_ASSERT_RETURN(buffer.buf != nullptr,);
 
-        for (uint8_t c=0; c<buffer.channels; ++c)
+        for (uint16_t c=0; c<buffer.channels; ++c)
             delete[] buffer.buf[c];
         delete[] buffer.buf;
         buffer.buf  = nullptr;
@@ -231,14 +231,14 @@ public:
 
             if (samples == 1)
             {
-                for (uint8_t c=0; c<buffer.channels; ++c)
+                for (uint16_t c=0; c<buffer.channels; ++c)
                     std::memcpy(buffers[c], buffer.buf[c] + tail, sizeof(float));
             }
             else
             {
                 const uint32_t firstpart = buffer.samples - tail;
 
-                for (uint8_t c=0; c<buffer.channels; ++c)
+                for (uint16_t c=0; c<buffer.channels; ++c)
                 {
                     std::memcpy(buffers[c], buffer.buf[c] + tail, firstpart * sizeof(float));
                     std::memcpy(buffers[c] + firstpart, buffer.buf[c], readto * sizeof(float));
@@ -247,7 +247,7 @@ public:
         }
         else
         {
-            for (uint8_t c=0; c<buffer.channels; ++c)
+            for (uint16_t c=0; c<buffer.channels; ++c)
                 std::memcpy(buffers[c], buffer.buf[c] + tail, samples * sizeof(float));
 
             if (readto == buffer.samples)
@@ -261,6 +261,30 @@ public:
 
     // ----------------------------------------------------------------------------------------------------------------
 
+    /*
+     * Discard samples from the read side, as if they were read.
+     * Must only be called from the reader thread.
+     */
+    bool skip(const uint32_t samples) noexcept
+    {
+        const uint32_t head = buffer.head;
+        const uint32_t tail = buffer.tail;
+        const uint32_t wrap = head >= tail ? 0 : buffer.samples;
+
+        if (samples > wrap + head - tail)
+            return false;
+
+        uint32_t readto = tail + samples;
+
+        if (readto >= buffer.samples)
+            readto -= buffer.samples;
+
+        buffer.tail = readto;
+        return true;
+    }
+
+    // ----------------------------------------------------------------------------------------------------------------
+
     bool write(const float* const* const buffers, const uint32_t samples) noexcept
     {
         DISTRHO_SAFE_ASSERT_UINT2_RETURN(samples < buffer.samples, samples, buffer.samples, false);
@@ -287,14 +311,14 @@ public:
 
             if (samples == 1)
             {
-                for (uint8_t c=0; c<buffer.channels; ++c)
+                for (uint16_t c=0; c<buffer.channels; ++c)
                     std::memcpy(buffer.buf[c], buffers[c], sizeof(float));
             }
             else
             {
                 const uint32_t firstpart = buffer.samples - head;
 
-                for (uint8_t c=0; c<buffer.channels; ++c)
+                for (uint16_t c=0; c<buffer.channels; ++c)
                 {
                     std::memcpy(buffer.buf[c] + head, buffers[c], firstpart * sizeof(float));
                     std::memcpy(buffer.buf[c], buffers[c] + firstpart, writeto * sizeof(float));
@@ -303,7 +327,7 @@ public:
         }
         else
         {
-            for (uint8_t c=0; c<buffer.channels; ++c)
+            for (uint16_t c=0; c<buffer.channels; ++c)
                 std::memcpy(buffer.buf[c] + head, buffers[c], samples * sizeof(float));
 
             if (writeto == buffer.samples)
@@ -323,7 +347,7 @@ private:
         uint32_t samples;
         uint32_t head;
         uint32_t tail;
-        uint8_t channels;
+        uint16_t channels;
         float** buf;
     } buffer = { 0, 0, 0, 0, nullptr };
 
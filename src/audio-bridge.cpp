@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-bridge.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+// --------------------------------------------------------------------------------------------------------------------
+// log output of the device code goes through the caller log function, if set
+
+static AudioBridgeLogFunc gLogFunc = nullptr;
+static void* gLogPtr = nullptr;
+
+static void audioBridgeLog(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void audioBridgeLog(const char* const fmt, ...)
+{
+    char msg[512];
+
+    va_list args;
+    va_start(args, fmt);
+    std::vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    if (const AudioBridgeLogFunc func = __atomic_load_n(&gLogFunc, __ATOMIC_ACQUIRE))
+        func(__atomic_load_n(&gLogPtr, __ATOMIC_ACQUIRE), msg);
+    else
+        std::puts(msg);
+}
+
+#define DEBUGPRINT(...) audioBridgeLog(__VA_ARGS__)
+
+// discovery and hotplug are built into this file too, so their log output also goes through the log function
+#include "audio-device-init.cpp"
+#include "audio-device-discovery.cpp"
+#include "audio-device-hotplug.cpp"
+
+// --------------------------------------------------------------------------------------------------------------------
+
+struct AudioBridge {
+    DeviceAudio* dev;
+    // set once runDeviceAudio reports the device is gone, it is not run again after that
+    bool failed;
+};
+
+static int audioBridgeRun(AudioBridge* const bridge, float** const buffers)
+{
+    DeviceAudio* const dev = bridge->dev;
+
+    if (! bridge->failed && runDeviceAudio(dev, buffers))
+        return 0;
+
+    bridge->failed = true;
+
+    if (dev->hints & kDeviceCapture)
+        clearCaptureBuffers(dev, buffers);
+
+    return -1;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+int audio_bridge_get_api_version(void)
+{
+    return AUDIO_BRIDGE_API_VERSION;
+}
+
+void audio_bridge_set_log_func(const AudioBridgeLogFunc func, void* const ptr)
+{
+    __atomic_store_n(&gLogPtr, ptr, __ATOMIC_RELEASE);
+    __atomic_store_n(&gLogFunc, func, __ATOMIC_RELEASE);
+}
+
+AudioBridge* audio_bridge_open(const char* const deviceID,
+                               const AudioBridgeDirection direction,
+                               const uint32_t bufferSize,
+                               const uint32_t sampleRate,
+                               const uint16_t channels)
+{
+    const bool playback = direction == AUDIO_BRIDGE_PLAYBACK;
+
+    DeviceAudioOptions options;
+    initDeviceAudioOptions(&options);
+    loadDeviceAudioOptionsFromEnv(&options);
+
+    if (channels != 0)
+        options.channels = channels;
+
+    DeviceAudio* dev = nullptr;
+
+    if (deviceID != nullptr)
+    {
+        dev = initDeviceAudio(deviceID, playback, bufferSize, sampleRate, &options);
+    }
+    else
+    {
+        std::vector<DeviceIndexEntry> devices;
+        getRankedSoundcards(playback, sampleRate, devices);
+
+        for (const DeviceIndexEntry& entry : devices)
+        {
+            if ((dev = initDeviceAudio(entry.device.id.c_str(), playback, bufferSize, sampleRate, &options)) != nullptr)
+                break;
+        }
+    }
+
+    if (dev == nullptr)
+        return nullptr;
+
+    AudioBridge* const bridge = new AudioBridge;
+    bridge->dev = dev;
+    bridge->failed = false;
+    return bridge;
+}
+
+int audio_bridge_pull(AudioBridge* const bridge, float* const* const buffers)
+{
+    DISTRHO_SAFE_ASSERT_RETURN(bridge->dev->hints & kDeviceCapture, -1);
+
+    return audioBridgeRun(bridge, const_cast<float**>(buffers));
+}
+
+int audio_bridge_push(AudioBridge* const bridge, const float* const* const buffers)
+{
+    DISTRHO_SAFE_ASSERT_RETURN((bridge->dev->hints & kDeviceCapture) == 0, -1);
+
+    // playback only reads from the host buffers
+    return audioBridgeRun(bridge, const_cast<float**>(buffers));
+}
+
+void audio_bridge_get_stats(const AudioBridge* const bridge, AudioBridgeStats* const stats, const size_t size)
+{
+    const DeviceAudio* const dev = bridge->dev;
+    const uint32_t hints = __atomic_load_n(&dev->hints, __ATOMIC_ACQUIRE);
+
+    AudioBridgeStats s = {};
+    s.status = bridge->failed ? AUDIO_BRIDGE_STATUS_FAILED
+             : hints & kDeviceInitializing ? AUDIO_BRIDGE_STATUS_INITIALIZING
+             : hints & kDeviceStarting ? AUDIO_BRIDGE_STATUS_STARTING
+             : hints & kDeviceBuffering ? AUDIO_BRIDGE_STATUS_BUFFERING
+             : AUDIO_BRIDGE_STATUS_RUNNING;
+    s.channels = dev->hwstatus.channels;
+    s.sampleRate = dev->sampleRate;
+    s.bufferSize = dev->bufferSize;
+    s.periods = dev->hwstatus.periods;
+    s.periodSize = dev->hwstatus.periodSize;
+    s.fullBufferSize = dev->hwstatus.fullBufferSize;
+    s.latency = getDeviceAudioLatency(dev);
+    s.ratio = dev->rbRatio;
+    s.bufferFill = dev->ringbuffer->getNumReadableSamples();
+    s.xruns = dev->stats.xruns;
+    s.ringbufferFailures = dev->stats.rbFailures;
+    s.recoveries = dev->stats.recoveries;
+    s.droppedFrames = dev->stats.droppedFrames;
+    s.blockedWaits = dev->stats.blockedWaits;
+    s.framesDone = dev->framesDone;
+
+    // callers built against an older header know fewer fields
+    std::memcpy(stats, &s, std::min(size, sizeof(s)));
+}
+
+void audio_bridge_close(AudioBridge* const bridge)
+{
+    closeDeviceAudio(bridge->dev);
+    delete bridge;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
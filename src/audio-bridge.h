@@ -0,0 +1,113 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+// C API of libaudiobridge, for using the soundcard side of audio-bridge directly within a process.
+// A bridge is opened for one direction of a soundcard and then run once per block from the caller's own audio thread,
+// pulling captured or pushing playback audio as planar float buffers, always of the buffer size given on open.
+// Soundcard I/O, clock drift compensation and ringbuffering happen in the background the same way as for the
+// JACK and LV2 variants, including the AUDIO_BRIDGE_* environment variables.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUDIO_BRIDGE_API __attribute__((visibility("default")))
+
+// bumped on incompatible changes, new functions and appended stats fields do not change it
+#define AUDIO_BRIDGE_API_VERSION 1
+
+typedef struct AudioBridge AudioBridge;
+
+typedef enum {
+    AUDIO_BRIDGE_CAPTURE = 0,
+    AUDIO_BRIDGE_PLAYBACK = 1
+} AudioBridgeDirection;
+
+typedef enum {
+    // soundcard being set up, audio is silent
+    AUDIO_BRIDGE_STATUS_INITIALIZING = 0,
+    // soundcard starting, audio is silent
+    AUDIO_BRIDGE_STATUS_STARTING,
+    // filling the ringbuffer up to its target, audio is silent
+    AUDIO_BRIDGE_STATUS_BUFFERING,
+    // audio is flowing
+    AUDIO_BRIDGE_STATUS_RUNNING,
+    // soundcard stopped working, the bridge needs to be closed (and opened again if wanted)
+    AUDIO_BRIDGE_STATUS_FAILED
+} AudioBridgeStatus;
+
+typedef struct {
+    // see AudioBridgeStatus
+    uint32_t status;
+    // bridged channels, the amount of buffers used for push and pull
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint32_t bufferSize;
+    // soundcard side setup
+    uint32_t periods;
+    uint32_t periodSize;
+    uint32_t fullBufferSize;
+    // total latency in frames between the caller buffers and the soundcard
+    uint32_t latency;
+    // current clock drift compensation ratio
+    double ratio;
+    // ringbuffer fill level, in frames
+    uint32_t bufferFill;
+    // counters since the bridge was opened, see DeviceAudio::Stats
+    uint32_t xruns;
+    uint32_t ringbufferFailures;
+    uint32_t recoveries;
+    uint32_t droppedFrames;
+    uint32_t blockedWaits;
+    // frames processed by the soundcard side
+    uint64_t framesDone;
+} AudioBridgeStats;
+
+// receives every log line, without trailing newline. called from any thread, including realtime ones.
+typedef void (*AudioBridgeLogFunc)(void* ptr, const char* msg);
+
+AUDIO_BRIDGE_API
+int audio_bridge_get_api_version(void);
+
+// sets where log lines go, NULL restores the default of printing them to stdout.
+// meant to be called once before opening any bridge
+AUDIO_BRIDGE_API
+void audio_bridge_set_log_func(AudioBridgeLogFunc func, void* ptr);
+
+// opens a soundcard, NULL device id picks the best available one.
+// channels is how many soundcard channels to ask for (the nearest supported amount is used), 0 for the default.
+// returns NULL on failure. not realtime safe
+AUDIO_BRIDGE_API
+AudioBridge* audio_bridge_open(const char* deviceID,
+                               AudioBridgeDirection direction,
+                               uint32_t bufferSize,
+                               uint32_t sampleRate,
+                               uint16_t channels);
+
+// fills 1 buffer per bridged channel with bufferSize frames of captured audio, silence while not running.
+// returns 0 on success, -1 once the soundcard stopped working. realtime safe, to be called once per block
+AUDIO_BRIDGE_API
+int audio_bridge_pull(AudioBridge* bridge, float* const* buffers);
+
+// queues 1 buffer per bridged channel with bufferSize frames of audio for playback.
+// returns 0 on success, -1 once the soundcard stopped working. realtime safe, to be called once per block
+AUDIO_BRIDGE_API
+int audio_bridge_push(AudioBridge* bridge, const float* const* buffers);
+
+// fills stats, size must be sizeof(AudioBridgeStats) as known to the caller, only that much gets written.
+// safe to call from any thread, values can be a block behind
+AUDIO_BRIDGE_API
+void audio_bridge_get_stats(const AudioBridge* bridge, AudioBridgeStats* stats, size_t size);
+
+// stops and closes the soundcard. not realtime safe
+AUDIO_BRIDGE_API
+void audio_bridge_close(AudioBridge* bridge);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,244 +6,442 @@
 
 #include <algorithm>
 
-static void* deviceCaptureThread(void* const  arg)
+static void setCaptureBlocks(DeviceAudio* const dev, const uint32_t captureBlocks)
 {
-    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+    dev->stats.captureBlocks = captureBlocks;
+    deviceUpdateFillTarget(dev);
+
+    // pool workers and the duplex thread wake up on device poll events, keep them in sync with the read size
+    if (deviceNonBlockingSteps(dev))
+        deviceSetAvailMin(dev, dev->hwstatus.periodSize * captureBlocks);
+}
 
-    const uint8_t hints = dev->hints;
-    const uint8_t channels = dev->hwstatus.channels;
-    const uint16_t bufferSize = dev->bufferSize;
+// per-thread capture state, kept outside the thread function so duplex mode can drive it too
+struct DeviceCaptureState {
+    DeviceAudio* dev;
 
-    float** buffers = new float*[channels];
-    for (uint8_t c=0; c<channels; ++c)
-        buffers[c] = new float[bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT];
+    uint16_t channels;
+    uint32_t periodSize;
+    uint32_t blockSize;
+    uint32_t maxBlocks;
+    uint32_t minBlocks;
+    uint32_t maxFrames;
 
-    simd::init();
+    float** buffers;
+    // offset pointers into buffers, for partial writes
+    float** bufptrs;
 
     // smooth initial volume to prevent clicks on start
     ExponentialValueSmoother gain;
-    gain.setSampleRate(dev->sampleRate);
-    gain.setTimeConstant(0.5f);
+    DeviceResampler resampler;
+    double rbRatio;
+    bool enabled;
+
+    // read size adapts at runtime, start big and go lower while things are stable
+    uint32_t captureBlocks;
+    uint32_t numFailures;
+    uint32_t stableFrames;
+
+    // state for in-place xrun recovery
+    DeviceRecovery recovery;
+    uint32_t lastFrames;
+    uint32_t fadeIn;
+
+    // resampled frames not yet written to a full ringbuffer, starting at pendingOffset
+    uint32_t pendingFrames;
+    uint32_t pendingOffset;
+    uint64_t pendingDeadline;
+    bool skipRequested;
+};
+
+static void deviceCaptureInit(DeviceCaptureState& s, DeviceAudio* const dev)
+{
+    s.dev = dev;
+    s.channels = dev->hwstatus.channels;
+    s.periodSize = dev->hwstatus.periodSize;
+    s.blockSize = std::max<uint32_t>(dev->bufferSize, s.periodSize);
+    s.maxBlocks = dev->options.captureMaxBlocks;
+    s.minBlocks = dev->options.captureMinBlocks;
+    s.maxFrames = s.periodSize * 2 * s.maxBlocks;
 
-    VResampler* const resampler = new VResampler;
-    resampler->setup(1.0, channels, 8);
+    s.buffers = new float*[s.channels];
+    for (uint16_t c=0; c<s.channels; ++c)
+        s.buffers[c] = new float[s.maxFrames];
 
-    snd_pcm_sframes_t err;
-    float xgain;
-    double rbRatio = 0.0;
-    bool enabled = true;
+    s.bufptrs = new float*[s.channels];
 
-    auto restart = [&dev, &resampler, &gain, &enabled]()
-    {
-        deviceFailInitHints(dev);
-        gain.setTargetValue(0.f);
-        gain.clearToTargetValue();
-        if (enabled)
-            gain.setTargetValue(1.f);
-    };
+    s.gain.setSampleRate(dev->sampleRate);
+    s.gain.setTimeConstant(0.5f);
 
-    // wait for audio thread to post
-    {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 15;
+    deviceResamplerInit(s.resampler, dev, s.channels);
 
-        if (sem_timedwait(&dev->sem, &ts) != 0)
-        {
-            printf("%08u | capture | audio thread failed to post\n", dev->frame);
-            goto end;
-        }
-    }
+    s.rbRatio = 0.0;
+    s.enabled = true;
 
-    while (dev->hwstatus.channels != 0)
+    s.captureBlocks = s.maxBlocks;
+    s.numFailures = 0;
+    s.stableFrames = 0;
+
+    s.recovery = {};
+    s.lastFrames = 0;
+    s.fadeIn = 0;
+
+    s.pendingFrames = 0;
+    s.pendingOffset = 0;
+    s.pendingDeadline = 0;
+    s.skipRequested = false;
+}
+
+static void deviceCaptureCleanup(DeviceCaptureState& s)
+{
+    deviceResamplerCleanup(s.resampler);
+
+    for (uint16_t c=0; c<s.channels; ++c)
+        delete[] s.buffers[c];
+    delete[] s.buffers;
+    delete[] s.bufptrs;
+}
+
+static void deviceCaptureRestart(DeviceCaptureState& s)
+{
+    deviceFailInitHints(s.dev);
+    s.gain.setTargetValue(0.f);
+    s.gain.clearToTargetValue();
+    if (s.enabled)
+        s.gain.setTargetValue(1.f);
+}
+
+// writes pending resampled frames into the ringbuffer, waiting for space according to the overflow policy.
+// dedicated threads block here, pooled and duplex devices return kDeviceStepWait and resume on the next step instead
+static DeviceThreadStep deviceCaptureFlush(DeviceCaptureState& s)
+{
+    DeviceAudio* const dev = s.dev;
+    const uint32_t frame = dev->frame;
+
+    while (dev->hwstatus.channels != 0 && s.pendingFrames != 0)
     {
-        const uint32_t frame = dev->frame;
+        const uint32_t rbavail = std::min<uint32_t>(s.pendingFrames, dev->ringbuffer->getNumWritableSamples());
 
-        if (dev->hints & kDeviceInitializing)
+        if (rbavail != 0)
         {
-            // read until alsa buffers are empty
-            bool started = false;
-            while ((err = snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw, bufferSize * 2)) > 0)
-                started = true;
+            for (uint16_t c=0; c<s.channels; ++c)
+                s.bufptrs[c] = s.buffers[c] + s.pendingOffset;
 
-            if (err == -EPIPE)
-            {
-                snd_pcm_prepare(dev->pcm);
-                // printf("%08u | capture | initial pipe error: %s\n", frame, snd_strerror(err));
-                // started = false;
-            }
-            else if (err != -EAGAIN)
+            if (! dev->ringbuffer->write(s.bufptrs, rbavail))
             {
-                printf("%08u | capture | initial read error: %s\n", frame, snd_strerror(err));
-                goto end;
+                DEBUGPRINT("%08u | capture | failed writing data", frame);
+                dev->stats.droppedFrames += s.pendingFrames;
+                break;
             }
 
-            if (started)
-            {
-                DEBUGPRINT("%08u | capture | can read data? removing kDeviceInitializing", frame);
-                restart();
-                dev->hints &= ~kDeviceInitializing;
-            }
-            else
+            if ((dev->hints & kDeviceBuffering) != 0
+                && dev->ringbuffer->getNumReadableSamples() > s.blockSize * getCaptureLatencyBlocks(s.captureBlocks))
             {
-                deviceTimedWait(dev);
-                continue;
+                DEBUGPRINT("%08u | capture | wrote enough data, removing kDeviceBuffering", frame);
+                dev->hints &= ~kDeviceBuffering;
+                deviceMarkStartup(dev, kDeviceStartupAudio);
             }
+
+            s.pendingOffset += rbavail;
+            s.pendingFrames -= rbavail;
+            continue;
         }
 
-        if (dev->hints & kDeviceStarting)
+        // ringbuffer is full, never spin here
+        if (dev->options.overflowPolicy == kDeviceOverflowDropNewest)
         {
-            // try reading a single sample to see if device is running
-            err = snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw, 1);
+            DEBUGPRINT("%08u | capture | ringbuffer full, dropping %u frames", frame, s.pendingFrames);
+            dev->stats.droppedFrames += s.pendingFrames;
+            break;
+        }
 
-            switch (err)
-            {
-            case 1:
-                DEBUGPRINT("%08u | capture | can read data, removing kDeviceStarting", frame);
-                dev->hints &= ~kDeviceStarting;
-                snd_pcm_rewind(dev->pcm, 1);
-                break;
-            case -EAGAIN:
-                deviceTimedWait(dev);
-                continue;
-            case -EPIPE:
-                DEBUGPRINT("%08u | capture | EPIPE while kDeviceStarting", frame);
-                snd_pcm_prepare(dev->pcm);
-                deviceTimedWait(dev);
-                continue;
-            default:
-                printf("%08u | capture | initial read error: %s\n", frame, snd_strerror(err));
-                goto end;
-            }
+        if (dev->options.overflowPolicy == kDeviceOverflowDropOldest && ! s.skipRequested)
+        {
+            s.skipRequested = true;
+            __atomic_add_fetch(&dev->rbSkipRequest, s.pendingFrames, __ATOMIC_SEQ_CST);
         }
 
-        err = snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw, bufferSize * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT);
+        const uint64_t now = getTimeNs();
 
-        if (dev->hwstatus.channels == 0)
+        if (s.pendingDeadline == 0)
+        {
+            s.pendingDeadline = now + static_cast<uint64_t>(dev->bufferSize) * 1000000000ULL / dev->sampleRate
+                                    * AUDIO_BRIDGE_OVERFLOW_DEADLINE_PERIODS;
+        }
+        else if (now >= s.pendingDeadline)
+        {
+            DEBUGPRINT("%08u | capture | ringbuffer full for too long, dropping %u frames", frame, s.pendingFrames);
+            dev->stats.droppedFrames += s.pendingFrames;
             break;
+        }
 
-        switch (err)
+        ++dev->stats.blockedWaits;
+
+        if (deviceNonBlockingSteps(dev))
+            return kDeviceStepWait;
+
+        deviceTimedWait(dev);
+    }
+
+    s.pendingFrames = 0;
+    return kDeviceStepAgain;
+}
+
+// a single iteration of the capture thread
+static DeviceThreadStep deviceCaptureStep(DeviceCaptureState& s)
+{
+    DeviceAudio* const dev = s.dev;
+    const uint32_t frame = dev->frame;
+    const uint16_t channels = s.channels;
+    const uint32_t periodSize = s.periodSize;
+
+    snd_pcm_sframes_t err;
+    float xgain;
+
+    // previous step of a pooled or duplex device could not write everything yet, finish that before reading more
+    if (s.pendingFrames != 0 && deviceCaptureFlush(s) == kDeviceStepWait)
+        return kDeviceStepWait;
+
+    if (dev->hints & kDeviceInitializing)
+    {
+        // read until alsa buffers are empty
+        bool started = false;
+        while ((err = deviceReadRaw(dev, 0, periodSize * 2)) > 0)
+            started = true;
+
+        if (err == -EPIPE)
         {
-        case -EPIPE:
             snd_pcm_prepare(dev->pcm);
-            // fall-through
-        case -EAGAIN:
-            deviceTimedWait(dev);
-            continue;
-        case 0:
-            // deviceTimedWait(dev);
-            continue;
+            // printf("%08u | capture | initial pipe error: %s\n", frame, snd_strerror(err));
+            // started = false;
         }
-
-        if (err < 0)
+        else if (err != -EAGAIN)
         {
-            restart();
-
-            /*
-            for (uint8_t c=0; c<channels; ++c)
-                dev->ringbuffer->clearData();
-            */
+            DEBUGPRINT("%08u | capture | initial read error: %s", frame, snd_strerror(err));
+            return kDeviceStepClose;
+        }
 
-            DEBUGPRINT("%08u | capture | Read error %s", frame, snd_strerror(err));
+        if (! started)
+            return kDeviceStepWait;
 
-            // TODO offline recovery
-            if (xrun_recovery(dev->pcm, err) < 0)
-            {
-                printf("%08u | capture | xrun_recovery error: %s\n", frame, snd_strerror(err));
-                goto end;
-            }
+        DEBUGPRINT("%08u | capture | can read data? removing kDeviceInitializing", frame);
+        deviceCaptureRestart(s);
+        dev->hints &= ~kDeviceInitializing;
+        deviceMarkStartup(dev, kDeviceStartupInitialized);
+    }
 
-            continue;
-        }
+    if (dev->hints & kDeviceStarting)
+    {
+        // try reading a single sample to see if device is running
+        err = deviceReadRaw(dev, 0, 1);
 
-        switch (hints & kDeviceSampleHints)
+        switch (err)
         {
-        case kDeviceSample16:
-            int2float::s16(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        case kDeviceSample24:
-            int2float::s24(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        case kDeviceSample24LE3:
-            int2float::s24le3(dev->buffers.f32, dev->buffers.raw, channels, err);
-            break;
-        case kDeviceSample32:
-            int2float::s32(dev->buffers.f32, dev->buffers.raw, channels, err);
+        case 1:
+            DEBUGPRINT("%08u | capture | can read data, removing kDeviceStarting", frame);
+            dev->hints &= ~kDeviceStarting;
+            deviceMarkStartup(dev, kDeviceStartupStarted);
+            snd_pcm_rewind(dev->pcm, 1);
             break;
+        case -EAGAIN:
+            return kDeviceStepWait;
+        case -EPIPE:
+            DEBUGPRINT("%08u | capture | EPIPE while kDeviceStarting", frame);
+            snd_pcm_prepare(dev->pcm);
+            return kDeviceStepWait;
+        default:
+            DEBUGPRINT("%08u | capture | initial read error: %s", frame, snd_strerror(err));
+            return kDeviceStepClose;
         }
+    }
+
+    // any xrun or ringbuffer underrun means we need to read in bigger blocks
+    if (s.numFailures != dev->stats.xruns + dev->stats.rbFailures)
+    {
+        s.numFailures = dev->stats.xruns + dev->stats.rbFailures;
+        s.stableFrames = 0;
 
-        if (enabled != dev->enabled)
+        if (s.captureBlocks != s.maxBlocks)
         {
-            enabled = dev->enabled;
-            gain.setTargetValue(enabled ? 1.f : 0.f);
+            s.captureBlocks = std::min(s.maxBlocks, s.captureBlocks * 2);
+            DEBUGPRINT("%08u | capture | unstable, reading %u periods at once", frame, s.captureBlocks);
+            setCaptureBlocks(dev, s.captureBlocks);
         }
+    }
+    else if (s.captureBlocks != s.minBlocks && s.stableFrames >= dev->sampleRate * AUDIO_BRIDGE_CAPTURE_STABLE_DELAY)
+    {
+        s.stableFrames = 0;
+        s.captureBlocks = std::max(s.minBlocks, s.captureBlocks / 2);
+        DEBUGPRINT("%08u | capture | stable, reading %u periods at once", frame, s.captureBlocks);
+        setCaptureBlocks(dev, s.captureBlocks);
+    }
+
+    deviceMeasureLatency(dev, deviceResamplerLatency(s.resampler));
+
+    // read exactly what is available, within the current block bounds
+    err = snd_pcm_avail_update(dev->pcm);
+
+    if (err >= 0)
+    {
+        if (err < periodSize * s.captureBlocks)
+            return kDeviceStepWait;
+
+        err = deviceReadRaw(dev, 0, std::min<snd_pcm_sframes_t>(err, periodSize * s.maxBlocks));
+    }
+
+    if (dev->hwstatus.channels == 0)
+        return kDeviceStepClose;
+
+    switch (err)
+    {
+    case -EAGAIN:
+        return kDeviceStepWait;
+    case 0:
+        return kDeviceStepAgain;
+    }
+
+    if (err < 0)
+    {
+        ++dev->stats.xruns;
 
-        if (rbRatio != dev->rbRatio)
+        if (deviceRecoverInPlace(dev, s.recovery, err))
         {
-            rbRatio = dev->rbRatio;
-            resampler->set_rratio(rbRatio);
+            DEBUGPRINT("%08u | capture | recovered from %s", frame, snd_strerror(err));
+
+            // replace lost audio with silence so the ringbuffer stays around its target,
+            // fading out from the last sample we got
+            const uint32_t rbfill = dev->ringbuffer->getNumReadableSamples();
+            const uint32_t rbtarget = getRingBufferFillTarget(dev);
+
+            if (rbfill < rbtarget)
+            {
+                const uint32_t insert = std::min(std::min(rbtarget - rbfill, s.maxFrames),
+                                                 dev->ringbuffer->getNumWritableSamples());
+
+                for (uint16_t c=0; c<channels; ++c)
+                {
+                    const float last = s.lastFrames != 0 ? s.buffers[c][s.lastFrames - 1] : 0.f;
+
+                    for (uint32_t i=0; i<insert; ++i)
+                        s.buffers[c][i] = i < AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES
+                                        ? last * (1.f - static_cast<float>(i) / AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES)
+                                        : 0.f;
+                }
+
+                if (insert != 0)
+                    dev->ringbuffer->write(s.buffers, insert);
+            }
+
+            s.lastFrames = 0;
+            s.fadeIn = AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES;
+            return kDeviceStepWait;
         }
 
-        resampler->inp_count = err;
-        resampler->out_count = bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
-        resampler->inp_data = dev->buffers.f32;
-        resampler->out_data = buffers;
-        resampler->process();
+        deviceCaptureRestart(s);
+
+        /*
+        for (uint16_t c=0; c<channels; ++c)
+            dev->ringbuffer->clearData();
+        */
 
-        uint32_t frames = bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT - resampler->out_count;
+        DEBUGPRINT("%08u | capture | Read error %s", frame, snd_strerror(err));
 
-        for (uint16_t i=0; i<frames; ++i)
+        // TODO offline recovery
+        if (xrun_recovery(dev->pcm, err) < 0)
         {
-            xgain = gain.next();
-            for (uint8_t c=0; c<channels; ++c)
-                buffers[c][i] *= xgain;
+            DEBUGPRINT("%08u | capture | xrun_recovery error: %s", frame, snd_strerror(err));
+            return kDeviceStepClose;
         }
 
-        while (dev->hwstatus.channels != 0 && frames != 0)
-        {
-            const uint32_t rbavail = std::min<uint32_t>(frames, dev->ringbuffer->getNumWritableSamples());
+        return kDeviceStepAgain;
+    }
 
-            if (rbavail == 0)
-            {
-                deviceTimedWait(dev);
-                continue;
-            }
+    // host is not running in realtime, keep reading to keep the device going but leave the ringbuffer as-is
+    if (__atomic_load_n(&dev->freewheeling, __ATOMIC_ACQUIRE))
+        return kDeviceStepAgain;
 
-            while (!dev->ringbuffer->write(buffers, rbavail))
-            {
-                DEBUGPRINT("%08u | capture | failed writing data", frame);
-                sched_yield();
-            }
+    deviceRawToFloat(dev, err);
 
-            if ((dev->hints & kDeviceBuffering) != 0
-                && dev->ringbuffer->getNumReadableSamples() > bufferSize * AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS)
-            {
-                DEBUGPRINT("%08u | capture | wrote enough data, removing kDeviceBuffering", frame);
-                dev->hints &= ~kDeviceBuffering;
-            }
+    if (s.enabled != dev->enabled)
+    {
+        s.enabled = dev->enabled;
+        s.gain.setTargetValue(s.enabled ? 1.f : 0.f);
+    }
 
-            if (rbavail != frames)
-            {
-                DEBUGPRINT("%08u | capture | Incomplete write %u of %u", frame, rbavail, frames);
+    if (s.rbRatio != dev->rbRatio)
+    {
+        s.rbRatio = dev->rbRatio;
+        deviceResamplerSetRatio(s.resampler, s.rbRatio);
+    }
 
-                frames -= rbavail;
+    uint32_t frames = deviceResamplerProcess(s.resampler, dev->buffers.f32, err, s.buffers, s.maxFrames);
 
-                deviceTimedWait(dev);
-                continue;
-            }
+    s.stableFrames += err;
+
+    for (uint32_t i=0; i<frames; ++i)
+    {
+        xgain = s.gain.next();
+
+        if (s.fadeIn != 0)
+            xgain *= 1.f - static_cast<float>(s.fadeIn--) / AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES;
+
+        for (uint16_t c=0; c<channels; ++c)
+            s.buffers[c][i] *= xgain;
+    }
+
+    s.lastFrames = frames;
+
+    s.pendingFrames = frames;
+    s.pendingOffset = 0;
+    s.pendingDeadline = 0;
+    s.skipRequested = false;
+
+    return deviceCaptureFlush(s);
+}
+
+static void* deviceCaptureThread(void* const  arg)
+{
+    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+
+    DeviceCaptureState state;
+    deviceCaptureInit(state, dev);
+
+    simd::init();
+    deviceThreadInit(dev);
+
+    // stay parked while the host drives the device synchronously
+    if ((dev->hints & kDeviceSync) != 0 && ! deviceSyncWait(dev))
+        goto end;
+
+    // wait for audio thread to post
+    if (! notifierWait(&dev->notifier, 15000000000ULL))
+    {
+        DEBUGPRINT("%08u | capture | audio thread failed to post", dev->frame);
+        goto end;
+    }
 
+    deviceMarkStartup(dev, kDeviceStartupHostPost);
+
+    while (dev->hwstatus.channels != 0)
+    {
+        devicePrintStartup(dev);
+
+        switch (deviceCaptureStep(state))
+        {
+        case kDeviceStepAgain:
             break;
+        case kDeviceStepWait:
+            deviceTimedWait(dev);
+            break;
+        case kDeviceStepClose:
+            goto end;
         }
     }
 
 end:
     DEBUGPRINT("%08u | capture | audio thread closed", dev->frame);
 
-    delete resampler;
-
-    for (uint8_t c=0; c<channels; ++c)
-        delete[] buffers[c];
-    delete[] buffers;
+    deviceCaptureCleanup(state);
 
     dev->thread = 0;
     return nullptr;
@@ -252,17 +450,17 @@ end:
 static inline
 void clearCaptureBuffers(DeviceAudio* const dev, float* buffers[])
 {
-    const uint16_t bufferSize = dev->bufferSize;
+    const uint32_t bufferSize = dev->bufferSize;
 
-    for (uint8_t c=0; c < dev->hwstatus.channels; ++c)
+    for (uint16_t c=0; c < dev->hwstatus.channels; ++c)
         std::memset(buffers[c], 0, sizeof(float) * bufferSize);
 }
 
 static void runDeviceAudioCapture(DeviceAudio* const dev, float* buffers[], const uint32_t frame)
 {
-    const uint16_t bufferSize = dev->bufferSize;
+    const uint32_t bufferSize = dev->bufferSize;
 
-    sem_post(&dev->sem);
+    notifierPost(&dev->notifier);
 
     if (dev->hints & kDeviceBuffering)
     {
@@ -272,9 +470,23 @@ static void runDeviceAudioCapture(DeviceAudio* const dev, float* buffers[], cons
         return;
     }
 
+    // capture thread asked us to discard old data, keeping enough for this cycle
+    if (const uint32_t skipRequest = __atomic_exchange_n(&dev->rbSkipRequest, 0, __ATOMIC_SEQ_CST))
+    {
+        const uint32_t rbfill = dev->ringbuffer->getNumReadableSamples();
+
+        if (rbfill > bufferSize)
+        {
+            const uint32_t skip = std::min(skipRequest, rbfill - bufferSize);
+            dev->ringbuffer->skip(skip);
+            dev->stats.droppedFrames += skip;
+        }
+    }
+
     if (dev->ringbuffer->getNumReadableSamples() < bufferSize)
     {
         DEBUGPRINT("%08u | capture | buffer empty, adding kDeviceInitializing|kDeviceStarting|kDeviceBuffering", frame);
+        ++dev->stats.rbFailures;
         clearCaptureBuffers(dev, buffers);
         deviceFailInitHints(dev);
         return;
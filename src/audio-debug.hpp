@@ -0,0 +1,15 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <cstdio>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// log output of the device code, can be defined before including any device source for sending it elsewhere
+#ifndef DEBUGPRINT
+#define DEBUGPRINT(...) { printf(__VA_ARGS__); puts(""); }
+#endif
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,239 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-init.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+// --------------------------------------------------------------------------------------------------------------------
+// known-good hw params, so that reopening a device does not need to go through full negotiation again
+
+static DeviceParamsCacheEntry sParamsCache[AUDIO_BRIDGE_PARAMS_CACHE_SIZE];
+static uint32_t sParamsCacheCount = 0;
+static bool sParamsCacheLoaded = false;
+static pthread_mutex_t sParamsCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// reads the USB vendor:product id of the card used by an ALSA device id, if it is a USB card
+static void getDeviceUsbId(const char* const deviceID, char usbid[16])
+{
+    usbid[0] = '\0';
+
+    const char* card = std::strchr(deviceID, ':');
+    if (card == nullptr)
+        return;
+
+    ++card;
+    if (std::strncmp(card, "CARD=", 5) == 0)
+        card += 5;
+
+    char cardname[64] = {};
+    std::strncpy(cardname, card, sizeof(cardname) - 1);
+    if (char* const sep = std::strchr(cardname, ','))
+        *sep = '\0';
+
+    const int index = snd_card_get_index(cardname);
+    if (index < 0)
+        return;
+
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/asound/card%d/usbid", index);
+
+    if (FILE* const f = std::fopen(path, "r"))
+    {
+        if (std::fscanf(f, "%15s", usbid) != 1)
+            usbid[0] = '\0';
+        std::fclose(f);
+    }
+}
+
+static void getDeviceParamsCacheKey(char key[192],
+                                    const char* const deviceID,
+                                    const bool playback,
+                                    const uint32_t sampleRate,
+                                    const uint32_t bufferSize,
+                                    const DeviceAudioOptions& options)
+{
+    char usbid[16];
+    getDeviceUsbId(deviceID, usbid);
+
+    std::snprintf(key, 192, "%s|%s|%s|%u|%u|%u|%u|%d|%u",
+                  deviceID, usbid[0] != '\0' ? usbid : "-", playback ? "playback" : "capture",
+                  sampleRate, bufferSize, options.periodSize, options.periods, options.nonInterleaved ? 1 : 0,
+                  deviceRequestedChannels(options));
+}
+
+// must be called with the cache mutex locked
+static void loadDeviceParamsCache()
+{
+    if (sParamsCacheLoaded)
+        return;
+
+    sParamsCacheLoaded = true;
+
+    const char* const path = std::getenv("AUDIO_BRIDGE_PARAMS_CACHE");
+    if (path == nullptr || *path == '\0')
+        return;
+
+    FILE* const f = std::fopen(path, "r");
+    if (f == nullptr)
+        return;
+
+    DeviceParamsCacheEntry entry;
+    char line[320];
+    int format, access, keypos;
+
+    // 1 entry per line, with the key last as device ids can contain spaces
+    while (sParamsCacheCount < AUDIO_BRIDGE_PARAMS_CACHE_SIZE && std::fgets(line, sizeof(line), f) != nullptr)
+    {
+        line[std::strcspn(line, "\n")] = '\0';
+
+        // exactly 1 space before the key, which can itself start with spaces
+        if (std::sscanf(line, "%d %d %u %u %u%n",
+                        &format, &access, &entry.periodSize, &entry.periods, &entry.channels, &keypos) != 5)
+            continue;
+        if (line[keypos] != ' ' || line[keypos + 1] == '\0' || std::strlen(line + keypos + 1) >= sizeof(entry.key))
+            continue;
+
+        std::strcpy(entry.key, line + keypos + 1);
+        entry.format = static_cast<snd_pcm_format_t>(format);
+        entry.access = static_cast<snd_pcm_access_t>(access);
+        sParamsCache[sParamsCacheCount++] = entry;
+    }
+
+    std::fclose(f);
+}
+
+// must be called with the cache mutex locked
+static void saveDeviceParamsCache()
+{
+    const char* const path = std::getenv("AUDIO_BRIDGE_PARAMS_CACHE");
+    if (path == nullptr || *path == '\0')
+        return;
+
+    FILE* const f = std::fopen(path, "w");
+    if (f == nullptr)
+    {
+        DEBUGPRINT("failed to write params cache to '%s'", path);
+        return;
+    }
+
+    for (uint32_t i=0; i<sParamsCacheCount; ++i)
+    {
+        const DeviceParamsCacheEntry& entry(sParamsCache[i]);
+
+        // would break the line-based format, such entries are only kept in memory
+        if (std::strchr(entry.key, '\n') != nullptr)
+            continue;
+
+        std::fprintf(f, "%d %d %u %u %u %s\n",
+                     static_cast<int>(entry.format), static_cast<int>(entry.access),
+                     entry.periodSize, entry.periods, entry.channels, entry.key);
+    }
+
+    std::fclose(f);
+}
+
+static bool lookupDeviceParamsCache(const char* const key, DeviceParamsCacheEntry& entry)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&sParamsCacheMutex);
+    loadDeviceParamsCache();
+
+    for (uint32_t i=0; i<sParamsCacheCount; ++i)
+    {
+        if (std::strcmp(sParamsCache[i].key, key) == 0)
+        {
+            entry = sParamsCache[i];
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sParamsCacheMutex);
+    return found;
+}
+
+static void storeDeviceParamsCache(const DeviceParamsCacheEntry& entry)
+{
+    pthread_mutex_lock(&sParamsCacheMutex);
+    loadDeviceParamsCache();
+
+    uint32_t i = 0;
+    for (; i<sParamsCacheCount; ++i)
+    {
+        if (std::strcmp(sParamsCache[i].key, entry.key) == 0)
+            break;
+    }
+
+    // full, drop the oldest entry
+    if (i == AUDIO_BRIDGE_PARAMS_CACHE_SIZE)
+    {
+        std::memmove(sParamsCache, sParamsCache + 1, sizeof(sParamsCache) - sizeof(sParamsCache[0]));
+        i = AUDIO_BRIDGE_PARAMS_CACHE_SIZE - 1;
+    }
+    else if (i == sParamsCacheCount)
+    {
+        ++sParamsCacheCount;
+    }
+
+    sParamsCache[i] = entry;
+    saveDeviceParamsCache();
+
+    pthread_mutex_unlock(&sParamsCacheMutex);
+}
+
+static void removeDeviceParamsCache(const char* const key)
+{
+    pthread_mutex_lock(&sParamsCacheMutex);
+
+    for (uint32_t i=0; i<sParamsCacheCount; ++i)
+    {
+        if (std::strcmp(sParamsCache[i].key, key) == 0)
+        {
+            std::memmove(sParamsCache + i, sParamsCache + i + 1, sizeof(sParamsCache[0]) * (sParamsCacheCount - i - 1));
+            --sParamsCacheCount;
+            saveDeviceParamsCache();
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sParamsCacheMutex);
+}
+
+// applies a cached configuration in one go, returns false if the device does not accept it anymore
+static bool applyDeviceParamsCache(snd_pcm_t* const pcm,
+                                   snd_pcm_hw_params_t* const params,
+                                   const DeviceParamsCacheEntry& entry,
+                                   const uint32_t sampleRate)
+{
+    int err;
+
+    if ((err = snd_pcm_hw_params_any(pcm, params)) < 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_rate_resample(pcm, params, 0)) != 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_access(pcm, params, entry.access)) != 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_format(pcm, params, entry.format)) != 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_rate(pcm, params, sampleRate, 0)) != 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_period_size(pcm, params, entry.periodSize, 0)) != 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_periods(pcm, params, entry.periods, 0)) != 0)
+        return false;
+    if ((err = snd_pcm_hw_params_set_channels(pcm, params, entry.channels)) != 0)
+        return false;
+
+    if ((err = snd_pcm_hw_params(pcm, params)) != 0)
+    {
+        DEBUGPRINT("cached hw params rejected: %s", snd_strerror(err));
+        return false;
+    }
+
+    return true;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -2,14 +2,17 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
+#include "audio-debug.hpp"
 
 //#define ALSA_PCM_NEW_HW_PARAMS_API
 //#define ALSA_PCM_NEW_SW_PARAMS_API
 #include <alsa/asoundlib.h>
+#include <algorithm>
 #include <map>
 #include <cstring>
-
-#define DEBUGPRINT(...) printf(__VA_ARGS__); puts("");
+#include <pthread.h>
+#include <sys/stat.h>
 
 static int nextPowerOfTwo(int size) noexcept
 {
@@ -23,6 +26,69 @@ static int nextPowerOfTwo(int size) noexcept
     return ++size;
 }
 
+// fills buffer sizes and channels of one direction from the device period size and channel ranges
+static bool setDeviceProperties(const bool isOutput,
+                                snd_pcm_uframes_t minSize,
+                                snd_pcm_uframes_t maxSize,
+                                unsigned minChans,
+                                unsigned maxChans,
+                                DeviceProperties& props)
+{
+    minSize = std::max(nextPowerOfTwo(minSize), 32);
+    maxSize = std::min(maxSize, 8192LU);
+
+    std::vector<unsigned> bufsizes;
+    std::map<unsigned,bool> used;
+
+    for (snd_pcm_uframes_t s = minSize; s <= maxSize; s = nextPowerOfTwo(s+1))
+    {
+        if (used.count(s) == 0)
+        {
+            used[s] = true;
+            bufsizes.push_back(s);
+        }
+
+        // do not go above 4096
+        if (s == 4096)
+            break;
+    }
+
+    if (bufsizes.empty())
+    {
+        DEBUGPRINT("bufsizes.empty() fail");
+        return false;
+    }
+
+    if (props.bufsizes.empty())
+    {
+        DEBUGPRINT("props.bufsizes assign");
+        props.bufsizes = bufsizes;
+    }
+    // FIXME
+    else if (props.bufsizes != bufsizes)
+    {
+        DEBUGPRINT("props.bufsizes != bufsizes fail | %u %u", props.bufsizes[0], bufsizes[0]);
+        return false;
+    }
+
+    // put some sane limits, matching the most channels a device can bridge (AUDIO_BRIDGE_MAX_CHANNELS)
+    maxChans = std::min(maxChans, 128U);
+    minChans = std::min(minChans, maxChans);
+
+    if (isOutput)
+    {
+        props.minChansOut = minChans;
+        props.maxChansOut = maxChans;
+    }
+    else
+    {
+        props.minChansIn = minChans;
+        props.maxChansIn = maxChans;
+    }
+
+    return true;
+}
+
 static bool fillDeviceProperties(snd_pcm_t* const pcm,
                                  const bool isOutput,
                                  const unsigned sampleRate,
@@ -44,211 +110,508 @@ static bool fillDeviceProperties(snd_pcm_t* const pcm,
         snd_pcm_hw_params_get_period_size_min(params, &minSize, &dir);
         snd_pcm_hw_params_get_period_size_max(params, &maxSize, &dir);
 
-        minSize = std::max(nextPowerOfTwo(minSize), 32);
-        maxSize = std::min(maxSize, 8192LU);
+        unsigned maxChans, minChans;
+        snd_pcm_hw_params_get_channels_max(params, &maxChans);
+        snd_pcm_hw_params_get_channels_min(params, &minChans);
+
+        return setDeviceProperties(isOutput, minSize, maxSize, minChans, maxChans, props);
+    }
+    else
+    {
+        DEBUGPRINT("snd_pcm_hw_params_any fail");
+    }
+
+    return false;
+}
+
+static bool isdigit(const char* const s)
+{
+    if (const size_t len = std::strlen(s))
+    {
+        for (size_t i=0; i<len; ++i)
+        {
+            if (! std::isdigit(s[i]))
+                return false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// opens the control handle for a card and gets its id and name, skipping cards that should not be used
+static snd_ctl_t* openCard(const int card, char hwcard[32], std::string& cardId, std::string& cardName)
+{
+    snd_ctl_t* ctl = nullptr;
+    snd_ctl_card_info_t* cardinfo = nullptr;
+    snd_ctl_card_info_alloca(&cardinfo);
+
+    std::snprintf(hwcard, 31, "hw:%i", card);
+
+    if (snd_ctl_open(&ctl, hwcard, SND_CTL_NONBLOCK) < 0)
+        return nullptr;
+
+    if (snd_ctl_card_info(ctl, cardinfo) < 0)
+    {
+        snd_ctl_close(ctl);
+        return nullptr;
+    }
 
-        std::vector<unsigned> bufsizes;
-        std::map<unsigned,bool> used;
+    const char* id = snd_ctl_card_info_get_id(cardinfo);
+    const char* name = snd_ctl_card_info_get_name(cardinfo);
 
-        for (snd_pcm_uframes_t s = minSize; s <= maxSize; s = nextPowerOfTwo(s+1))
+   #ifdef __MOD_DEVICES__
+    if (name != nullptr && *name != '\0')
+    {
+        if (std::strcmp(name, "MOD DUO") == 0 ||
+            std::strcmp(name, "MOD DUOX") == 0 ||
+            std::strcmp(name, "MOD DWARF") == 0 ||
+            std::strcmp(name, "USB Gadget") == 0 ||
+            std::strcmp(name, "UAC2_Gadget") == 0)
         {
-            if (snd_pcm_hw_params_test_period_size(pcm, params, minSize, dir) == 0)
+            snd_ctl_close(ctl);
+            return nullptr;
+        }
+    }
+   #endif
+
+    if (id == nullptr || isdigit(id))
+        cardId = std::to_string(card);
+    else
+        cardId = id;
+
+    if (name == nullptr || *name == '\0')
+        cardName = cardId;
+    else
+        cardName = name;
+
+    return ctl;
+}
+
+static void enumerateCardDevices(snd_ctl_t* const ctl,
+                                 const char* const hwcard,
+                                 const std::string& cardName,
+                                 std::vector<DeviceID>& inputs,
+                                 std::vector<DeviceID>& outputs)
+{
+    int device = -1;
+
+    snd_pcm_info_t* pcminfo;
+    snd_pcm_info_alloca(&pcminfo);
+
+    for (;;)
+    {
+        if (snd_ctl_pcm_next_device(ctl, &device) < 0 || device < 0)
+            break;
+
+        snd_pcm_info_set_device(pcminfo, device);
+
+        for (int subDevice = 0, nbSubDevice = 1; subDevice < nbSubDevice; ++subDevice)
+        {
+            snd_pcm_info_set_subdevice(pcminfo, subDevice);
+
+            snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_CAPTURE);
+            const bool isInput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
+
+            snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_PLAYBACK);
+            const bool isOutput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
+
+            if (! (isInput || isOutput))
+                continue;
+
+            if (nbSubDevice == 1)
+                nbSubDevice = snd_pcm_info_get_subdevices_count(pcminfo);
+
+            std::string strid(hwcard);
+            std::string strname(cardName);
+
+            strid += ",";
+            strid += std::to_string(device);
+
+            if (const char* const pcmName = snd_pcm_info_get_name(pcminfo))
             {
-                if (used.count(s) == 0)
+                if (pcmName[0] != '\0')
                 {
-                    used[s] = true;
-                    bufsizes.push_back(s);
+                    strname += ", ";
+                    strname += pcmName;
                 }
             }
 
-            // do not go above 4096
-            if (s == 4096)
-                break;
-        }
+            if (nbSubDevice != 1)
+            {
+                strid += ",";
+                strid += std::to_string(subDevice);
+                strname += " {";
+                strname += snd_pcm_info_get_subdevice_name(pcminfo);
+                strname += "}";
+            }
 
-        if (bufsizes.empty())
-        {
-            DEBUGPRINT("bufsizes.empty() fail");
-            return false;
-        }
+            if (isInput)
+                inputs.push_back({ strid, strname });
 
-        if (props.bufsizes.empty())
-        {
-            DEBUGPRINT("props.bufsizes assign");
-            props.bufsizes = bufsizes;
+            if (isOutput)
+                outputs.push_back({ strid, strname });
         }
-        // FIXME
-        else if (props.bufsizes != bufsizes)
+    }
+}
+
+bool enumerateSoundcards(std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs)
+{
+    int card = -1;
+    char hwcard[32] = {};
+    std::string cardId, cardName;
+
+    while (inputs.size() + outputs.size() <= 64)
+    {
+        if (snd_card_next(&card) != 0 || card < 0)
+            break;
+
+        if (snd_ctl_t* const ctl = openCard(card, hwcard, cardId, cardName))
         {
-            DEBUGPRINT("props.bufsizes != bufsizes fail | %u %u", props.bufsizes[0], bufsizes[0]);
-            return false;
+            enumerateCardDevices(ctl, hwcard, cardName, inputs, outputs);
+            snd_ctl_close(ctl);
         }
+    }
 
-        unsigned maxChans, minChans;
-        snd_pcm_hw_params_get_channels_max(params, &maxChans);
-        snd_pcm_hw_params_get_channels_min(params, &minChans);
+    return inputs.size() + outputs.size() != 0;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+struct IndexedCard {
+    int card;
+    // card id, long name, USB ids and control node creation time,
+    // so that another unit of the same model plugged into the same slot gets indexed again
+    std::string identity;
+    std::vector<DeviceIndexEntry> inputs;
+    std::vector<DeviceIndexEntry> outputs;
+};
+
+static std::vector<IndexedCard> sIndex;
+static pthread_mutex_t sIndexMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// hotplug generations the index was last refreshed at
+static uint32_t sIndexGenerations[2] = {};
+static bool sIndexValid = false;
+
+static constexpr const unsigned kRatesToProbe[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+
+static uint64_t getTimeMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static std::string getCardIdentity(const int card, snd_ctl_t* const ctl, const std::string& cardId)
+{
+    std::string identity(cardId);
 
-        // put some sane limits
-        maxChans = std::min(maxChans, 32U);
-        minChans = std::min(minChans, maxChans);
+    snd_ctl_card_info_t* cardinfo;
+    snd_ctl_card_info_alloca(&cardinfo);
 
-        if (isOutput)
+    if (snd_ctl_card_info(ctl, cardinfo) >= 0)
+    {
+        if (const char* const longname = snd_ctl_card_info_get_longname(cardinfo))
         {
-            props.minChansOut = minChans;
-            props.maxChansOut = maxChans;
+            identity += "|";
+            identity += longname;
         }
-        else
+    }
+
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/asound/card%d/usbid", card);
+
+    if (FILE* const f = std::fopen(path, "r"))
+    {
+        char usbid[16];
+        if (std::fscanf(f, "%15s", usbid) == 1)
         {
-            props.minChansIn = minChans;
-            props.maxChansIn = maxChans;
+            identity += "|";
+            identity += usbid;
         }
-
-        return true;
+        std::fclose(f);
     }
-    else
+
+    // the control node is created again whenever the card is, even when everything else matches
+    std::snprintf(path, sizeof(path), "/dev/snd/controlC%d", card);
+
+    struct stat st;
+    if (stat(path, &st) == 0)
     {
-        DEBUGPRINT("snd_pcm_hw_params_any fail");
+        identity += "|";
+        identity += std::to_string(st.st_ctim.tv_sec);
+        identity += ".";
+        identity += std::to_string(st.st_ctim.tv_nsec);
     }
 
-    return false;
+    return identity;
 }
 
-static bool isdigit(const char* const s)
+static void probeCapabilities(const std::string& deviceID, const bool playback, DeviceCapabilities& caps)
 {
-    if (const size_t len = std::strlen(s))
+    snd_pcm_t* pcm;
+    if (snd_pcm_open(&pcm, deviceID.c_str(), playback ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE,
+                     SND_PCM_NONBLOCK|SND_PCM_NO_AUTO_RESAMPLE|SND_PCM_NO_AUTO_CHANNELS|SND_PCM_NO_AUTO_FORMAT) < 0)
+        return;
+
+    snd_pcm_hw_params_t* params;
+    snd_pcm_hw_params_alloca(&params);
+
+    if (snd_pcm_hw_params_any(pcm, params) >= 0)
     {
-        for (size_t i=0; i<len; ++i)
+        caps.formats = 0;
+        if (snd_pcm_hw_params_test_format(pcm, params, SND_PCM_FORMAT_S16) == 0)
+            caps.formats |= kDeviceCapsS16;
+        if (snd_pcm_hw_params_test_format(pcm, params, SND_PCM_FORMAT_S24) == 0)
+            caps.formats |= kDeviceCapsS24;
+        if (snd_pcm_hw_params_test_format(pcm, params, SND_PCM_FORMAT_S24_3LE) == 0)
+            caps.formats |= kDeviceCapsS24LE3;
+        if (snd_pcm_hw_params_test_format(pcm, params, SND_PCM_FORMAT_S32) == 0)
+            caps.formats |= kDeviceCapsS32;
+
+        caps.rates.clear();
+        caps.unsupportedRates.clear();
+        for (unsigned rate : kRatesToProbe)
         {
-            if (! std::isdigit(s[i]))
-                return false;
+            if (snd_pcm_hw_params_test_rate(pcm, params, rate, 0) == 0)
+                caps.rates.push_back(rate);
+            else
+                caps.unsupportedRates.push_back(rate);
         }
 
-        return true;
+        int dir = 0;
+        snd_pcm_uframes_t minSize = 0, maxSize = 0;
+        snd_pcm_hw_params_get_period_size_min(params, &minSize, &dir);
+        snd_pcm_hw_params_get_period_size_max(params, &maxSize, &dir);
+        caps.minPeriodSize = minSize;
+        caps.maxPeriodSize = maxSize;
+
+        snd_pcm_hw_params_get_channels_min(params, &caps.minChannels);
+        snd_pcm_hw_params_get_channels_max(params, &caps.maxChannels);
+
+        caps.probed = true;
     }
 
-    return false;
+    snd_pcm_close(pcm);
 }
 
-bool enumerateSoundcards(std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs)
+// probes a device if not done yet, devices that are busy are only tried again after a while
+static void probeEntry(DeviceIndexEntry& entry, const bool playback)
 {
-    snd_ctl_t* ctl = nullptr;
-    snd_ctl_card_info_t* cardinfo = nullptr;
-    snd_ctl_card_info_alloca(&cardinfo);
+    if (entry.caps.probed)
+        return;
+
+    const uint64_t now = getTimeMs();
+
+    if (entry.lastProbeTime != 0 && now - entry.lastProbeTime < AUDIO_BRIDGE_HOTPLUG_FALLBACK_MS)
+        return;
+
+    entry.lastProbeTime = now;
+    probeCapabilities(entry.device.id, playback, entry.caps);
+}
+
+// checks a rate against the probed capabilities, rates outside the common ones are tested once and remembered
+static bool supportsRate(DeviceIndexEntry& entry, const bool playback, const unsigned sampleRate)
+{
+    DeviceCapabilities& caps(entry.caps);
+
+    if (std::find(caps.rates.begin(), caps.rates.end(), sampleRate) != caps.rates.end())
+        return true;
+    if (std::find(caps.unsupportedRates.begin(), caps.unsupportedRates.end(), sampleRate) != caps.unsupportedRates.end())
+        return false;
+
+    snd_pcm_t* pcm;
+
+    // busy, try again next time
+    if (snd_pcm_open(&pcm, entry.device.id.c_str(),
+                     playback ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE,
+                     SND_PCM_NONBLOCK|SND_PCM_NO_AUTO_RESAMPLE) < 0)
+        return false;
+
+    snd_pcm_hw_params_t* params;
+    snd_pcm_hw_params_alloca(&params);
+    const bool supported = snd_pcm_hw_params_any(pcm, params) >= 0
+                        && snd_pcm_hw_params_test_rate(pcm, params, sampleRate, 0) == 0;
+    snd_pcm_close(pcm);
+
+    (supported ? caps.rates : caps.unsupportedRates).push_back(sampleRate);
+    return supported;
+}
+
+// higher is better, prefer the widest native format so no precision is lost
+static int getFormatRank(const unsigned formats)
+{
+    return formats & kDeviceCapsS32 ? 4 :
+           formats & kDeviceCapsS24 ? 3 :
+           formats & kDeviceCapsS24LE3 ? 2 :
+           formats & kDeviceCapsS16 ? 1 :
+           0;
+}
+
+// must be called with the index mutex locked.
+// cards are only enumerated again after hotplug events, or on every call if those are not available
+static void refreshIndex()
+{
+    const uint32_t generations[2] = { hotplugMonitorGetGeneration(false), hotplugMonitorGetGeneration(true) };
+
+    if (sIndexValid && hotplugMonitorIsActive() &&
+        generations[0] == sIndexGenerations[0] && generations[1] == sIndexGenerations[1])
+        return;
+
+    sIndexGenerations[0] = generations[0];
+    sIndexGenerations[1] = generations[1];
+    sIndexValid = true;
+
+    std::vector<IndexedCard> index;
 
     int card = -1;
     char hwcard[32] = {};
-    char reserve[32] = {};
+    std::string cardId, cardName;
 
-    while (inputs.size() + outputs.size() <= 64)
+    while (index.size() <= 32)
     {
         if (snd_card_next(&card) != 0 || card < 0)
             break;
 
-        std::snprintf(hwcard, sizeof(hwcard) - 1, "hw:%i", card);
-
-        if (snd_ctl_open(&ctl, hwcard, SND_CTL_NONBLOCK) < 0)
+        snd_ctl_t* const ctl = openCard(card, hwcard, cardId, cardName);
+        if (ctl == nullptr)
             continue;
 
-        if (snd_ctl_card_info(ctl, cardinfo) >= 0)
+        const std::string identity(getCardIdentity(card, ctl, cardId));
+
+        // reuse cached info if the very same card is still in the same slot
+        bool cached = false;
+        for (IndexedCard& old : sIndex)
         {
-            const char* cardId = snd_ctl_card_info_get_id(cardinfo);
-            const char* cardName = snd_ctl_card_info_get_name(cardinfo);
+            if (old.card == card && old.identity == identity)
+            {
+                index.push_back(std::move(old));
+                cached = true;
+                break;
+            }
+        }
+
+        if (! cached)
+        {
+            DEBUGPRINT("discovery | indexing new card %s, %s", hwcard, cardName.c_str());
+
+            std::vector<DeviceID> inputs, outputs;
+            enumerateCardDevices(ctl, hwcard, cardName, inputs, outputs);
+
+            IndexedCard indexed;
+            indexed.card = card;
+            indexed.identity = identity;
 
-           #ifdef __MOD_DEVICES__
-            if (cardName != nullptr && *cardName != '\0')
+            for (const DeviceID& device : inputs)
             {
-                if (std::strcmp(cardName, "MOD DUO") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "MOD DUOX") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "MOD DWARF") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "USB Gadget") == 0)
-                    goto skip;
-                if (std::strcmp(cardName, "UAC2_Gadget") == 0)
-                    goto skip;
+                DeviceIndexEntry entry;
+                entry.device = device;
+                entry.card = card;
+                indexed.inputs.push_back(entry);
             }
-           #endif
 
-            if (cardId == nullptr || isdigit(cardId))
+            for (const DeviceID& device : outputs)
             {
-                std::snprintf(reserve, sizeof(reserve) - 1, "%i", card);
-                cardId = reserve;
+                DeviceIndexEntry entry;
+                entry.device = device;
+                entry.card = card;
+                indexed.outputs.push_back(entry);
             }
 
-            if (cardName == nullptr || *cardName == '\0')
-                cardName = cardId;
+            index.push_back(std::move(indexed));
+        }
 
-            int device = -1;
+        snd_ctl_close(ctl);
+    }
 
-            snd_pcm_info_t* pcminfo;
-            snd_pcm_info_alloca(&pcminfo);
+    sIndex.swap(index);
+}
 
-            for (;;)
-            {
-                if (snd_ctl_pcm_next_device(ctl, &device) < 0 || device < 0)
-                    break;
+// must be called with the index mutex locked
+static DeviceIndexEntry* findIndexEntry(const std::string& deviceID, const bool playback)
+{
+    for (IndexedCard& card : sIndex)
+    {
+        for (DeviceIndexEntry& entry : playback ? card.outputs : card.inputs)
+        {
+            if (entry.device.id == deviceID)
+                return &entry;
+        }
+    }
 
-                snd_pcm_info_set_device(pcminfo, device);
+    return nullptr;
+}
 
-                for (int subDevice = 0, nbSubDevice = 1; subDevice < nbSubDevice; ++subDevice)
-                {
-                    snd_pcm_info_set_subdevice(pcminfo, subDevice);
+bool getRankedSoundcards(const bool playback, const unsigned sampleRate, std::vector<DeviceIndexEntry>& devices)
+{
+    devices.clear();
 
-                    snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_CAPTURE);
-                    const bool isInput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
+    pthread_mutex_lock(&sIndexMutex);
+    refreshIndex();
 
-                    snd_pcm_info_set_stream(pcminfo, SND_PCM_STREAM_PLAYBACK);
-                    const bool isOutput = (snd_ctl_pcm_info(ctl, pcminfo) >= 0);
+    for (IndexedCard& card : sIndex)
+    {
+        for (DeviceIndexEntry& entry : playback ? card.outputs : card.inputs)
+        {
+            probeEntry(entry, playback);
 
-                    if (! (isInput || isOutput))
-                        continue;
+            if (entry.caps.probed && ! supportsRate(entry, playback, sampleRate))
+                continue;
 
-                    if (nbSubDevice == 1)
-                        nbSubDevice = snd_pcm_info_get_subdevices_count(pcminfo);
+            devices.push_back(entry);
+        }
+    }
 
-                    std::string strid(hwcard);
-                    std::string strname(cardName);
+    pthread_mutex_unlock(&sIndexMutex);
 
-                    strid += ",";
-                    strid += std::to_string(device);
+    // probed first, then lowest latency, then widest native format, then the most recently added card
+    std::stable_sort(devices.begin(), devices.end(), [](const DeviceIndexEntry& a, const DeviceIndexEntry& b) {
+        if (a.caps.probed != b.caps.probed)
+            return a.caps.probed;
+        if (a.caps.minPeriodSize != b.caps.minPeriodSize)
+            return a.caps.minPeriodSize < b.caps.minPeriodSize;
+        if (getFormatRank(a.caps.formats) != getFormatRank(b.caps.formats))
+            return getFormatRank(a.caps.formats) > getFormatRank(b.caps.formats);
+        return a.card > b.card;
+    });
 
-                    if (const char* const pcmName = snd_pcm_info_get_name(pcminfo))
-                    {
-                        if (pcmName[0] != '\0')
-                        {
-                            strname += ", ";
-                            strname += pcmName;
-                        }
-                    }
+    return ! devices.empty();
+}
 
-                    if (nbSubDevice != 1)
-                    {
-                        strid += ",";
-                        strid += std::to_string(subDevice);
-                        strname += " {";
-                        strname += snd_pcm_info_get_subdevice_name(pcminfo);
-                        strname += "}";
-                    }
+// fills properties of one direction from the index, without opening the device.
+// returns -1 if the device is not part of the index or could not be probed yet
+static int getIndexedDeviceProperties(const std::string& deviceID,
+                                      const bool isOutput,
+                                      const unsigned sampleRate,
+                                      DeviceProperties& props)
+{
+    int ret = -1;
 
-                    if (isInput)
-                        inputs.push_back({ strid, strname });
+    pthread_mutex_lock(&sIndexMutex);
+    refreshIndex();
 
-                    if (isOutput)
-                        outputs.push_back({ strid, strname });
-                }
-            }
-        }
+    if (DeviceIndexEntry* const entry = findIndexEntry(deviceID, isOutput))
+    {
+        probeEntry(*entry, isOutput);
 
-   #ifdef __MOD_DEVICES__
-    skip:
-        snd_ctl_close(ctl);
-   #endif
+        if (entry->caps.probed)
+        {
+            const DeviceCapabilities& caps(entry->caps);
+
+            ret = supportsRate(*entry, isOutput, sampleRate) &&
+                  setDeviceProperties(isOutput, caps.minPeriodSize, caps.maxPeriodSize,
+                                      caps.minChannels, caps.maxChannels, props) ? 1 : 0;
+        }
     }
 
-    return inputs.size() + outputs.size() != 0;
+    pthread_mutex_unlock(&sIndexMutex);
+    return ret;
 }
 
+// --------------------------------------------------------------------------------------------------------------------
+
 bool getDeviceProperties(const std::string& deviceID,
                          const bool checkInput,
                          const bool checkOutput,
@@ -266,7 +629,14 @@ bool getDeviceProperties(const std::string& deviceID,
 
     bool ok = true;
 
-    if (checkOutput)
+    // devices known to the index are not opened again
+    int indexed = checkOutput ? getIndexedDeviceProperties(deviceID, true, sampleRate, props) : -1;
+
+    if (indexed >= 0)
+    {
+        ok = indexed != 0;
+    }
+    else if (checkOutput)
     {
         snd_pcm_t* pcm;
 
@@ -282,7 +652,13 @@ bool getDeviceProperties(const std::string& deviceID,
         }
     }
 
-    if (ok && checkInput)
+    indexed = ok && checkInput ? getIndexedDeviceProperties(deviceID, false, sampleRate, props) : -1;
+
+    if (indexed >= 0)
+    {
+        ok = indexed != 0;
+    }
+    else if (ok && checkInput)
     {
         snd_pcm_t* pcm;
 
@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -19,8 +20,45 @@ struct DeviceProperties {
     std::vector<unsigned> bufsizes;
 };
 
+enum DeviceCapsFormat {
+    kDeviceCapsS16 = 0x1,
+    kDeviceCapsS24 = 0x2,
+    kDeviceCapsS24LE3 = 0x4,
+    kDeviceCapsS32 = 0x8,
+};
+
+struct DeviceCapabilities {
+    // false if the device could not be opened for probing yet (e.g. busy), all other fields are unset then
+    bool probed = false;
+    // mask of DeviceCapsFormat
+    unsigned formats = 0;
+    // supported rates out of the common ones (44.1k up to 192k), plus any others tested since
+    std::vector<unsigned> rates;
+    // rates tested and not supported, so they are not tested again
+    std::vector<unsigned> unsupportedRates;
+    unsigned minPeriodSize = 0;
+    unsigned maxPeriodSize = 0;
+    unsigned minChannels = 0;
+    unsigned maxChannels = 0;
+};
+
+struct DeviceIndexEntry {
+    DeviceID device;
+    int card = -1;
+    DeviceCapabilities caps;
+    // CLOCK_MONOTONIC milliseconds of the last probe attempt, busy devices are only probed again after a while
+    uint64_t lastProbeTime = 0;
+};
+
 bool enumerateSoundcards(std::vector<DeviceID>& inputs, std::vector<DeviceID>& outputs);
 
+// Cached index of soundcards and their capabilities.
+// Cards are only enumerated again after hotplug events (on every call without a running hotplug monitor),
+// and then only cards that are new or were replugged get probed, known cards are reused as-is.
+// Devices are ranked by lowest achievable latency and then by native format, best candidate first.
+// Devices that do not support the requested sample rate are left out.
+bool getRankedSoundcards(bool playback, unsigned sampleRate, std::vector<DeviceIndexEntry>& devices);
+
 bool getDeviceProperties(const std::string& deviceID,
                          bool checkInput,
                          bool checkOutput,
@@ -0,0 +1,255 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-hotplug.hpp"
+#include "audio-debug.hpp"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static pthread_mutex_t sMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sThread = {};
+static uint32_t sRefCount = 0;
+static int sInotifyFd = -1;
+static int sStopFd = -1;
+static bool sActive = false;
+
+// indexed by playback, 0 for capture and 1 for playback
+static int32_t sGenerations[2] = {};
+
+// separate from sMutex, which is held while joining the monitor thread
+static pthread_mutex_t sListenersMutex = PTHREAD_MUTEX_INITIALIZER;
+static Notifier* sListeners[AUDIO_BRIDGE_HOTPLUG_MAX_LISTENERS] = {};
+static uint32_t sNumListeners = 0;
+
+static void postListeners()
+{
+    pthread_mutex_lock(&sListenersMutex);
+
+    for (uint32_t i=0; i<sNumListeners; ++i)
+        notifierPost(sListeners[i]);
+
+    pthread_mutex_unlock(&sListenersMutex);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void bumpGeneration(const bool playback)
+{
+    int32_t* const generation = &sGenerations[playback ? 1 : 0];
+    __atomic_add_fetch(generation, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, generation, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    postListeners();
+}
+
+static void handleEvent(const struct inotify_event* const event, int& sndWatch)
+{
+    if (event->len == 0)
+        return;
+
+    // "/dev/snd" itself was created, happens when the first soundcard appears
+    if (event->wd != sndWatch)
+    {
+        if (std::strcmp(event->name, "snd") == 0 && (event->mask & IN_CREATE) != 0)
+        {
+            sndWatch = inotify_add_watch(sInotifyFd, "/dev/snd", IN_CREATE|IN_DELETE|IN_ATTRIB);
+            bumpGeneration(false);
+            bumpGeneration(true);
+        }
+        return;
+    }
+
+    // we only care about pcm nodes, named like pcmC0D0p or pcmC0D0c
+    int card, device;
+    char direction;
+    if (std::sscanf(event->name, "pcmC%dD%d%c", &card, &device, &direction) != 3)
+        return;
+
+    DEBUGPRINT("hotplug | %s %s", event->name,
+               event->mask & IN_CREATE ? "created" : event->mask & IN_DELETE ? "removed" : "changed");
+
+    bumpGeneration(direction == 'p');
+}
+
+static void* hotplugThread(void*)
+{
+    const int devWatch = inotify_add_watch(sInotifyFd, "/dev", IN_CREATE);
+    int sndWatch = inotify_add_watch(sInotifyFd, "/dev/snd", IN_CREATE|IN_DELETE|IN_ATTRIB);
+
+    if (devWatch < 0 && sndWatch < 0)
+    {
+        DEBUGPRINT("hotplug | failed to watch /dev/snd, falling back to polling");
+        __atomic_store_n(&sActive, false, __ATOMIC_SEQ_CST);
+        return nullptr;
+    }
+
+    // large enough for several events at once
+    alignas(struct inotify_event) char buffer[4096];
+
+    struct pollfd fds[2] = {
+        { sInotifyFd, POLLIN, 0 },
+        { sStopFd, POLLIN, 0 },
+    };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+            continue;
+
+        if (fds[1].revents != 0)
+            break;
+
+        if ((fds[0].revents & POLLIN) == 0)
+            continue;
+
+        const ssize_t len = read(sInotifyFd, buffer, sizeof(buffer));
+        if (len <= 0)
+            continue;
+
+        for (ssize_t offset = 0; offset < len;)
+        {
+            const struct inotify_event* const event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+            handleEvent(event, sndWatch);
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return nullptr;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+bool hotplugMonitorInit()
+{
+    pthread_mutex_lock(&sMutex);
+
+    if (sRefCount++ == 0)
+    {
+        sInotifyFd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        sStopFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+        if (sInotifyFd >= 0 && sStopFd >= 0)
+        {
+            sActive = true;
+
+            if (pthread_create(&sThread, nullptr, hotplugThread, nullptr) != 0)
+                sActive = false;
+        }
+
+        if (! sActive)
+        {
+            DEBUGPRINT("hotplug | monitor not available, falling back to polling");
+        }
+    }
+
+    const bool active = sActive;
+    pthread_mutex_unlock(&sMutex);
+
+    return active;
+}
+
+void hotplugMonitorClose()
+{
+    pthread_mutex_lock(&sMutex);
+
+    if (sRefCount != 0 && --sRefCount == 0)
+    {
+        if (sThread != 0)
+        {
+            const uint64_t value = 1;
+            if (write(sStopFd, &value, sizeof(value)) == sizeof(value))
+                pthread_join(sThread, nullptr);
+            sThread = {};
+        }
+
+        if (sInotifyFd >= 0)
+            close(sInotifyFd);
+        if (sStopFd >= 0)
+            close(sStopFd);
+
+        sInotifyFd = sStopFd = -1;
+        sActive = false;
+    }
+
+    pthread_mutex_unlock(&sMutex);
+}
+
+bool hotplugMonitorIsActive()
+{
+    return __atomic_load_n(&sActive, __ATOMIC_SEQ_CST);
+}
+
+uint32_t hotplugMonitorGetGeneration(const bool playback)
+{
+    return static_cast<uint32_t>(__atomic_load_n(&sGenerations[playback ? 1 : 0], __ATOMIC_SEQ_CST));
+}
+
+bool hotplugMonitorWait(const bool playback, const uint32_t generation, uint32_t timeoutMs)
+{
+    if (! hotplugMonitorIsActive())
+    {
+        if (timeoutMs > AUDIO_BRIDGE_HOTPLUG_POLL_MS)
+            timeoutMs = AUDIO_BRIDGE_HOTPLUG_POLL_MS;
+
+        usleep(timeoutMs * 1000);
+        return hotplugMonitorGetGeneration(playback) != generation;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+
+    int32_t* const value = &sGenerations[playback ? 1 : 0];
+    syscall(SYS_futex, value, FUTEX_WAIT_PRIVATE, static_cast<int32_t>(generation), &ts, nullptr, 0);
+
+    return hotplugMonitorGetGeneration(playback) != generation;
+}
+
+void hotplugMonitorWakeAll()
+{
+    syscall(SYS_futex, &sGenerations[0], FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    syscall(SYS_futex, &sGenerations[1], FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    postListeners();
+}
+
+bool hotplugMonitorAddListener(Notifier* const notifier)
+{
+    pthread_mutex_lock(&sListenersMutex);
+
+    const bool ok = sNumListeners < AUDIO_BRIDGE_HOTPLUG_MAX_LISTENERS;
+    if (ok)
+        sListeners[sNumListeners++] = notifier;
+
+    pthread_mutex_unlock(&sListenersMutex);
+    return ok;
+}
+
+void hotplugMonitorRemoveListener(Notifier* const notifier)
+{
+    pthread_mutex_lock(&sListenersMutex);
+
+    for (uint32_t i=0; i<sNumListeners; ++i)
+    {
+        if (sListeners[i] == notifier)
+        {
+            sListeners[i] = sListeners[--sNumListeners];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sListenersMutex);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
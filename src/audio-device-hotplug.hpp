@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include "audio-notifier.hpp"
+
+// how long to wait between device open attempts when hotplug monitoring is not available
+#define AUDIO_BRIDGE_HOTPLUG_POLL_MS 250
+
+// how long to wait for hotplug events before retrying anyway, in case some event was missed
+#define AUDIO_BRIDGE_HOTPLUG_FALLBACK_MS 10000
+
+// maximum number of notifiers that can listen for hotplug events at once
+#define AUDIO_BRIDGE_HOTPLUG_MAX_LISTENERS 16
+
+// Process-wide monitor for ALSA PCM device nodes appearing, disappearing or changing permissions.
+// It is shared by all users in the same process and reference counted.
+// Each direction keeps a generation counter that increments on every matching event,
+// so users only need to retry opening devices when the counter changes.
+
+// starts the monitor on first use, returns false if hotplug events are not available
+bool hotplugMonitorInit();
+
+// stops the monitor after its last user is gone
+void hotplugMonitorClose();
+
+// returns true if the monitor is running and generation counters are being updated
+bool hotplugMonitorIsActive();
+
+// current generation counter for playback or capture devices, safe to call from realtime threads
+uint32_t hotplugMonitorGetGeneration(bool playback);
+
+// waits until the generation counter differs from `generation`, for up to `timeoutMs`
+// falls back to a plain sleep of up to AUDIO_BRIDGE_HOTPLUG_POLL_MS if the monitor is not active
+// returns true if the generation changed
+bool hotplugMonitorWait(bool playback, uint32_t generation, uint32_t timeoutMs);
+
+// wakes up all waiters and listeners without changing the generation counters,
+// used for shutting down and for host setting changes
+void hotplugMonitorWakeAll();
+
+// registers a notifier to be posted on every hotplug event (of any direction) and on hotplugMonitorWakeAll.
+// for users that need to wait on their own events too, as the notifier can also be posted from elsewhere
+// (including realtime threads). returns false if there are too many listeners already
+bool hotplugMonitorAddListener(Notifier* notifier);
+void hotplugMonitorRemoveListener(Notifier* notifier);
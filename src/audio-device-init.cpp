@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-init.hpp"
+#include "audio-utils.hpp"
 
 #include <algorithm>
 #include <cmath>
@@ -10,16 +11,69 @@
 // --------------------------------------------------------------------------------------------------------------------
 
 // private
+struct DeviceRecovery {
+    uint64_t lastTime;
+    uint32_t count;
+};
+
+// result of a single device thread iteration
+enum DeviceThreadStep {
+    // more work might be available right away
+    kDeviceStepAgain,
+    // nothing to do until the next host cycle or device period.
+    // pooled devices also get this instead of blocking, the step then resumes where it was on the next call
+    kDeviceStepWait,
+    // device closed or failed, stop the thread
+    kDeviceStepClose,
+};
+
 static void deviceFailInitHints(DeviceAudio* dev);
+static bool deviceRecoverInPlace(DeviceAudio* dev, DeviceRecovery& recovery, int err);
+static uint32_t getRingBufferFillTarget(const DeviceAudio* dev);
 static void deviceTimedWait(DeviceAudio* dev);
+static bool deviceNonBlockingSteps(const DeviceAudio* dev);
+static void deviceMeasureLatency(DeviceAudio* dev, double resamplerDelay);
+static snd_pcm_sframes_t deviceReadRaw(DeviceAudio* dev, uint32_t offset, uint32_t frames);
+static snd_pcm_sframes_t deviceWriteRaw(DeviceAudio* dev, uint32_t offset, uint32_t frames);
+static void deviceClearRaw(DeviceAudio* dev, uint32_t frames);
+static void deviceRawToFloat(DeviceAudio* dev, uint32_t frames);
+static void deviceFloatToRaw(DeviceAudio* dev, uint32_t frames);
+static bool deviceCreateThread(DeviceAudio* dev, void* (*threadCall)(void*));
+static void deviceThreadInit(DeviceAudio* dev);
 static void* deviceCaptureThread(void* arg);
 static void* devicePlaybackThread(void* arg);
+static void* deviceDuplexThread(void* arg);
+static bool devicePoolAdd(DeviceAudio* dev);
+static void devicePoolRemove(DeviceAudio* dev);
+static bool devicePoolIsRunning(const DeviceAudio* dev);
+static bool deviceSyncSupported(const DeviceAudio* dev);
+static bool deviceSyncWait(DeviceAudio* dev);
+static bool runDeviceAudioSync(DeviceAudio* dev, float* buffers[]);
 static void runDeviceAudioPlayback(DeviceAudio* dev, float* buffers[], uint32_t frame);
 static void runDeviceAudioCapture(DeviceAudio* dev, float* buffers[], uint32_t frame);
+static void clearCaptureBuffers(DeviceAudio* dev, float* buffers[]);
 
 // TODO cleanup, see what is needed
 static int xrun_recovery(snd_pcm_t *handle, int err);
 
+// known-good hw params for a device, see audio-device-cache.cpp
+struct DeviceParamsCacheEntry {
+    char key[192];
+    snd_pcm_format_t format;
+    snd_pcm_access_t access;
+    uint32_t periodSize;
+    uint32_t periods;
+    uint32_t channels;
+};
+
+static void getDeviceParamsCacheKey(char key[192], const char* deviceID, bool playback,
+                                    uint32_t sampleRate, uint32_t bufferSize, const DeviceAudioOptions& options);
+static bool lookupDeviceParamsCache(const char* key, DeviceParamsCacheEntry& entry);
+static void storeDeviceParamsCache(const DeviceParamsCacheEntry& entry);
+static void removeDeviceParamsCache(const char* key);
+static bool applyDeviceParamsCache(snd_pcm_t* pcm, snd_pcm_hw_params_t* params,
+                                   const DeviceParamsCacheEntry& entry, uint32_t sampleRate);
+
 // --------------------------------------------------------------------------------------------------------------------
 
 static constexpr const snd_pcm_format_t kFormatsToTry[] = {
@@ -31,6 +85,32 @@ static constexpr const snd_pcm_format_t kFormatsToTry[] = {
 
 static constexpr const unsigned kPeriodsToTry[] = { 3, 4 };
 
+static uint32_t getHintsFromFormat(const snd_pcm_format_t format)
+{
+    switch (format)
+    {
+    case SND_PCM_FORMAT_S16:
+        return kDeviceSample16;
+    case SND_PCM_FORMAT_S24:
+        return kDeviceSample24;
+    case SND_PCM_FORMAT_S24_3LE:
+        return kDeviceSample24LE3;
+    case SND_PCM_FORMAT_S32:
+        return kDeviceSample32;
+    default:
+        return 0;
+    }
+}
+
+static snd_pcm_format_t getFormatFromHints(const uint32_t hints)
+{
+    return hints & kDeviceSample16 ? SND_PCM_FORMAT_S16 :
+           hints & kDeviceSample24 ? SND_PCM_FORMAT_S24 :
+           hints & kDeviceSample24LE3 ? SND_PCM_FORMAT_S24_3LE :
+           hints & kDeviceSample32 ? SND_PCM_FORMAT_S32 :
+           SND_PCM_FORMAT_UNKNOWN;
+}
+
 // --------------------------------------------------------------------------------------------------------------------
 
 static const char* SND_PCM_FORMAT_STRING(const snd_pcm_format_t format)
@@ -105,7 +185,7 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
     // if ((count % 200) == 0)
     {
         // count = 1;
-        printf("stream recovery: %s\n", snd_strerror(err));
+        DEBUGPRINT("stream recovery: %s", snd_strerror(err));
     }
 
     if (err == -EPIPE)
@@ -113,7 +193,7 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
         /* under-run */
         err = snd_pcm_prepare(handle);
         if (err < 0)
-            printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
+            DEBUGPRINT("Can't recovery from underrun, prepare failed: %s", snd_strerror(err));
         return 0;
     }
     else if (err == -ESTRPIPE)
@@ -121,60 +201,870 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
         while ((err = snd_pcm_resume(handle)) == -EAGAIN)
             sleep(1);   /* wait until the suspend flag is released */
 
-        if (err < 0)
-        {
-            err = snd_pcm_prepare(handle);
-            if (err < 0)
-                printf("Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
-        }
+        if (err < 0)
+        {
+            err = snd_pcm_prepare(handle);
+            if (err < 0)
+                DEBUGPRINT("Can't recovery from suspend, prepare failed: %s", snd_strerror(err));
+        }
+
+        return 0;
+    }
+
+    return 0;
+    return err;
+}
+
+static uint64_t getTimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void deviceResetDriftFilter(DeviceAudio* const dev)
+{
+    dev->rbRatio = 1.0;
+    dev->rbFilterSteps1 = AUDIO_BRIDGE_CLOCK_FILTER_FAST_STEPS_1;
+    dev->rbFilterSteps2 = AUDIO_BRIDGE_CLOCK_FILTER_FAST_STEPS_2;
+    dev->rbLockFrames = 0;
+    dev->latency.reference = 0;
+}
+
+// startup stages are marked from both the host and device threads, and reset from either on failure,
+// so every access goes through relaxed atomics
+static uint64_t deviceStartupStage(DeviceAudio* const dev, const DeviceStartupStage stage)
+{
+    return __atomic_load_n(&dev->startup.stages[stage], __ATOMIC_RELAXED);
+}
+
+static void deviceMarkStartup(DeviceAudio* const dev, const DeviceStartupStage stage)
+{
+    if (deviceStartupStage(dev, stage) != 0)
+        return;
+
+    uint64_t unset = 0;
+    __atomic_compare_exchange_n(&dev->startup.stages[stage], &unset, getTimeNs(),
+                                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// prints the startup timeline once drift has locked, called from the device threads
+static void devicePrintStartup(DeviceAudio* const dev)
+{
+    if (deviceStartupStage(dev, kDeviceStartupDriftLocked) == 0)
+        return;
+    if (__atomic_exchange_n(&dev->startup.printed, true, __ATOMIC_RELAXED))
+        return;
+
+    static constexpr const char* const kStageNames[kDeviceStartupStageCount] = {
+        "open", "configured", "thread", "host", "initialized", "started", "audio", "drift", "locked"
+    };
+
+    const uint64_t base = __atomic_load_n(&dev->startup.base, __ATOMIC_RELAXED);
+
+    char buf[256];
+    int pos = std::snprintf(buf, sizeof(buf), "%s | startup", dev->deviceID);
+
+    for (int i=0; i<kDeviceStartupStageCount && pos < static_cast<int>(sizeof(buf)); ++i)
+    {
+        const uint64_t stage = deviceStartupStage(dev, static_cast<DeviceStartupStage>(i));
+
+        if (stage == 0)
+            continue;
+
+        // stages reached before the last restart are not part of this timeline
+        if (stage < base)
+            continue;
+
+        pos += std::snprintf(buf + pos, sizeof(buf) - pos, " | %s %.1fms", kStageNames[i],
+                             (stage - base) / 1000000.0);
+    }
+
+    DEBUGPRINT("%s", buf);
+}
+
+static void deviceFailInitHints(DeviceAudio* const dev)
+{
+    dev->hints |= kDeviceInitializing|kDeviceStarting|kDeviceBuffering;
+    dev->framesDone = 0;
+    dev->ringbuffer->flush();
+    dev->latency.average = 0.0;
+    deviceResetDriftFilter(dev);
+
+    // measure time-to-audio again, relative to this restart
+    if (deviceStartupStage(dev, kDeviceStartupInitialized) != 0)
+    {
+        __atomic_store_n(&dev->startup.base, getTimeNs(), __ATOMIC_RELAXED);
+        for (int i=kDeviceStartupInitialized; i<kDeviceStartupStageCount; ++i)
+            __atomic_store_n(&dev->startup.stages[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&dev->startup.printed, false, __ATOMIC_RELAXED);
+    }
+}
+
+// light recovery for xruns and suspend, keeping stream state (ringbuffer, ratio and resampler) intact
+// returns false if a full restart is needed instead
+static bool deviceRecoverInPlace(DeviceAudio* const dev, DeviceRecovery& recovery, const int err)
+{
+    if (err != -EPIPE && err != -ESTRPIPE)
+        return false;
+
+    // linked streams stop together, let the duplex thread restart both sides in sync
+    if (dev->hints & kDeviceDuplex)
+        return false;
+
+    const uint64_t now = getTimeNs();
+
+    recovery.count = now - recovery.lastTime < 1000000000ULL ? recovery.count + 1 : 1;
+    recovery.lastTime = now;
+
+    if (recovery.count > AUDIO_BRIDGE_XRUN_MAX_RECOVERIES)
+    {
+        DEBUGPRINT("too many xruns in a short time, doing full restart");
+        recovery.count = 0;
+        return false;
+    }
+
+    if (err == -EPIPE || snd_pcm_resume(dev->pcm) != 0)
+    {
+        if (snd_pcm_prepare(dev->pcm) != 0)
+            return false;
+    }
+
+    if ((dev->hints & kDeviceCapture) && snd_pcm_state(dev->pcm) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(dev->pcm);
+
+    ++dev->stats.recoveries;
+    return true;
+}
+
+static uint32_t getRingBufferFillTarget(const DeviceAudio* const dev)
+{
+    return static_cast<uint32_t>(dev->rbFillTarget * dev->rbTotalNumSamples * kRingBufferDataFactor);
+}
+
+// how many frames of silence low-latency start prefills, always leaving at least 1 period free for writing
+static uint32_t getPlaybackStartFrames(const DeviceAudio* const dev)
+{
+    const uint32_t periods = std::max(1U, std::min<uint32_t>(dev->options.startPeriods, dev->hwstatus.periods - 1));
+    return dev->hwstatus.periodSize * periods;
+}
+
+static void deviceTimedWait(DeviceAudio* const dev)
+{
+    // wait for the smallest of host and device block sizes
+    const uint32_t frames = std::min(dev->bufferSize, dev->hwstatus.periodSize);
+    const uint64_t periodTime = static_cast<uint64_t>(frames) * 1000000000ULL / dev->sampleRate
+                              / AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+
+    notifierWait(&dev->notifier, periodTime);
+}
+
+// pooled and duplex devices have more than one pipeline serviced by the same thread,
+// so their steps return kDeviceStepWait instead of blocking, and the caller waits once for all of them
+static bool deviceNonBlockingSteps(const DeviceAudio* const dev)
+{
+    return (dev->hints & (kDevicePooled|kDeviceDuplex)) != 0;
+}
+
+// averages the frames queued in the device buffer plus the resampler delay, called from the device threads
+static void deviceMeasureLatency(DeviceAudio* const dev, const double resamplerDelay)
+{
+    if (dev->hints & (kDeviceInitializing|kDeviceStarting))
+        return;
+
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(dev->pcm, &delay) != 0 || delay < 0)
+        return;
+
+    const double value = delay + resamplerDelay;
+
+    if (dev->latency.average == 0.0)
+        dev->latency.average = value;
+    else
+        dev->latency.average += (value - dev->latency.average) / AUDIO_BRIDGE_LATENCY_AVERAGE_STEPS;
+
+    __atomic_store_n(&dev->latency.measured, static_cast<uint32_t>(dev->latency.average + 0.5), __ATOMIC_RELAXED);
+}
+
+// raw device buffer access, `offset` is in frames from the start of the raw buffer
+static void deviceRawPointers(DeviceAudio* const dev, const uint32_t offset, void** const ptrs)
+{
+    const uint8_t sampleSize = getSampleSizeFromHints(dev->hints);
+
+    for (uint32_t c=0; c<dev->hwstatus.deviceChannels; ++c)
+        ptrs[c] = dev->buffers.raw + c * dev->buffers.rawChannelStride + offset * sampleSize;
+}
+
+// pointers to the start of each bridged channel in raw, for non-interleaved conversion
+static void** deviceBridgedRawPointers(DeviceAudio* const dev)
+{
+    deviceRawPointers(dev, 0, dev->buffers.rawptrs);
+
+    if ((dev->hints & kDeviceChannelMap) == 0)
+        return dev->buffers.rawptrs;
+
+    for (uint32_t c=0; c<dev->hwstatus.channels; ++c)
+        dev->buffers.mapptrs[c] = dev->buffers.rawptrs[dev->options.channelMap[c]];
+
+    return dev->buffers.mapptrs;
+}
+
+static snd_pcm_sframes_t deviceReadRaw(DeviceAudio* const dev, const uint32_t offset, const uint32_t frames)
+{
+    if (dev->hints & kDeviceNonInterleaved)
+    {
+        deviceRawPointers(dev, offset, dev->buffers.rawptrs);
+        return snd_pcm_mmap_readn(dev->pcm, dev->buffers.rawptrs, frames);
+    }
+
+    const uint32_t frameSize = getSampleSizeFromHints(dev->hints) * dev->hwstatus.deviceChannels;
+    return snd_pcm_mmap_readi(dev->pcm, dev->buffers.raw + offset * frameSize, frames);
+}
+
+static snd_pcm_sframes_t deviceWriteRaw(DeviceAudio* const dev, const uint32_t offset, const uint32_t frames)
+{
+    if (dev->hints & kDeviceNonInterleaved)
+    {
+        deviceRawPointers(dev, offset, dev->buffers.rawptrs);
+        return snd_pcm_mmap_writen(dev->pcm, dev->buffers.rawptrs, frames);
+    }
+
+    const uint32_t frameSize = getSampleSizeFromHints(dev->hints) * dev->hwstatus.deviceChannels;
+    return snd_pcm_mmap_writei(dev->pcm, dev->buffers.raw + offset * frameSize, frames);
+}
+
+static void deviceClearRaw(DeviceAudio* const dev, const uint32_t frames)
+{
+    const uint8_t sampleSize = getSampleSizeFromHints(dev->hints);
+
+    if (dev->hints & kDeviceNonInterleaved)
+    {
+        for (uint32_t c=0; c<dev->hwstatus.deviceChannels; ++c)
+            std::memset(dev->buffers.raw + c * dev->buffers.rawChannelStride, 0, sampleSize * frames);
+    }
+    else
+    {
+        std::memset(dev->buffers.raw, 0, sampleSize * dev->hwstatus.deviceChannels * frames);
+    }
+}
+
+static void deviceRawToFloat(DeviceAudio* const dev, const uint32_t frames)
+{
+    const uint16_t channels = dev->hwstatus.channels;
+
+    if (dev->hints & kDeviceNonInterleaved)
+    {
+        void** const ptrs = deviceBridgedRawPointers(dev);
+
+        switch (dev->hints & kDeviceSampleHints)
+        {
+        case kDeviceSample16:
+            int2float::planar::s16(dev->buffers.f32, ptrs, channels, frames);
+            break;
+        case kDeviceSample24:
+            int2float::planar::s24(dev->buffers.f32, ptrs, channels, frames);
+            break;
+        case kDeviceSample24LE3:
+            int2float::planar::s24le3(dev->buffers.f32, ptrs, channels, frames);
+            break;
+        case kDeviceSample32:
+            int2float::planar::s32(dev->buffers.f32, ptrs, channels, frames);
+            break;
+        }
+        return;
+    }
+
+    if (dev->hints & kDeviceChannelMap)
+    {
+        const uint16_t* const map = dev->options.channelMap;
+        const uint16_t stride = dev->hwstatus.deviceChannels;
+
+        switch (dev->hints & kDeviceSampleHints)
+        {
+        case kDeviceSample16:
+            int2float::mapped::s16(dev->buffers.f32, dev->buffers.raw, map, channels, stride, frames);
+            break;
+        case kDeviceSample24:
+            int2float::mapped::s24(dev->buffers.f32, dev->buffers.raw, map, channels, stride, frames);
+            break;
+        case kDeviceSample24LE3:
+            int2float::mapped::s24le3(dev->buffers.f32, dev->buffers.raw, map, channels, stride, frames);
+            break;
+        case kDeviceSample32:
+            int2float::mapped::s32(dev->buffers.f32, dev->buffers.raw, map, channels, stride, frames);
+            break;
+        }
+        return;
+    }
+
+    switch (dev->hints & kDeviceSampleHints)
+    {
+    case kDeviceSample16:
+        int2float::s16(dev->buffers.f32, dev->buffers.raw, channels, frames);
+        break;
+    case kDeviceSample24:
+        int2float::s24(dev->buffers.f32, dev->buffers.raw, channels, frames);
+        break;
+    case kDeviceSample24LE3:
+        int2float::s24le3(dev->buffers.f32, dev->buffers.raw, channels, frames);
+        break;
+    case kDeviceSample32:
+        int2float::s32(dev->buffers.f32, dev->buffers.raw, channels, frames);
+        break;
+    }
+}
+
+static void deviceFloatToRaw(DeviceAudio* const dev, const uint32_t frames)
+{
+    const uint16_t channels = dev->hwstatus.channels;
+
+    if (dev->hints & kDeviceNonInterleaved)
+    {
+        void** const ptrs = deviceBridgedRawPointers(dev);
+
+        switch (dev->hints & kDeviceSampleHints)
+        {
+        case kDeviceSample16:
+            float2int::planar::s16(ptrs, dev->buffers.f32, channels, frames);
+            break;
+        case kDeviceSample24:
+            float2int::planar::s24(ptrs, dev->buffers.f32, channels, frames);
+            break;
+        case kDeviceSample24LE3:
+            float2int::planar::s24le3(ptrs, dev->buffers.f32, channels, frames);
+            break;
+        case kDeviceSample32:
+            float2int::planar::s32(ptrs, dev->buffers.f32, channels, frames);
+            break;
+        default:
+            DEBUGPRINT("unknown format");
+            break;
+        }
+        return;
+    }
+
+    // unmapped channels are never written, so they keep the silence the raw buffer starts with
+    if (dev->hints & kDeviceChannelMap)
+    {
+        const uint16_t* const map = dev->options.channelMap;
+        const uint16_t stride = dev->hwstatus.deviceChannels;
+
+        switch (dev->hints & kDeviceSampleHints)
+        {
+        case kDeviceSample16:
+            float2int::mapped::s16(dev->buffers.raw, dev->buffers.f32, map, channels, stride, frames);
+            break;
+        case kDeviceSample24:
+            float2int::mapped::s24(dev->buffers.raw, dev->buffers.f32, map, channels, stride, frames);
+            break;
+        case kDeviceSample24LE3:
+            float2int::mapped::s24le3(dev->buffers.raw, dev->buffers.f32, map, channels, stride, frames);
+            break;
+        case kDeviceSample32:
+            float2int::mapped::s32(dev->buffers.raw, dev->buffers.f32, map, channels, stride, frames);
+            break;
+        default:
+            DEBUGPRINT("unknown format");
+            break;
+        }
+        return;
+    }
+
+    switch (dev->hints & kDeviceSampleHints)
+    {
+    case kDeviceSample16:
+        float2int::s16(dev->buffers.raw, dev->buffers.f32, channels, frames);
+        break;
+    case kDeviceSample24:
+        float2int::s24(dev->buffers.raw, dev->buffers.f32, channels, frames);
+        break;
+    case kDeviceSample24LE3:
+        float2int::s24le3(dev->buffers.raw, dev->buffers.f32, channels, frames);
+        break;
+    case kDeviceSample32:
+        float2int::s32(dev->buffers.raw, dev->buffers.f32, channels, frames);
+        break;
+    default:
+        DEBUGPRINT("unknown format");
+        break;
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// capture latency follows the read size, plus 1 block of safety margin
+static uint32_t getCaptureLatencyBlocks(const uint32_t captureBlocks)
+{
+    return std::min<uint32_t>(captureBlocks + 1, AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS);
+}
+
+static uint32_t getRingBufferBlocks(const DeviceAudio* const dev)
+{
+    return dev->hints & kDeviceCapture ? AUDIO_BRIDGE_CAPTURE_RINGBUFFER_BLOCKS : AUDIO_BRIDGE_PLAYBACK_RINGBUFFER_BLOCKS;
+}
+
+// ringbuffer fill target, from the current capture read size (or 1 block for playback) plus any extra group latency
+static void deviceUpdateFillTarget(DeviceAudio* const dev)
+{
+    const uint32_t blocks = getRingBufferBlocks(dev);
+    const uint32_t blockSize = std::max(dev->bufferSize, dev->hwstatus.periodSize);
+    const uint32_t targetBlocks = dev->hints & kDeviceCapture ? getCaptureLatencyBlocks(dev->stats.captureBlocks) : 1;
+
+    dev->rbFillTarget = static_cast<double>(targetBlocks * blockSize + dev->rbExtraLatency) / (blockSize * blocks);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+#ifndef SCHED_DEADLINE
+# define SCHED_DEADLINE 6
+#endif
+
+// not exposed by glibc
+struct sched_attr_compat {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+static int deviceThreadPriority(DeviceAudio* const dev)
+{
+    const int priority = dev->options.rtPriority - (dev->hints & kDeviceCapture ? 0 : 1);
+
+    return std::max(1, std::min(99, priority));
+}
+
+static bool deviceSetDeadlineScheduling(DeviceAudio* const dev)
+{
+   #ifdef SYS_sched_setattr
+    const uint32_t frames = std::min(dev->bufferSize, dev->hwstatus.periodSize);
+    const uint64_t periodTime = static_cast<uint64_t>(frames) * 1000000000ULL / dev->sampleRate;
+
+    sched_attr_compat attr = {};
+    attr.size = sizeof(attr);
+    attr.sched_policy = SCHED_DEADLINE;
+    attr.sched_runtime = periodTime * dev->options.rtDeadlinePercent / 100;
+    attr.sched_deadline = periodTime;
+    attr.sched_period = periodTime;
+
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) == 0)
+        return true;
+
+    DEBUGPRINT("sched_setattr SCHED_DEADLINE fail %s", std::strerror(errno));
+   #else
+    (void)dev;
+   #endif
+
+    return false;
+}
+
+static void deviceLockMemory()
+{
+    static bool locked = false;
+
+    if (locked)
+        return;
+
+    if (::mlockall(MCL_CURRENT|MCL_FUTURE) == 0)
+        locked = true;
+    else
+        d_stderr2("mlockall failed: %s", std::strerror(errno));
+}
+
+// sets up affinity and realtime scheduling for a new device or pool thread
+static void deviceInitThreadAttr(pthread_attr_t* const attr,
+                                 const uint8_t rtPolicy,
+                                 const int priority,
+                                 const uint64_t cpuAffinity)
+{
+    pthread_attr_init(attr);
+
+    if (cpuAffinity != 0)
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+
+        for (int i=0; i<64; ++i)
+        {
+            if (cpuAffinity & (1ULL << i))
+                CPU_SET(i, &cpuset);
+        }
+
+        pthread_attr_setaffinity_np(attr, sizeof(cpuset), &cpuset);
+    }
+
+    // SCHED_DEADLINE can only be applied from within the thread, see deviceThreadInit
+    if (rtPolicy == kDeviceSchedFIFO || rtPolicy == kDeviceSchedRR)
+    {
+        sched_param sched = {};
+        sched.sched_priority = priority;
+
+        pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setscope(attr, PTHREAD_SCOPE_SYSTEM);
+        pthread_attr_setschedpolicy(attr, rtPolicy == kDeviceSchedRR ? SCHED_RR : SCHED_FIFO);
+        pthread_attr_setschedparam(attr, &sched);
+    }
+}
+
+static bool deviceCreateThread(DeviceAudio* const dev, void* (*threadCall)(void*))
+{
+    const DeviceAudioOptions& options = dev->options;
+
+    pthread_attr_t attr;
+    deviceInitThreadAttr(&attr, options.rtPolicy, deviceThreadPriority(dev), options.cpuAffinity);
+
+    if (pthread_create(&dev->thread, &attr, threadCall, dev) == 0)
+    {
+        pthread_attr_destroy(&attr);
+        return true;
+    }
+
+    // try again as a regular thread, deviceThreadInit will report the missing realtime scheduling
+    pthread_attr_destroy(&attr);
+    pthread_attr_init(&attr);
+
+    const bool ok = pthread_create(&dev->thread, &attr, threadCall, dev) == 0;
+    pthread_attr_destroy(&attr);
+    return ok;
+}
+
+// the capture thread waits for whole blocks, which must fit in the ALSA buffer with a period to spare
+static void deviceLimitCaptureBlocks(DeviceAudioOptions& options, const uint32_t periods)
+{
+    const uint8_t maxBlocks = static_cast<uint8_t>(std::max(1u, std::min(0xffu, periods - 1)));
+
+    if (options.captureMaxBlocks <= maxBlocks)
+        return;
+
+    DEBUGPRINT("device has %u periods, reading at most %u at once", periods, maxBlocks);
+    options.captureMaxBlocks = maxBlocks;
+    options.captureMinBlocks = std::min(options.captureMinBlocks, maxBlocks);
+}
+
+static void deviceSetAvailMin(DeviceAudio* const dev, const snd_pcm_uframes_t frames)
+{
+    snd_pcm_sw_params_t* swparams;
+    snd_pcm_sw_params_alloca(&swparams);
+
+    int err;
+    if ((err = snd_pcm_sw_params_current(dev->pcm, swparams)) != 0 ||
+        (err = snd_pcm_sw_params_set_avail_min(dev->pcm, swparams, frames)) != 0 ||
+        (err = snd_pcm_sw_params(dev->pcm, swparams)) != 0)
+    {
+        DEBUGPRINT("%s | failed to set avail min: %s", dev->deviceID, snd_strerror(err));
+    }
+}
+
+static void deviceThreadInit(DeviceAudio* const dev)
+{
+    const DeviceAudioOptions& options = dev->options;
+    const char* const mode = dev->hints & kDeviceCapture ? "capture" : "playback";
+
+    // touch the stack now, so page faults do not happen later during audio processing
+    {
+        volatile uint8_t stack[AUDIO_BRIDGE_DEVICE_THREAD_STACK_PREFAULT];
+
+        for (size_t i=0; i<sizeof(stack); i+=1024)
+            stack[i] = 0;
+    }
+
+    if (options.rtPolicy == kDeviceSchedDeadline && ! deviceSetDeadlineScheduling(dev))
+    {
+        d_stderr2("%s | %s | SCHED_DEADLINE not available, using SCHED_FIFO instead", dev->deviceID, mode);
+
+        sched_param sched = {};
+        sched.sched_priority = deviceThreadPriority(dev);
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
+    }
+
+    int policy = SCHED_OTHER;
+    sched_param sched = {};
+    pthread_getschedparam(pthread_self(), &policy, &sched);
+
+    if (options.rtPolicy != kDeviceSchedOther && policy != SCHED_FIFO && policy != SCHED_RR && policy != SCHED_DEADLINE)
+    {
+        d_stderr2("%s | %s | failed to get realtime scheduling, expect audio dropouts", dev->deviceID, mode);
+        return;
+    }
+
+    DEBUGPRINT("%s | %s | thread running with policy %d, priority %d", dev->deviceID, mode, policy, sched.sched_priority);
+
+    deviceMarkStartup(dev, kDeviceStartupThreadReady);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static uint64_t parseCpuList(const char* str)
+{
+    uint64_t mask = 0;
+    char* end;
+
+    while (*str != '\0')
+    {
+        const long first = std::strtol(str, &end, 10);
+        if (end == str)
+            break;
+
+        long last = first;
+        str = end;
+
+        if (*str == '-')
+        {
+            last = std::strtol(str + 1, &end, 10);
+            if (end == str + 1)
+                break;
+            str = end;
+        }
+
+        for (long i = std::max(0L, first); i <= last && i < 64; ++i)
+            mask |= 1ULL << i;
+
+        if (*str != ',')
+            break;
+
+        ++str;
+    }
+
+    return mask;
+}
+
+void initDeviceAudioOptions(DeviceAudioOptions* const options)
+{
+    options->rtPolicy = kDeviceSchedFIFO;
+    options->rtPriority = AUDIO_BRIDGE_DEVICE_THREAD_PRIORITY;
+    options->rtDeadlinePercent = 50;
+    options->cpuAffinity = 0;
+    options->lockMemory = false;
+    options->periodSize = 0;
+    options->periods = 0;
+    options->captureMinBlocks = AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MIN;
+    options->captureMaxBlocks = AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+    options->overflowPolicy = kDeviceOverflowBlock;
+    options->lowLatencyStart = false;
+    options->startPeriods = AUDIO_BRIDGE_PLAYBACK_START_PERIODS;
+    options->nonInterleaved = true;
+    options->workerPool = false;
+    options->resampleThreads = AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS;
+    options->synchronous = false;
+    options->channels = 2;
+    options->numMappedChannels = 0;
+}
+
+bool parseDeviceChannelMap(DeviceAudioOptions* const options, const char* str)
+{
+    uint16_t numMapped = 0;
+    char* end;
+
+    while (*str != '\0')
+    {
+        const long first = std::strtol(str, &end, 10);
+        if (end == str || first < 1)
+            return false;
+
+        long last = first;
+        str = end;
+
+        if (*str == '-')
+        {
+            last = std::strtol(str + 1, &end, 10);
+            if (end == str + 1 || last < first)
+                return false;
+            str = end;
+        }
+
+        for (long i = first; i <= last; ++i)
+        {
+            if (numMapped == AUDIO_BRIDGE_MAX_CHANNELS || i > 0xffff)
+                return false;
+
+            options->channelMap[numMapped++] = i - 1;
+        }
+
+        if (*str == '\0')
+            break;
+        if (*str != ',')
+            return false;
+
+        ++str;
+    }
+
+    options->numMappedChannels = numMapped;
+    return true;
+}
+
+// how many channels to ask the device for, enough to include all mapped ones
+static uint16_t deviceRequestedChannels(const DeviceAudioOptions& options)
+{
+    uint16_t channels = std::max<uint16_t>(1, options.channels);
+
+    for (uint16_t c=0; c<options.numMappedChannels; ++c)
+        channels = std::max<uint16_t>(channels, options.channelMap[c] + 1);
+
+    return channels;
+}
+
+void loadDeviceAudioOptionsFromEnv(DeviceAudioOptions* const options)
+{
+    if (const char* const policy = std::getenv("AUDIO_BRIDGE_RT_POLICY"))
+    {
+        if (std::strcmp(policy, "other") == 0)
+            options->rtPolicy = kDeviceSchedOther;
+        else if (std::strcmp(policy, "fifo") == 0)
+            options->rtPolicy = kDeviceSchedFIFO;
+        else if (std::strcmp(policy, "rr") == 0)
+            options->rtPolicy = kDeviceSchedRR;
+        else if (std::strcmp(policy, "deadline") == 0)
+            options->rtPolicy = kDeviceSchedDeadline;
+        else
+            d_stderr2("unknown AUDIO_BRIDGE_RT_POLICY value '%s'", policy);
+    }
+
+    if (const char* const priority = std::getenv("AUDIO_BRIDGE_RT_PRIORITY"))
+        options->rtPriority = std::max(1, std::min(99, std::atoi(priority)));
+
+    if (const char* const percent = std::getenv("AUDIO_BRIDGE_RT_DEADLINE_PERCENT"))
+        options->rtDeadlinePercent = std::max(1, std::min(95, std::atoi(percent)));
+
+    if (const char* const cpus = std::getenv("AUDIO_BRIDGE_CPU_AFFINITY"))
+        options->cpuAffinity = parseCpuList(cpus);
+
+    if (const char* const lock = std::getenv("AUDIO_BRIDGE_MLOCKALL"))
+        options->lockMemory = std::atoi(lock) != 0;
 
-        return 0;
+    if (const char* const periodSize = std::getenv("AUDIO_BRIDGE_PERIOD_SIZE"))
+        options->periodSize = std::max(0, std::min(65536, std::atoi(periodSize)));
+
+    if (const char* const periods = std::getenv("AUDIO_BRIDGE_PERIODS"))
+        options->periods = std::max(0, std::min(32, std::atoi(periods)));
+
+    if (const char* const blocks = std::getenv("AUDIO_BRIDGE_CAPTURE_MIN_BLOCKS"))
+        options->captureMinBlocks = std::max(1, std::min(64, std::atoi(blocks)));
+
+    if (const char* const blocks = std::getenv("AUDIO_BRIDGE_CAPTURE_MAX_BLOCKS"))
+        options->captureMaxBlocks = std::max(1, std::min(64, std::atoi(blocks)));
+
+    options->captureMaxBlocks = std::max(options->captureMinBlocks, options->captureMaxBlocks);
+
+    if (const char* const policy = std::getenv("AUDIO_BRIDGE_OVERFLOW_POLICY"))
+    {
+        if (std::strcmp(policy, "block") == 0)
+            options->overflowPolicy = kDeviceOverflowBlock;
+        else if (std::strcmp(policy, "drop-newest") == 0)
+            options->overflowPolicy = kDeviceOverflowDropNewest;
+        else if (std::strcmp(policy, "drop-oldest") == 0)
+            options->overflowPolicy = kDeviceOverflowDropOldest;
+        else
+            d_stderr2("unknown AUDIO_BRIDGE_OVERFLOW_POLICY value '%s'", policy);
     }
 
-    return 0;
-    return err;
-}
+    if (const char* const lowLatency = std::getenv("AUDIO_BRIDGE_LOW_LATENCY_START"))
+        options->lowLatencyStart = std::atoi(lowLatency) != 0;
 
-static void deviceFailInitHints(DeviceAudio* const dev)
-{
-    dev->hints |= kDeviceInitializing|kDeviceStarting|kDeviceBuffering;
-    dev->framesDone = 0;
-    dev->rbRatio = 1.0;
-    dev->ringbuffer->flush();
-}
+    if (const char* const startPeriods = std::getenv("AUDIO_BRIDGE_LOW_LATENCY_START_PERIODS"))
+        options->startPeriods = std::max(1, std::min(32, std::atoi(startPeriods)));
 
-static void deviceTimedWait(DeviceAudio* const dev)
-{
-    if (sem_trywait(&dev->sem) == 0)
-        return;
+    if (const char* const nonInterleaved = std::getenv("AUDIO_BRIDGE_NONINTERLEAVED"))
+        options->nonInterleaved = std::atoi(nonInterleaved) != 0;
 
-    const uint32_t periodTime = (dev->bufferSize * 1000000) / dev->sampleRate * 1000 / AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+    if (const char* const workerPool = std::getenv("AUDIO_BRIDGE_WORKER_POOL"))
+        options->workerPool = std::atoi(workerPool) != 0;
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    if (const char* const resampleThreads = std::getenv("AUDIO_BRIDGE_RESAMPLE_THREADS"))
+        options->resampleThreads = std::max(1, std::min(AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS, std::atoi(resampleThreads)));
 
-    ts.tv_nsec += periodTime;
-    if (ts.tv_nsec >= 1000000000LL)
+    if (const char* const sync = std::getenv("AUDIO_BRIDGE_SYNC"))
+        options->synchronous = std::atoi(sync) != 0;
+
+    if (const char* const map = std::getenv("AUDIO_BRIDGE_CHANNEL_MAP"))
     {
-        ++ts.tv_sec;
-        ts.tv_nsec -= 1000000000LL;
+        if (! parseDeviceChannelMap(options, map))
+            d_stderr2("invalid AUDIO_BRIDGE_CHANNEL_MAP value '%s'", map);
     }
-    sem_timedwait(&dev->sem, &ts);
 }
 
 // --------------------------------------------------------------------------------------------------------------------
 
-DeviceAudio* initDeviceAudio(const char* const deviceID,
-                             const bool playback,
-                             const uint16_t bufferSize,
-                             const uint32_t sampleRate)
+// allocates conversion buffers and ringbuffer for the configured channels, host and device block sizes.
+// all sizes are in 32-bit frames, the scratch buffers hold up to 2 device periods per captured block
+static void deviceAllocBuffers(DeviceAudio& dev)
+{
+    const uint16_t channels = dev.hwstatus.channels;
+    const uint16_t deviceChannels = dev.hwstatus.deviceChannels;
+    const uint32_t blocks = getRingBufferBlocks(&dev);
+    const uint32_t scratchFrames = dev.hwstatus.periodSize * 2 * dev.options.captureMaxBlocks;
+    const size_t rawbufferlen = static_cast<size_t>(getSampleSizeFromHints(dev.hints)) * scratchFrames * deviceChannels;
+
+    // ringbuffer blocks need to fit whatever is bigger, host or device side
+    const uint32_t blockSize = std::max(dev.bufferSize, dev.hwstatus.periodSize);
+
+    // zero-initialized, unmapped playback channels are never written and must stay silent
+    dev.buffers.raw = new int8_t[rawbufferlen]();
+    dev.buffers.rawChannelStride = rawbufferlen / deviceChannels;
+    dev.buffers.rawptrs = new void*[deviceChannels];
+    dev.buffers.mapptrs = new void*[channels];
+    dev.buffers.f32 = new float*[channels];
+
+    for (uint16_t c=0; c<channels; ++c)
+        dev.buffers.f32[c] = new float[scratchFrames];
+
+    dev.ringbuffer = new AudioRingBuffer;
+    dev.ringbuffer->createBuffer(channels, blockSize * blocks);
+
+    dev.stats.captureBlocks = dev.options.captureMaxBlocks;
+    deviceUpdateFillTarget(&dev);
+    dev.rbTotalNumSamples = blockSize * blocks / kRingBufferDataFactor;
+    deviceResetDriftFilter(&dev);
+}
+
+static void deviceFreeBuffers(DeviceAudio* const dev, const uint16_t channels)
+{
+    for (uint16_t c=0; c<channels; ++c)
+        delete[] dev->buffers.f32[c];
+    delete[] dev->buffers.f32;
+    delete[] dev->buffers.raw;
+    delete[] dev->buffers.rawptrs;
+    delete[] dev->buffers.mapptrs;
+    delete dev->ringbuffer;
+}
+
+// opens and configures a device, without starting its thread
+static DeviceAudio* deviceOpen(const char* const deviceID,
+                               const bool playback,
+                               const uint32_t bufferSize,
+                               const uint32_t sampleRate,
+                               const DeviceAudioOptions* const options,
+                               const bool duplex)
 {
     int err;
     DeviceAudio dev = {};
+    dev.startup.base = getTimeNs();
+    dev.startup.stages[kDeviceStartupOpen] = dev.startup.base;
     dev.sampleRate = sampleRate;
+
+    if (options != nullptr)
+    {
+        dev.options = *options;
+    }
+    else
+    {
+        initDeviceAudioOptions(&dev.options);
+        loadDeviceAudioOptionsFromEnv(&dev.options);
+    }
+
     dev.bufferSize = bufferSize;
     dev.hints = kDeviceInitializing|kDeviceStarting|kDeviceBuffering|(playback ? 0 : kDeviceCapture);
 
+    // linked streams are started explicitly by the playback side, after its prefill
+    if (duplex)
+    {
+        dev.hints |= kDeviceDuplex;
+        dev.options.lowLatencyStart = true;
+    }
+
     const snd_pcm_stream_t mode = playback ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE;
 
     // SND_PCM_ASYNC
@@ -194,6 +1084,31 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
 
     unsigned uintParam;
     unsigned long ulongParam;
+    uint32_t periodSize;
+
+    char cacheKey[192];
+    DeviceParamsCacheEntry cacheEntry;
+    getDeviceParamsCacheKey(cacheKey, deviceID, playback, sampleRate, bufferSize, dev.options);
+
+    // try the last known-good configuration first, skipping full negotiation
+    if (lookupDeviceParamsCache(cacheKey, cacheEntry))
+    {
+        if (applyDeviceParamsCache(dev.pcm, params, cacheEntry, sampleRate))
+        {
+            DEBUGPRINT("using cached hw params %s, period size %u, periods %u, channels %u",
+                       SND_PCM_FORMAT_STRING(cacheEntry.format), cacheEntry.periodSize, cacheEntry.periods, cacheEntry.channels);
+
+            dev.hints |= getHintsFromFormat(cacheEntry.format);
+            if (cacheEntry.access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED)
+                dev.hints |= kDeviceNonInterleaved;
+            dev.hwstatus.periods = cacheEntry.periods;
+            dev.hwstatus.deviceChannels = cacheEntry.channels;
+            periodSize = cacheEntry.periodSize;
+            goto hwparams_done;
+        }
+
+        removeDeviceParamsCache(cacheKey);
+    }
 
     if ((err = snd_pcm_hw_params_any(dev.pcm, params)) < 0)
     {
@@ -207,7 +1122,14 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         goto error;
     }
 
-    if ((err = snd_pcm_hw_params_set_access(dev.pcm, params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) != 0)
+    // non-interleaved maps directly onto planar host buffers, prefer it when available
+    if (dev.options.nonInterleaved &&
+        snd_pcm_hw_params_set_access(dev.pcm, params, SND_PCM_ACCESS_MMAP_NONINTERLEAVED) == 0)
+    {
+        DEBUGPRINT("using non-interleaved access");
+        dev.hints |= kDeviceNonInterleaved;
+    }
+    else if ((err = snd_pcm_hw_params_set_access(dev.pcm, params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) != 0)
     {
         DEBUGPRINT("snd_pcm_hw_params_set_access fail %s", snd_strerror(err));
         goto error;
@@ -221,21 +1143,12 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
             continue;
         }
 
-        switch (format)
+        if (const uint32_t formatHints = getHintsFromFormat(format))
+        {
+            dev.hints |= formatHints;
+        }
+        else
         {
-        case SND_PCM_FORMAT_S16:
-            dev.hints |= kDeviceSample16;
-            break;
-        case SND_PCM_FORMAT_S24:
-            dev.hints |= kDeviceSample24;
-            break;
-        case SND_PCM_FORMAT_S24_3LE:
-            dev.hints |= kDeviceSample24LE3;
-            break;
-        case SND_PCM_FORMAT_S32:
-            dev.hints |= kDeviceSample32;
-            break;
-        default:
             DEBUGPRINT("snd_pcm_hw_params_set_format fail unimplemented format %u:%s", format, SND_PCM_FORMAT_STRING(format));
             continue;
         }
@@ -262,18 +1175,26 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
     //     goto error;
     // }
 
+    // ALSA period size is independent from the host buffer size, by default try to match it
+    periodSize = dev.options.periodSize != 0 ? dev.options.periodSize : bufferSize;
+
     uintParam = 0;
     for (unsigned periods : kPeriodsToTry)
     {
-        if ((err = snd_pcm_hw_params_set_period_size(dev.pcm, params, bufferSize, 0)) != 0)
+        if (dev.options.periods != 0)
+            periods = dev.options.periods;
+
+        if ((err = snd_pcm_hw_params_set_period_size(dev.pcm, params, periodSize, 0)) != 0)
         {
-            DEBUGPRINT("snd_pcm_hw_params_set_period_size fail %u %u %s", periods, bufferSize, snd_strerror(err));
-            continue;
+            DEBUGPRINT("snd_pcm_hw_params_set_period_size fail %u %u %s", periods, periodSize, snd_strerror(err));
+            break;
         }
 
         if ((err = snd_pcm_hw_params_set_periods(dev.pcm, params, periods, 0)) != 0)
         {
-            DEBUGPRINT("snd_pcm_hw_params_set_periods fail %u %u %s", periods, bufferSize, snd_strerror(err));
+            DEBUGPRINT("snd_pcm_hw_params_set_periods fail %u %u %s", periods, periodSize, snd_strerror(err));
+            if (dev.options.periods != 0)
+                break;
             continue;
         }
 
@@ -281,14 +1202,36 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         break;
     }
 
+    // exact period size not possible, let the device pick the closest one it supports
+    if (uintParam == 0)
+    {
+        ulongParam = periodSize;
+        uintParam = dev.options.periods != 0 ? dev.options.periods : kPeriodsToTry[0];
+
+        if ((err = snd_pcm_hw_params_set_period_size_near(dev.pcm, params, &ulongParam, nullptr)) != 0)
+        {
+            DEBUGPRINT("snd_pcm_hw_params_set_period_size_near fail %u %s", periodSize, snd_strerror(err));
+            uintParam = 0;
+        }
+        else if ((err = snd_pcm_hw_params_set_periods_near(dev.pcm, params, &uintParam, nullptr)) != 0)
+        {
+            DEBUGPRINT("snd_pcm_hw_params_set_periods_near fail %lu %s", ulongParam, snd_strerror(err));
+            uintParam = 0;
+        }
+        else
+        {
+            DEBUGPRINT("using nearest period size %lu, periods %u", ulongParam, uintParam);
+        }
+    }
+
     if (uintParam == 0)
     {
         for (unsigned periods : kPeriodsToTry)
         {
-            ulongParam = bufferSize * periods;
+            ulongParam = periodSize * periods;
             if ((err = snd_pcm_hw_params_set_buffer_size_max(dev.pcm, params, &ulongParam)) != 0)
             {
-                DEBUGPRINT("snd_pcm_hw_params_set_buffer_size_max fail %u %u %s", periods, bufferSize, snd_strerror(err));
+                DEBUGPRINT("snd_pcm_hw_params_set_buffer_size_max fail %u %u %s", periods, periodSize, snd_strerror(err));
                 continue;
             }
 
@@ -305,9 +1248,14 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
 
     dev.hwstatus.periods = uintParam;
 
-    if (snd_pcm_hw_params_set_channels(dev.pcm, params, 2) == 0)
+    uintParam = deviceRequestedChannels(dev.options);
+
+    if (snd_pcm_hw_params_set_channels_near(dev.pcm, params, &uintParam) == 0)
     {
-        dev.hwstatus.channels = 2;
+        if (uintParam != deviceRequestedChannels(dev.options))
+            DEBUGPRINT("asked for %u channels, using nearest supported %u", deviceRequestedChannels(dev.options), uintParam);
+
+        dev.hwstatus.deviceChannels = uintParam;
     }
     else if ((err = snd_pcm_hw_params_get_channels(params, &uintParam)) != 0)
     {
@@ -316,7 +1264,7 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
     }
     else
     {
-        dev.hwstatus.channels = uintParam;
+        dev.hwstatus.deviceChannels = uintParam;
     }
 
     if ((err = snd_pcm_hw_params(dev.pcm, params)) != 0)
@@ -325,6 +1273,25 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         goto error;
     }
 
+    // remember what worked for next time
+    std::memcpy(cacheEntry.key, cacheKey, sizeof(cacheKey));
+    cacheEntry.format = getFormatFromHints(dev.hints);
+    cacheEntry.access = dev.hints & kDeviceNonInterleaved ? SND_PCM_ACCESS_MMAP_NONINTERLEAVED
+                                                          : SND_PCM_ACCESS_MMAP_INTERLEAVED;
+    snd_pcm_hw_params_get_period_size(params, &ulongParam, nullptr);
+    cacheEntry.periodSize = ulongParam;
+    snd_pcm_hw_params_get_periods(params, &uintParam, nullptr);
+    cacheEntry.periods = uintParam;
+    cacheEntry.channels = dev.hwstatus.deviceChannels;
+    storeDeviceParamsCache(cacheEntry);
+
+hwparams_done:
+    if (! playback)
+    {
+        snd_pcm_hw_params_get_periods(params, &uintParam, nullptr);
+        deviceLimitCaptureBlocks(dev.options, uintParam);
+    }
+
     if ((err = snd_pcm_sw_params_current(dev.pcm, swparams)) != 0)
     {
         DEBUGPRINT("snd_pcm_sw_params_current fail %s", snd_strerror(err));
@@ -355,7 +1322,12 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         }
 
         // how many samples we need to write until audio hw starts
-        if ((err = snd_pcm_sw_params_set_start_threshold(dev.pcm, swparams, bufferSize)) != 0)
+        // low-latency start never starts automatically, we call snd_pcm_start ourselves
+        snd_pcm_uframes_t startThreshold = periodSize;
+        if (dev.options.lowLatencyStart)
+            snd_pcm_sw_params_get_boundary(swparams, &startThreshold);
+
+        if ((err = snd_pcm_sw_params_set_start_threshold(dev.pcm, swparams, startThreshold)) != 0)
         {
             DEBUGPRINT("snd_pcm_sw_params_set_start_threshold fail %s", snd_strerror(err));
             goto error;
@@ -363,13 +1335,23 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
     }
     else
     {
-        if ((err = snd_pcm_sw_params_set_avail_min(dev.pcm, swparams, 1)) != 0)
+        // pool workers and the duplex thread poll the device, so only wake them up once a full read is available
+        const snd_pcm_uframes_t availMin = dev.options.workerPool || duplex
+                                         ? periodSize * dev.options.captureMaxBlocks
+                                         : 1;
+
+        if ((err = snd_pcm_sw_params_set_avail_min(dev.pcm, swparams, availMin)) != 0)
         {
             DEBUGPRINT("snd_pcm_sw_params_set_avail_min fail %s", snd_strerror(err));
             goto error;
         }
 
-        if ((err = snd_pcm_sw_params_set_start_threshold(dev.pcm, swparams, 0)) != 0)
+        // in duplex mode capture must not start by itself, as that would start playback without data
+        snd_pcm_uframes_t startThreshold = 0;
+        if (duplex)
+            snd_pcm_sw_params_get_boundary(swparams, &startThreshold);
+
+        if ((err = snd_pcm_sw_params_set_start_threshold(dev.pcm, swparams, startThreshold)) != 0)
         {
             DEBUGPRINT("snd_pcm_sw_params_set_start_threshold fail %s", snd_strerror(err));
             goto error;
@@ -400,114 +1382,360 @@ DeviceAudio* initDeviceAudio(const char* const deviceID,
         goto error;
     }
 
+    deviceMarkStartup(&dev, kDeviceStartupConfigured);
+
     snd_pcm_hw_params_get_channels(params, &uintParam);
-    DEBUGPRINT("num channels %u | %u", uintParam, dev.hwstatus.channels);
-    dev.hwstatus.channels = uintParam;
+    DEBUGPRINT("num channels %u | %u", uintParam, dev.hwstatus.deviceChannels);
+    dev.hwstatus.deviceChannels = uintParam;
+
+    // too many channels to bridge them all, take the first ones
+    if (dev.options.numMappedChannels == 0 && uintParam > AUDIO_BRIDGE_MAX_CHANNELS)
+    {
+        DEBUGPRINT("device has %u channels, only bridging the first %u", uintParam, AUDIO_BRIDGE_MAX_CHANNELS);
+
+        for (uint16_t c=0; c<AUDIO_BRIDGE_MAX_CHANNELS; ++c)
+            dev.options.channelMap[c] = c;
+
+        dev.options.numMappedChannels = AUDIO_BRIDGE_MAX_CHANNELS;
+    }
+
+    // only the mapped channels go through conversion, resampling and the ringbuffer
+    if (dev.options.numMappedChannels != 0)
+    {
+        uint16_t numMapped = 0;
+        uint16_t numIgnored = 0;
+        bool identity = true;
+
+        for (uint16_t c=0; c<dev.options.numMappedChannels; ++c)
+        {
+            const uint16_t channel = dev.options.channelMap[c];
+
+            if (channel >= uintParam)
+            {
+                ++numIgnored;
+                continue;
+            }
+
+            identity = identity && channel == numMapped;
+            dev.options.channelMap[numMapped++] = channel;
+        }
+
+        identity = identity && numMapped == uintParam;
+
+        if (numIgnored != 0)
+            DEBUGPRINT("ignoring %u channels in channel map, device only has %u", numIgnored, uintParam);
+
+        if (numMapped == 0)
+        {
+            DEBUGPRINT("channel map selects no device channels");
+            goto error;
+        }
+
+        dev.options.numMappedChannels = numMapped;
+        dev.hwstatus.channels = numMapped;
+
+        if (! identity)
+            dev.hints |= kDeviceChannelMap;
+    }
+    else
+    {
+        dev.hwstatus.channels = uintParam;
+    }
 
     snd_pcm_hw_params_get_periods(params, &uintParam, nullptr);
     DEBUGPRINT("num periods %u | %u", uintParam, dev.hwstatus.periods);
     dev.hwstatus.periods = uintParam;
 
     snd_pcm_hw_params_get_period_size(params, &ulongParam, nullptr);
-    DEBUGPRINT("period size %lu | %u", ulongParam, dev.bufferSize);
+    DEBUGPRINT("period size %lu | %u | host %u", ulongParam, periodSize, dev.bufferSize);
     dev.hwstatus.periodSize = ulongParam;
 
     snd_pcm_hw_params_get_buffer_size(params, &ulongParam);
-    DEBUGPRINT("buffer size %lu | %u", ulongParam, dev.bufferSize * dev.hwstatus.periods);
+    DEBUGPRINT("buffer size %lu | %u", ulongParam, dev.hwstatus.periodSize * dev.hwstatus.periods);
     dev.hwstatus.fullBufferSize = ulongParam;
 
     dev.deviceID = strdup(deviceID);
     dev.enabled = true;
 
     {
-        const uint8_t channels = dev.hwstatus.channels;
-        const uint16_t blocks = (playback ? AUDIO_BRIDGE_PLAYBACK_RINGBUFFER_BLOCKS
-                                          : AUDIO_BRIDGE_CAPTURE_RINGBUFFER_BLOCKS);
-        const size_t rawbufferlen = getSampleSizeFromHints(dev.hints) * dev.bufferSize * channels * 2;
+        deviceAllocBuffers(dev);
+        notifierInit(&dev.notifier);
+        DEBUGPRINT("target is %f", dev.rbFillTarget);
+
+        DeviceAudio* const devptr = new DeviceAudio;
+        std::memcpy(devptr, &dev, sizeof(dev));
+
+        if (dev.options.lockMemory)
+            deviceLockMemory();
+
+        return devptr;
+    }
+
+error:
+    snd_pcm_close(dev.pcm);
+    return nullptr;
+}
+
+DeviceAudio* initDeviceAudio(const char* const deviceID,
+                             const bool playback,
+                             const uint32_t bufferSize,
+                             const uint32_t sampleRate,
+                             const DeviceAudioOptions* const options)
+{
+    DeviceAudio* const dev = deviceOpen(deviceID, playback, bufferSize, sampleRate, options, false);
+
+    if (dev == nullptr)
+        return nullptr;
+
+    // the device thread is still created, but stays parked until drift is detected
+    if (dev->options.synchronous && deviceSyncSupported(dev))
+        dev->hints |= kDeviceSync;
+
+    if (dev->options.workerPool && (dev->hints & kDeviceSync) == 0)
+    {
+        if (devicePoolAdd(dev))
+            return dev;
+
+        DEBUGPRINT("%s | worker pool is full, using a dedicated thread", deviceID);
+
+        if (dev->hints & kDeviceCapture)
+            deviceSetAvailMin(dev, 1);
+    }
 
-        dev.buffers.raw = new int8_t[rawbufferlen * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT];
-        dev.buffers.f32 = new float*[channels];
+    if (! deviceCreateThread(dev, playback ? devicePlaybackThread : deviceCaptureThread))
+    {
+        closeDeviceAudio(dev);
+        return nullptr;
+    }
 
-        for (uint8_t c=0; c<channels; ++c)
-            dev.buffers.f32[c] = new float[dev.bufferSize * 2 * AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT];
+    return dev;
+}
 
-        sem_init(&dev.sem, 0, 0);
+DeviceAudio* initDeviceAudioDuplex(const char* const deviceID,
+                                   const uint32_t bufferSize,
+                                   const uint32_t sampleRate,
+                                   const DeviceAudioOptions* const options)
+{
+    DeviceAudio* const capture = deviceOpen(deviceID, false, bufferSize, sampleRate, options, true);
 
-        dev.ringbuffer = new AudioRingBuffer;
-        dev.ringbuffer->createBuffer(channels, dev.bufferSize * blocks);
+    if (capture == nullptr)
+        return nullptr;
 
-        dev.rbFillTarget = static_cast<double>(playback ? 1 : AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS) / blocks;
-        dev.rbTotalNumSamples = dev.bufferSize * blocks / kRingBufferDataFactor;
-        dev.rbRatio = 1.0;
-        printf("target is %f\n", dev.rbFillTarget);
+    DeviceAudio* const playback = deviceOpen(deviceID, true, bufferSize, sampleRate, options, true);
 
-        DeviceAudio* const devptr = new DeviceAudio;
-        std::memcpy(devptr, &dev, sizeof(dev));
+    if (playback == nullptr)
+    {
+        closeDeviceAudio(capture);
+        return nullptr;
+    }
 
-        void* (*threadCall)(void*) = playback ? devicePlaybackThread : deviceCaptureThread;
+    int err;
+    if ((err = snd_pcm_link(capture->pcm, playback->pcm)) != 0)
+    {
+        DEBUGPRINT("snd_pcm_link fail %s", snd_strerror(err));
+        closeDeviceAudio(playback);
+        closeDeviceAudio(capture);
+        return nullptr;
+    }
 
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-        pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-        sched_param sched = {};
-        sched.sched_priority = playback ? 69 : 70;
-        pthread_attr_setschedparam(&attr, &sched);
-        if (pthread_create(&devptr->thread, &attr, threadCall, devptr) != 0)
+    capture->duplexPeer = playback;
+
+    if (! deviceCreateThread(capture, deviceDuplexThread))
+    {
+        closeDeviceAudio(capture);
+        return nullptr;
+    }
+
+    return capture;
+}
+
+// applies a freewheel change from the host audio thread
+static void deviceSetFreewheeling(DeviceAudio* const dev, const bool freewheeling)
+{
+    DEBUGPRINT("%08u | %s | %s freewheel mode", dev->frame,
+               dev->hints & kDeviceCapture ? "capture" : "playback", freewheeling ? "entering" : "leaving");
+
+    // synchronous mode has no thread keeping the device going, so stop it and start again afterwards
+    if (dev->hints & kDeviceSync)
+    {
+        if (freewheeling)
         {
-            pthread_attr_destroy(&attr);
-            pthread_attr_init(&attr);
-            if (pthread_create(&devptr->thread, &attr, threadCall, devptr) != 0)
-            {
-                pthread_attr_destroy(&attr);
-                goto error;
-            }
+            snd_pcm_drop(dev->pcm);
+        }
+        else
+        {
+            snd_pcm_prepare(dev->pcm);
+            deviceFailInitHints(dev);
+            dev->sync = {};
         }
-        pthread_attr_destroy(&attr);
-
-        return devptr;
     }
 
-error:
-    snd_pcm_close(dev.pcm);
-    return nullptr;
+    __atomic_store_n(&dev->freewheeling, freewheeling, __ATOMIC_RELEASE);
 }
 
 bool runDeviceAudio(DeviceAudio* const dev, float* buffers[])
 {
     const uint32_t frame = dev->frame;
 
+    if (__atomic_load_n(&dev->freewheel, __ATOMIC_ACQUIRE) != dev->freewheeling)
+        deviceSetFreewheeling(dev, ! dev->freewheeling);
+
+    // skip ringbuffer and drift compensation, the device thread keeps the device itself running
+    if (dev->freewheeling)
+    {
+        if (dev->hints & kDeviceCapture)
+            clearCaptureBuffers(dev, buffers);
+
+        dev->frame += dev->bufferSize;
+        return dev->hints & kDevicePooled ? devicePoolIsRunning(dev) : dev->thread != 0;
+    }
+
+    // synchronous mode hands over to the asynchronous path on the same cycle when clock drift is detected
+    if ((dev->hints & kDeviceSync) == 0 || ! runDeviceAudioSync(dev, buffers))
+    {
+        if (dev->hints & kDeviceCapture)
+            runDeviceAudioCapture(dev, buffers, frame);
+        else
+            runDeviceAudioPlayback(dev, buffers, frame);
+    }
+
+    dev->frame += dev->bufferSize;
+
+    if (dev->hints & kDevicePooled)
+        return devicePoolIsRunning(dev);
+
+    return dev->thread != 0;
+}
+
+uint32_t getDeviceAudioLatency(const DeviceAudio* const dev)
+{
+    const uint32_t periodSize = dev->hwstatus.periodSize;
+    uint32_t hwLatency;
+
+    // no ringbuffer involved, only the safety margin plus the period being transferred
+    if (dev->hints & kDeviceSync)
+        return periodSize * (AUDIO_BRIDGE_SYNC_SAFETY_PERIODS + 1);
+
+    if (const uint32_t measured = __atomic_load_n(&dev->latency.measured, __ATOMIC_RELAXED))
+        return getRingBufferFillTarget(dev) + measured;
+
     if (dev->hints & kDeviceCapture)
-        runDeviceAudioCapture(dev, buffers, frame);
+        hwLatency = periodSize * dev->stats.captureBlocks;
+    else if (dev->options.lowLatencyStart)
+        hwLatency = getPlaybackStartFrames(dev);
     else
-        runDeviceAudioPlayback(dev, buffers, frame);
+        hwLatency = dev->hwstatus.fullBufferSize;
+
+    return getRingBufferFillTarget(dev) + hwLatency;
+}
+
+void setDeviceAudioExtraLatency(DeviceAudio* const dev, uint32_t frames)
+{
+    // keep the target within the first half of the ringbuffer, so there is still room for jitter
+    const uint32_t blockSize = std::max(dev->bufferSize, dev->hwstatus.periodSize);
+    const uint32_t targetBlocks = dev->hints & kDeviceCapture ? AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS : 1;
+    const uint32_t maxFrames = blockSize * std::max<uint32_t>(targetBlocks, getRingBufferBlocks(dev) / 2)
+                             - blockSize * targetBlocks;
+
+    frames = std::min(frames, maxFrames);
+
+    if (dev->rbExtraLatency == frames)
+        return;
+
+    DEBUGPRINT("%s | extra latency %u frames", dev->deviceID, frames);
+    dev->rbExtraLatency = frames;
+    deviceUpdateFillTarget(dev);
+}
+
+void setDeviceAudioFreewheel(DeviceAudio* const dev, const bool freewheel)
+{
+    __atomic_store_n(&dev->freewheel, freewheel, __ATOMIC_RELEASE);
+}
+
+bool runDeviceAudioDuplex(DeviceAudio* const dev, float* captureBuffers[], float* playbackBuffers[])
+{
+    DeviceAudio* const playback = dev->duplexPeer;
+    const uint32_t frame = dev->frame;
+
+    if (__atomic_load_n(&dev->freewheel, __ATOMIC_ACQUIRE) != dev->freewheeling)
+    {
+        deviceSetFreewheeling(dev, ! dev->freewheeling);
+        deviceSetFreewheeling(playback, dev->freewheeling);
+    }
+
+    if (dev->freewheeling)
+    {
+        clearCaptureBuffers(dev, captureBuffers);
+
+        dev->frame += dev->bufferSize;
+        playback->frame += playback->bufferSize;
+        return dev->thread != 0;
+    }
+
+    runDeviceAudioPlayback(playback, playbackBuffers, frame);
+    runDeviceAudioCapture(dev, captureBuffers, frame);
+
+    // both directions run from the same hardware clock, playback resamples the other way around
+    playback->rbRatio = 1.0 / dev->rbRatio;
+
+    if (deviceStartupStage(dev, kDeviceStartupDriftActive) != 0)
+        deviceMarkStartup(playback, kDeviceStartupDriftActive);
+    if (deviceStartupStage(dev, kDeviceStartupDriftLocked) != 0)
+        deviceMarkStartup(playback, kDeviceStartupDriftLocked);
 
     dev->frame += dev->bufferSize;
+    playback->frame += playback->bufferSize;
 
     return dev->thread != 0;
 }
 
 void closeDeviceAudio(DeviceAudio* const dev)
 {
-    const uint8_t channels = dev->hwstatus.channels;
+    const uint16_t channels = dev->hwstatus.channels;
+    DeviceAudio* const peer = dev->duplexPeer;
 
     if (dev->thread != 0)
     {
+        // the duplex thread checks both sides, so stop the peer too
+        const uint32_t peerChannels = peer != nullptr ? peer->hwstatus.channels : 0;
+
         dev->hwstatus.channels = 0;
-        sem_post(&dev->sem);
+        if (peer != nullptr)
+            peer->hwstatus.channels = 0;
+
+        notifierPost(&dev->notifier);
+        if (peer != nullptr)
+            notifierPost(&peer->notifier);
+
         pthread_join(dev->thread, nullptr);
-        snd_pcm_close(dev->pcm);
+
+        if (peer != nullptr)
+            peer->hwstatus.channels = peerChannels;
+    }
+
+    if (dev->hints & kDevicePooled)
+    {
+        dev->hwstatus.channels = 0;
+        notifierPost(&dev->notifier);
+        devicePoolRemove(dev);
+    }
+
+    if (peer != nullptr)
+    {
+        snd_pcm_unlink(dev->pcm);
+        closeDeviceAudio(peer);
     }
 
-    sem_destroy(&dev->sem);
+    snd_pcm_close(dev->pcm);
+
+    DEBUGPRINT("%s | notifier stats | %u posts, %u wakeups, %u elided",
+               dev->deviceID, dev->notifier.numPosts, dev->notifier.numWakeups, dev->notifier.numElided);
+    DEBUGPRINT("%s | ringbuffer stats | %u dropped frames, %u blocked waits",
+               dev->deviceID, dev->stats.droppedFrames, dev->stats.blockedWaits);
 
     std::free(dev->deviceID);
 
-    for (uint8_t c=0; c<channels; ++c)
-        delete[] dev->buffers.f32[c];
-    delete[] dev->buffers.f32;
-    delete[] dev->buffers.raw;
+    deviceFreeBuffers(dev, channels);
 
     delete dev;
 }
@@ -518,25 +1746,76 @@ static void setDeviceTimings(DeviceAudio* const dev)
 {
     if (dev->hints & kDeviceBuffering)
         return;
-    if (dev->framesDone < dev->sampleRate * AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY)
+    // duplex playback follows the capture side, see runDeviceAudioDuplex
+    if ((dev->hints & (kDeviceDuplex|kDeviceCapture)) == kDeviceDuplex)
         return;
+    if (dev->framesDone < dev->sampleRate * AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY_MS / 1000)
+        return;
+
+    deviceMarkStartup(dev, kDeviceStartupDriftActive);
 
-    const double rbratio = 2.0 - (
-        dev->ringbuffer->getNumReadableSamples() / (double)kRingBufferDataFactor / dev->rbTotalNumSamples / dev->rbFillTarget
-        + AUDIO_BRIDGE_CLOCK_FILTER_STEPS_1 - 1
-    ) / AUDIO_BRIDGE_CLOCK_FILTER_STEPS_1;
+    // the ringbuffer fill jumps by a full device period at a time,
+    // so make sure the short filter spans enough of those when device periods are bigger than the host ones
+    const uint32_t periodFactor = std::max<uint32_t>(1, dev->hwstatus.periodSize / dev->bufferSize);
+    const double filterSteps1 = dev->rbFilterSteps1 * periodFactor;
+    const double filterSteps2 = dev->rbFilterSteps2;
+
+    double fillFrames = dev->ringbuffer->getNumReadableSamples();
+
+    // playback drains the ringbuffer into the device as soon as there is room, so right after a host write
+    // its fill sits at the 1 block target whether the device buffer behind it is full or draining.
+    // count how far the device side fell from where it was when the filter started, so a fast device shows up
+    if ((dev->hints & kDeviceCapture) == 0)
+    {
+        if (const uint32_t measured = __atomic_load_n(&dev->latency.measured, __ATOMIC_RELAXED))
+        {
+            if (dev->latency.reference == 0)
+                dev->latency.reference = measured;
+
+            fillFrames += static_cast<double>(measured) - dev->latency.reference;
+        }
+    }
+
+    const double rbfill = std::max(0.0, fillFrames) / (double)kRingBufferDataFactor
+                        / dev->rbTotalNumSamples / dev->rbFillTarget;
+
+    const double rbratio = 2.0 - (rbfill + filterSteps1 - 1) / filterSteps1;
 
     const double balratio = std::max(0.9, std::min(1.1,
-        (rbratio + dev->rbRatio * (AUDIO_BRIDGE_CLOCK_FILTER_STEPS_2 - 1)) / AUDIO_BRIDGE_CLOCK_FILTER_STEPS_2
+        (rbratio + dev->rbRatio * (filterSteps2 - 1)) / filterSteps2
     ));
 
+    // fast acquisition: start with short filters, relax them to the long ones once the fill stays near target
+    if (dev->rbFilterSteps2 < AUDIO_BRIDGE_CLOCK_FILTER_STEPS_2)
+    {
+        if (deviceStartupStage(dev, kDeviceStartupDriftLocked) == 0)
+        {
+            if (std::abs(rbfill - 1.0) > AUDIO_BRIDGE_CLOCK_LOCK_THRESHOLD)
+                dev->rbLockFrames = 0;
+            else if ((dev->rbLockFrames += dev->bufferSize) >= dev->sampleRate * AUDIO_BRIDGE_CLOCK_LOCK_TIME_MS / 1000)
+                deviceMarkStartup(dev, kDeviceStartupDriftLocked);
+        }
+        else
+        {
+            // doubles the steps once per second of audio, whatever the host buffer size
+            const double relax = std::exp2(static_cast<double>(dev->bufferSize) / dev->sampleRate);
+            dev->rbFilterSteps1 = std::min<double>(AUDIO_BRIDGE_CLOCK_FILTER_STEPS_1, dev->rbFilterSteps1 * relax);
+            dev->rbFilterSteps2 = std::min<double>(AUDIO_BRIDGE_CLOCK_FILTER_STEPS_2, dev->rbFilterSteps2 * relax);
+        }
+    }
+
     if (std::abs(dev->rbRatio - balratio) > 0.000000002)
         dev->rbRatio = balratio;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
 
+#include "audio-device-resampler.cpp"
 #include "audio-capture.cpp"
+#include "audio-device-cache.cpp"
 #include "audio-playback.cpp"
+#include "audio-duplex.cpp"
+#include "audio-device-pool.cpp"
+#include "audio-device-sync.cpp"
 
 // --------------------------------------------------------------------------------------------------------------------
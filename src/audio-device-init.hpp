@@ -7,22 +7,32 @@
 //#define ALSA_PCM_NEW_SW_PARAMS_API
 #include <alsa/asoundlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "RingBuffer.hpp"
 #include "ValueSmoother.hpp"
+#include "audio-debug.hpp"
+#include "audio-notifier.hpp"
 
 #include "zita-resampler/vresampler.h"
 
 // --------------------------------------------------------------------------------------------------------------------
 
-// how many seconds to wait until start trying to compensate for clock drift
-#define AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY 2
+// how many milliseconds to wait until start trying to compensate for clock drift
+#define AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY_MS 200
 
 // how many steps to use for smoothing the clock-drift compensation filter
 #define AUDIO_BRIDGE_CLOCK_FILTER_STEPS_1 1024
 #define AUDIO_BRIDGE_CLOCK_FILTER_STEPS_2 8192
 
+// how many steps to use for the clock-drift filter during fast acquisition, right after starting
+#define AUDIO_BRIDGE_CLOCK_FILTER_FAST_STEPS_1 64
+#define AUDIO_BRIDGE_CLOCK_FILTER_FAST_STEPS_2 512
+
+// how close to the ringbuffer fill target (relative), and for how many milliseconds, to consider drift locked
+// once locked the filter relaxes towards the long steps above, doubling them every second
+#define AUDIO_BRIDGE_CLOCK_LOCK_THRESHOLD 0.05
+#define AUDIO_BRIDGE_CLOCK_LOCK_TIME_MS 500
+
 // how many audio buffer-size capture blocks to store until rolling starts
 // must be > 0
 #define AUDIO_BRIDGE_CAPTURE_LATENCY_BLOCKS 8
@@ -31,11 +41,76 @@
 #define AUDIO_BRIDGE_CAPTURE_RINGBUFFER_BLOCKS 32
 
 // prefer to read in big blocks, higher latency but more stable capture
+// this is the default upper bound, the capture thread adapts its read size at runtime
 #define AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT 8
 
+// default lower bound for capture read size, in device periods
+#define AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MIN 2
+
+// how many seconds of stable capture until trying to read in smaller blocks
+#define AUDIO_BRIDGE_CAPTURE_STABLE_DELAY 10
+
 // how many audio buffer-size blocks to keep in the playback ringbuffer
 #define AUDIO_BRIDGE_PLAYBACK_RINGBUFFER_BLOCKS 8
 
+// how many frames to use for fading in and out around an xrun
+#define AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES 64
+
+// how many in-place xrun recoveries are allowed within 1 second before doing a full restart
+#define AUDIO_BRIDGE_XRUN_MAX_RECOVERIES 3
+
+// default for how many ALSA periods of silence to prefill before starting playback, when using low-latency start.
+// this is the device side target delay, 1 period being written while the other one plays
+#define AUDIO_BRIDGE_PLAYBACK_START_PERIODS 2
+
+// how many known-good hw param configurations to remember, see AUDIO_BRIDGE_PARAMS_CACHE
+#define AUDIO_BRIDGE_PARAMS_CACHE_SIZE 32
+
+// how many host periods the capture thread may block waiting for ringbuffer space, when using kDeviceOverflowBlock
+#define AUDIO_BRIDGE_OVERFLOW_DEADLINE_PERIODS 4
+
+// default realtime priority for the device threads (capture uses this value, playback 1 less)
+#define AUDIO_BRIDGE_DEVICE_THREAD_PRIORITY 70
+
+// how much of the device thread stack to touch on startup, so it does not page-fault later
+#define AUDIO_BRIDGE_DEVICE_THREAD_STACK_PREFAULT (64 * 1024)
+
+// how many devices the shared worker pool can service, see DeviceAudioOptions::workerPool
+#define AUDIO_BRIDGE_POOL_MAX_DEVICES 32
+
+// how many pool workers to use when no CPU affinity is set, otherwise there is 1 worker per selected CPU
+#define AUDIO_BRIDGE_POOL_DEFAULT_WORKERS 2
+
+// how many pipeline steps a worker runs for a device before giving other devices a turn
+#define AUDIO_BRIDGE_POOL_MAX_STEPS 4
+
+// maximum number of channel groups resampled in parallel, each group with at least a minimum amount of channels
+#define AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS 4
+#define AUDIO_BRIDGE_RESAMPLER_GROUP_MIN_CHANNELS 8
+
+// resampling cost, as a percentage of the audio duration, above which channel groups are processed in parallel
+#define AUDIO_BRIDGE_RESAMPLER_PARALLEL_PERCENT 25
+
+// how many resampler runs to average the cost over
+#define AUDIO_BRIDGE_RESAMPLER_MEASURE_RUNS 64
+
+// how many device thread iterations to average the measured device and resampler delay over, for latency reporting
+#define AUDIO_BRIDGE_LATENCY_AVERAGE_STEPS 512
+
+// how many device periods synchronous mode keeps queued, as margin against host scheduling jitter
+#define AUDIO_BRIDGE_SYNC_SAFETY_PERIODS 1
+
+// how many milliseconds synchronous mode averages the device buffer level over, for verifying the clocks stay locked
+#define AUDIO_BRIDGE_SYNC_LOCK_WINDOW_MS 1000
+
+// how far the averaged device buffer level may move away from its initial value, as a percentage of a period,
+// before synchronous mode considers the clocks to be drifting and falls back to the asynchronous path
+#define AUDIO_BRIDGE_SYNC_MAX_DRIFT_PERCENT 25
+
+// maximum number of channels bridged per device direction, wider devices only get their first channels bridged
+// unless a channel map selects others, see DeviceAudioOptions::channelMap
+#define AUDIO_BRIDGE_MAX_CHANNELS 128
+
 // --------------------------------------------------------------------------------------------------------------------
 
 enum DeviceHints {
@@ -47,13 +122,18 @@ enum DeviceHints {
     kDeviceSample24 = 0x20,
     kDeviceSample24LE3 = 0x40,
     kDeviceSample32 = 0x80,
-    kDeviceSampleHints = kDeviceSample16|kDeviceSample24|kDeviceSample24LE3|kDeviceSample32
+    kDeviceSampleHints = kDeviceSample16|kDeviceSample24|kDeviceSample24LE3|kDeviceSample32,
+    kDeviceNonInterleaved = 0x100,
+    kDeviceDuplex = 0x200,
+    kDevicePooled = 0x400,
+    kDeviceSync = 0x800,
+    kDeviceChannelMap = 0x1000
 };
 
 static constexpr const uint8_t kRingBufferDataFactor = 32;
 
 static inline constexpr
-uint8_t getSampleSizeFromHints(const uint8_t hints)
+uint8_t getSampleSizeFromHints(const uint32_t hints)
 {
     return hints & kDeviceSample16 ? sizeof(int16_t) :
            hints & kDeviceSample24 ? sizeof(int32_t) :
@@ -64,44 +144,224 @@ uint8_t getSampleSizeFromHints(const uint8_t hints)
 
 // --------------------------------------------------------------------------------------------------------------------
 
+// stages of the device startup, timestamps are kept for each so time-to-audio can be measured
+enum DeviceStartupStage {
+    // initDeviceAudio called
+    kDeviceStartupOpen = 0,
+    // hw and sw params set up, device prepared
+    kDeviceStartupConfigured,
+    // device thread running with its scheduling set up
+    kDeviceStartupThreadReady,
+    // first host audio cycle seen by the device thread
+    kDeviceStartupHostPost,
+    // kDeviceInitializing removed
+    kDeviceStartupInitialized,
+    // kDeviceStarting removed
+    kDeviceStartupStarted,
+    // kDeviceBuffering removed, audio is flowing
+    kDeviceStartupAudio,
+    // clock drift compensation started
+    kDeviceStartupDriftActive,
+    // clock drift compensation locked, filter relaxing to long steps
+    kDeviceStartupDriftLocked,
+    kDeviceStartupStageCount
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+
+enum DeviceSchedPolicy {
+    kDeviceSchedOther = 0,
+    kDeviceSchedFIFO,
+    kDeviceSchedRR,
+    kDeviceSchedDeadline,
+};
+
+enum DeviceOverflowPolicy {
+    // wait for space until a deadline, then drop the newest data
+    kDeviceOverflowBlock = 0,
+    // drop data that does not fit
+    kDeviceOverflowDropNewest,
+    // ask the reader side to discard old data to make room
+    kDeviceOverflowDropOldest,
+};
+
+struct DeviceAudioOptions {
+    // scheduling policy for the device thread, see DeviceSchedPolicy
+    uint8_t rtPolicy;
+    // realtime priority used for capture, playback uses 1 less
+    int rtPriority;
+    // SCHED_DEADLINE runtime as a percentage of the device period time
+    uint8_t rtDeadlinePercent;
+    // CPU affinity mask for the device thread, 0 for no affinity
+    uint64_t cpuAffinity;
+    // lock all current and future process memory
+    bool lockMemory;
+    // ALSA period size, 0 to match the host buffer size
+    uint32_t periodSize;
+    // number of ALSA periods, 0 to try the built-in defaults
+    uint8_t periods;
+    // bounds for how many ALSA periods the capture thread reads at once
+    uint8_t captureMinBlocks;
+    uint8_t captureMaxBlocks;
+    // what to do when the capture ringbuffer is full, see DeviceOverflowPolicy
+    uint8_t overflowPolicy;
+    // start playback explicitly after prefilling only the target delay, instead of filling the whole ALSA buffer
+    bool lowLatencyStart;
+    // target delay for low-latency start in ALSA periods, limited to 1 less than the number of periods
+    uint8_t startPeriods;
+    // prefer non-interleaved access when the device supports it, matching the planar host buffers
+    bool nonInterleaved;
+    // service the device from a shared pool of realtime workers instead of its own thread
+    bool workerPool;
+    // maximum number of threads for resampling channel groups in parallel, 1 to always use the device thread
+    uint8_t resampleThreads;
+    // do device I/O directly from the host audio callback, for devices sharing the host clock
+    bool synchronous;
+    // how many device channels to ask for, the nearest supported amount is used if not possible
+    uint16_t channels;
+    // device channels to bridge (0-based, in host channel order), all of them if numMappedChannels is 0
+    uint16_t channelMap[AUDIO_BRIDGE_MAX_CHANNELS];
+    uint16_t numMappedChannels;
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+
 struct DeviceAudio {
     struct HWStatus {
+        // bridged channels, either all device channels or the ones selected by the channel map
         uint32_t channels;
+        // channels of the ALSA stream
+        uint32_t deviceChannels;
         uint32_t periods;
         uint32_t periodSize;
         uint32_t fullBufferSize;
     } hwstatus;
 
     char* deviceID;
+    DeviceAudioOptions options;
 
     snd_pcm_t* pcm;
     uint32_t frame;
-    uint32_t framesDone;
+    uint64_t framesDone;
     uint32_t sampleRate;
     uint32_t bufferSize;
     uint32_t hints;
     bool enabled;
+    // freewheel mode requested by the host, applied on the next audio cycle, see setDeviceAudioFreewheel
+    bool freewheel;
+    // freewheel mode as applied by the host audio thread, device threads follow this one
+    bool freewheeling;
 
     struct {
+        // device format data, interleaved or one block of rawChannelStride bytes per channel
         int8_t* raw;
+        uint32_t rawChannelStride;
+        // per-channel pointers into raw, used for non-interleaved access
+        void** rawptrs;
+        // rawptrs of the bridged channels only, used for non-interleaved access with kDeviceChannelMap
+        void** mapptrs;
         float** f32;
     } buffers;
 
+    struct Stats {
+        // xruns on the device side
+        uint32_t xruns;
+        // not enough data (capture) or space (playback) in the ringbuffer on the host side
+        uint32_t rbFailures;
+        // xruns recovered in place, without a full restart
+        uint32_t recoveries;
+        // frames discarded due to a full ringbuffer, either newest or oldest
+        uint32_t droppedFrames;
+        // times the device thread had to wait for ringbuffer space (capture),
+        // or for data while the device buffer was down to its last period (playback)
+        uint32_t blockedWaits;
+        // how many ALSA periods the capture thread currently reads at once
+        uint32_t captureBlocks;
+    } stats;
+
+    struct Startup {
+        // reference time, either initDeviceAudio call or last full restart
+        uint64_t base;
+        // CLOCK_MONOTONIC timestamps for each DeviceStartupStage, 0 if not reached yet.
+        // written from both host and device threads, see deviceStartupStage and deviceMarkStartup
+        uint64_t stages[kDeviceStartupStageCount];
+        bool printed;
+    } startup;
+
+    // device thread latency measurements, see getDeviceAudioLatency
+    struct Latency {
+        // running average of device buffer plus resampler delay, only used by the device thread
+        double average;
+        // last published average in frames, 0 until measured
+        uint32_t measured;
+        // playback device side level when the drift filter started, only used by the host thread
+        uint32_t reference;
+    } latency;
+
+    // synchronous mode clock lock verification, only used with kDeviceSync
+    struct Sync {
+        // cycles, frames and summed device buffer levels within the current window
+        uint32_t windowCycles;
+        uint32_t windowFrames;
+        uint64_t windowLevel;
+        // averaged level of the first window, later windows must stay close to it
+        double baseLevel;
+    } sync;
+
     pthread_t thread;
-    sem_t sem;
+    Notifier notifier;
+
+    // playback side of a duplex device, linked to this capture one and serviced by the same thread
+    DeviceAudio* duplexPeer;
+
+    // worker pool slot, only valid with kDevicePooled
+    uint32_t poolSlot;
 
     AudioRingBuffer* ringbuffer;
+    uint32_t rbSkipRequest;
     double rbFillTarget;
     double rbTotalNumSamples;
     double rbRatio = 1.0;
+    double rbFilterSteps1;
+    double rbFilterSteps2;
+    uint32_t rbLockFrames;
+    // added on top of the ringbuffer fill target, see setDeviceAudioExtraLatency
+    uint32_t rbExtraLatency;
 };
 
 // --------------------------------------------------------------------------------------------------------------------
 
-DeviceAudio* initDeviceAudio(const char* deviceID, bool playback, uint16_t bufferSize, uint32_t sampleRate);
+void initDeviceAudioOptions(DeviceAudioOptions* options);
+void loadDeviceAudioOptionsFromEnv(DeviceAudioOptions* options);
+
+// sets the channel map from a list of 1-based device channels and ranges, like "1,2" or "3-6,9".
+// an empty list selects all channels, returns false if the list is invalid
+bool parseDeviceChannelMap(DeviceAudioOptions* options, const char* map);
+
+DeviceAudio* initDeviceAudio(const char* deviceID, bool playback, uint32_t bufferSize, uint32_t sampleRate,
+                             const DeviceAudioOptions* options = nullptr);
 bool runDeviceAudio(DeviceAudio* dev, float* buffers[]);
 void closeDeviceAudio(DeviceAudio* dev);
 
-#define DEBUGPRINT(...) { printf(__VA_ARGS__); puts(""); }
+// total latency in frames between the host buffers and the device, with the ringbuffer at its target fill.
+// uses the device buffer and resampler delay measured by the device thread, or an estimate until those are known
+uint32_t getDeviceAudioLatency(const DeviceAudio* dev);
+
+// adds extra latency in frames to the ringbuffer fill target, used for aligning several devices to a common latency.
+// the value is clamped to what the ringbuffer can hold while still leaving room for jitter
+void setDeviceAudioExtraLatency(DeviceAudio* dev, uint32_t frames);
+
+// sets freewheel (offline) mode, safe to call from any thread and applied on the next host audio cycle.
+// while freewheeling the host side skips the device entirely, device threads keep the device running on their own
+// without touching the ringbuffer, so fill level and drift compensation continue where they were once back to realtime.
+// for duplex devices this applies to both sides
+void setDeviceAudioFreewheel(DeviceAudio* dev, bool freewheel);
+
+// opens both directions of a device with their PCMs linked, so they start and stop together.
+// a single thread services both and playback follows the capture clock drift estimate.
+// returns the capture side, with the playback side available as `duplexPeer`.
+DeviceAudio* initDeviceAudioDuplex(const char* deviceID, uint32_t bufferSize, uint32_t sampleRate,
+                                   const DeviceAudioOptions* options = nullptr);
+bool runDeviceAudioDuplex(DeviceAudio* dev, float* captureBuffers[], float* playbackBuffers[]);
 
 // --------------------------------------------------------------------------------------------------------------------
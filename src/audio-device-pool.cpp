@@ -0,0 +1,430 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-init.hpp"
+#include "audio-utils.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+// --------------------------------------------------------------------------------------------------------------------
+// Optional pool of realtime workers servicing many devices, instead of one thread per device.
+// Workers sleep on the capture device poll descriptors, while playback devices are serviced on the same
+// timed cadence the dedicated threads use (their avail_min is 0, so polling them would spin).
+// Each worker services its own devices first and steals from others when those have not been serviced in time.
+// Device steps never block when pooled, they return kDeviceStepWait and resume on a later call,
+// so a device waiting on its ringbuffer or host does not hold up the other devices of the same worker.
+
+struct DevicePoolSlot {
+    DeviceAudio* dev;
+    DeviceCaptureState* capture;
+    DevicePlaybackState* playback;
+    // worker index + 1 while being serviced, 0 when unclaimed, -1 while being removed
+    int32_t owner;
+    // worker that services this slot by default
+    uint32_t home;
+    // last time any worker serviced this slot, used for deciding when to steal it
+    uint64_t lastServiced;
+    // host has posted at least once
+    bool started;
+    // capture is waiting for ringbuffer space, its poll descriptors are left out meanwhile so workers do not spin
+    bool blocked;
+    // false once the pipeline failed or was closed
+    bool running;
+};
+
+static DevicePoolSlot sPoolSlots[AUDIO_BRIDGE_POOL_MAX_DEVICES];
+static pthread_t sPoolThreads[64];
+static uint32_t sPoolNumWorkers = 0;
+static uint32_t sPoolNumDevices = 0;
+static uint32_t sPoolGeneration = 0;
+static uint8_t sPoolRtPolicy = kDeviceSchedOther;
+static int sPoolWakeFd = -1;
+static bool sPoolQuit = false;
+static pthread_mutex_t sPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// makes workers pick up slot changes
+static void devicePoolWake()
+{
+    __atomic_add_fetch(&sPoolGeneration, 1, __ATOMIC_SEQ_CST);
+
+    const uint64_t value = 1;
+    if (write(sPoolWakeFd, &value, sizeof(value)) != sizeof(value))
+        DEBUGPRINT("pool | failed to wake workers");
+}
+
+// collects the descriptors to sleep on, and the shortest wait period of all devices.
+// never blocks on the pool mutex, returns false if it is busy so the caller can try again later
+static bool devicePoolRebuild(struct pollfd* const fds, nfds_t& nfds, uint64_t& timeoutNs)
+{
+    const nfds_t maxfds = AUDIO_BRIDGE_POOL_MAX_DEVICES * 2 + 1;
+
+    if (pthread_mutex_trylock(&sPoolMutex) != 0)
+        return false;
+
+    fds[0].fd = sPoolWakeFd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    nfds = 1;
+    timeoutNs = 1000000000ULL;
+
+    for (uint32_t i=0; i<AUDIO_BRIDGE_POOL_MAX_DEVICES; ++i)
+    {
+        const DevicePoolSlot& slot(sPoolSlots[i]);
+        DeviceAudio* const dev = slot.dev;
+
+        if (dev == nullptr || ! slot.running)
+            continue;
+
+        // same period as deviceTimedWait
+        const uint32_t frames = std::min(dev->bufferSize, dev->hwstatus.periodSize);
+        timeoutNs = std::min<uint64_t>(timeoutNs,
+                                       static_cast<uint64_t>(frames) * 1000000000ULL / dev->sampleRate
+                                       / AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT);
+
+        if (slot.capture != nullptr && slot.started && ! slot.blocked)
+        {
+            const int count = snd_pcm_poll_descriptors(dev->pcm, fds + nfds, maxfds - nfds);
+
+            if (count > 0)
+                nfds += count;
+        }
+    }
+
+    pthread_mutex_unlock(&sPoolMutex);
+    return true;
+}
+
+static void devicePoolService(DevicePoolSlot& slot, const uint32_t index)
+{
+    if (__atomic_load_n(&slot.dev, __ATOMIC_ACQUIRE) == nullptr)
+        return;
+
+    int32_t expected = 0;
+    if (! __atomic_compare_exchange_n(&slot.owner, &expected, static_cast<int32_t>(index + 1),
+                                      false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    DeviceAudio* const dev = slot.dev;
+
+    if (dev != nullptr && slot.running)
+    {
+        if (! slot.started && notifierTryWait(&dev->notifier))
+        {
+            slot.started = true;
+            deviceMarkStartup(dev, kDeviceStartupHostPost);
+
+            // include the device poll descriptors from now on
+            __atomic_add_fetch(&sPoolGeneration, 1, __ATOMIC_SEQ_CST);
+        }
+
+        if (slot.started)
+        {
+            devicePrintStartup(dev);
+
+            for (uint32_t i=0; i<AUDIO_BRIDGE_POOL_MAX_STEPS; ++i)
+            {
+                const DeviceThreadStep step = slot.capture != nullptr ? deviceCaptureStep(*slot.capture)
+                                                                      : devicePlaybackStep(*slot.playback);
+
+                if (step == kDeviceStepWait)
+                    break;
+
+                if (step == kDeviceStepClose)
+                {
+                    DEBUGPRINT("%08u | pool worker %u | device %s closed", dev->frame, index, dev->deviceID);
+                    __atomic_store_n(&slot.running, false, __ATOMIC_SEQ_CST);
+                    __atomic_add_fetch(&sPoolGeneration, 1, __ATOMIC_SEQ_CST);
+                    break;
+                }
+            }
+
+            // steps never block in the pool, a capture device waiting for ringbuffer space is retried on timeout
+            const bool blocked = slot.capture != nullptr && slot.capture->pendingFrames != 0;
+
+            if (slot.blocked != blocked)
+            {
+                slot.blocked = blocked;
+                __atomic_add_fetch(&sPoolGeneration, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+
+    slot.lastServiced = getTimeNs();
+    __atomic_store_n(&slot.owner, 0, __ATOMIC_RELEASE);
+}
+
+static void devicePoolWorkerInit(const uint32_t index)
+{
+    // touch the stack now, so page faults do not happen later during audio processing
+    {
+        volatile uint8_t stack[AUDIO_BRIDGE_DEVICE_THREAD_STACK_PREFAULT];
+
+        for (size_t i=0; i<sizeof(stack); i+=1024)
+            stack[i] = 0;
+    }
+
+    int policy = SCHED_OTHER;
+    sched_param sched = {};
+    pthread_getschedparam(pthread_self(), &policy, &sched);
+
+    if (sPoolRtPolicy != kDeviceSchedOther && policy != SCHED_FIFO && policy != SCHED_RR)
+    {
+        d_stderr2("pool worker %u | failed to get realtime scheduling, expect audio dropouts", index);
+        return;
+    }
+
+    DEBUGPRINT("pool worker %u | thread running with policy %d, priority %d", index, policy, sched.sched_priority);
+}
+
+static void* devicePoolWorker(void* const arg)
+{
+    const uint32_t index = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(arg));
+
+    struct pollfd fds[AUDIO_BRIDGE_POOL_MAX_DEVICES * 2 + 1];
+    nfds_t nfds = 0;
+    uint64_t timeoutNs = 1000000;
+    uint32_t generation = __atomic_load_n(&sPoolGeneration, __ATOMIC_SEQ_CST) - 1;
+
+    simd::init();
+    devicePoolWorkerInit(index);
+
+    while (! __atomic_load_n(&sPoolQuit, __ATOMIC_SEQ_CST))
+    {
+        const uint32_t newGeneration = __atomic_load_n(&sPoolGeneration, __ATOMIC_SEQ_CST);
+
+        if (generation != newGeneration && devicePoolRebuild(fds, nfds, timeoutNs))
+            generation = newGeneration;
+
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(timeoutNs / 1000000000ULL);
+        ts.tv_nsec = static_cast<long>(timeoutNs % 1000000000ULL);
+
+        if (ppoll(fds, nfds, &ts, nullptr) > 0 && fds[0].revents != 0)
+        {
+            if (__atomic_load_n(&sPoolQuit, __ATOMIC_SEQ_CST))
+                break;
+
+            uint64_t value;
+            if (read(sPoolWakeFd, &value, sizeof(value)) != sizeof(value))
+                value = 0;
+        }
+
+        // own devices first
+        for (uint32_t i=0; i<AUDIO_BRIDGE_POOL_MAX_DEVICES; ++i)
+        {
+            if (sPoolSlots[i].home == index)
+                devicePoolService(sPoolSlots[i], index);
+        }
+
+        // then steal the ones other workers did not get to in time, because they are busy with a load spike
+        const uint64_t now = getTimeNs();
+
+        for (uint32_t i=0; i<AUDIO_BRIDGE_POOL_MAX_DEVICES; ++i)
+        {
+            DevicePoolSlot& slot(sPoolSlots[i]);
+
+            if (slot.home != index && now - __atomic_load_n(&slot.lastServiced, __ATOMIC_RELAXED) > timeoutNs * 2)
+                devicePoolService(slot, index);
+        }
+    }
+
+    return nullptr;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// must be called with the pool mutex locked
+static void devicePoolStop()
+{
+    __atomic_store_n(&sPoolQuit, true, __ATOMIC_SEQ_CST);
+    devicePoolWake();
+
+    for (uint32_t i=0; i<sPoolNumWorkers; ++i)
+        pthread_join(sPoolThreads[i], nullptr);
+
+    close(sPoolWakeFd);
+    sPoolWakeFd = -1;
+    sPoolNumWorkers = 0;
+}
+
+// must be called with the pool mutex locked
+static bool devicePoolStart(const DeviceAudioOptions& options)
+{
+    sPoolWakeFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+    if (sPoolWakeFd < 0)
+    {
+        DEBUGPRINT("pool | failed to create eventfd: %s", std::strerror(errno));
+        return false;
+    }
+
+    sPoolQuit = false;
+    sPoolRtPolicy = options.rtPolicy;
+
+    // SCHED_DEADLINE needs per-device timings, so workers use SCHED_FIFO instead
+    const uint8_t rtPolicy = options.rtPolicy == kDeviceSchedDeadline
+                             ? static_cast<uint8_t>(kDeviceSchedFIFO)
+                             : options.rtPolicy;
+    const int priority = std::max(1, std::min(99, options.rtPriority));
+
+    // 1 worker per selected CPU, pinned to it
+    uint64_t cpus[64];
+    uint32_t numCpus = 0;
+
+    if (options.cpuAffinity != 0)
+    {
+        for (int i=0; i<64; ++i)
+        {
+            if (options.cpuAffinity & (1ULL << i))
+                cpus[numCpus++] = 1ULL << i;
+        }
+    }
+    else
+    {
+        for (; numCpus < AUDIO_BRIDGE_POOL_DEFAULT_WORKERS; ++numCpus)
+            cpus[numCpus] = 0;
+    }
+
+    for (uint32_t i=0; i<numCpus; ++i)
+    {
+        void* const arg = reinterpret_cast<void*>(static_cast<uintptr_t>(sPoolNumWorkers));
+
+        pthread_attr_t attr;
+        deviceInitThreadAttr(&attr, rtPolicy, priority, cpus[i]);
+
+        if (pthread_create(&sPoolThreads[sPoolNumWorkers], &attr, devicePoolWorker, arg) != 0)
+        {
+            // try again as a regular thread, devicePoolWorkerInit will report the missing realtime scheduling
+            pthread_attr_destroy(&attr);
+            deviceInitThreadAttr(&attr, kDeviceSchedOther, 0, cpus[i]);
+
+            if (pthread_create(&sPoolThreads[sPoolNumWorkers], &attr, devicePoolWorker, arg) != 0)
+            {
+                pthread_attr_destroy(&attr);
+                continue;
+            }
+        }
+
+        pthread_attr_destroy(&attr);
+        ++sPoolNumWorkers;
+    }
+
+    if (sPoolNumWorkers == 0)
+    {
+        close(sPoolWakeFd);
+        sPoolWakeFd = -1;
+        return false;
+    }
+
+    DEBUGPRINT("pool | started %u workers", sPoolNumWorkers);
+    return true;
+}
+
+static bool devicePoolAdd(DeviceAudio* const dev)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&sPoolMutex);
+
+    if (sPoolNumDevices != 0 || devicePoolStart(dev->options))
+    {
+        for (uint32_t i=0; i<AUDIO_BRIDGE_POOL_MAX_DEVICES; ++i)
+        {
+            DevicePoolSlot& slot(sPoolSlots[i]);
+
+            if (slot.dev != nullptr || __atomic_load_n(&slot.owner, __ATOMIC_SEQ_CST) != 0)
+                continue;
+
+            if (dev->hints & kDeviceCapture)
+            {
+                slot.capture = new DeviceCaptureState;
+                deviceCaptureInit(*slot.capture, dev);
+                slot.playback = nullptr;
+            }
+            else
+            {
+                slot.capture = nullptr;
+                slot.playback = new DevicePlaybackState;
+                devicePlaybackInit(*slot.playback, dev);
+            }
+
+            slot.home = i % sPoolNumWorkers;
+            slot.lastServiced = getTimeNs();
+            slot.started = false;
+            slot.blocked = false;
+            slot.running = true;
+
+            dev->poolSlot = i;
+            dev->hints |= kDevicePooled;
+            deviceMarkStartup(dev, kDeviceStartupThreadReady);
+
+            __atomic_store_n(&slot.dev, dev, __ATOMIC_RELEASE);
+            ++sPoolNumDevices;
+            ok = true;
+
+            DEBUGPRINT("%s | serviced by pool worker %u", dev->deviceID, slot.home);
+            devicePoolWake();
+            break;
+        }
+
+        if (sPoolNumDevices == 0)
+            devicePoolStop();
+    }
+
+    pthread_mutex_unlock(&sPoolMutex);
+
+    return ok;
+}
+
+static void devicePoolRemove(DeviceAudio* const dev)
+{
+    pthread_mutex_lock(&sPoolMutex);
+
+    DevicePoolSlot& slot(sPoolSlots[dev->poolSlot]);
+
+    // wait for the current worker to be done with it, then keep all workers away
+    int32_t expected = 0;
+    while (! __atomic_compare_exchange_n(&slot.owner, &expected, -1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        expected = 0;
+        usleep(100);
+    }
+
+    __atomic_store_n(&slot.dev, static_cast<DeviceAudio*>(nullptr), __ATOMIC_RELEASE);
+
+    if (slot.capture != nullptr)
+    {
+        deviceCaptureCleanup(*slot.capture);
+        delete slot.capture;
+    }
+
+    if (slot.playback != nullptr)
+    {
+        devicePlaybackCleanup(*slot.playback);
+        delete slot.playback;
+    }
+
+    slot.capture = nullptr;
+    slot.playback = nullptr;
+    slot.running = false;
+    __atomic_store_n(&slot.owner, 0, __ATOMIC_RELEASE);
+
+    dev->hints &= ~kDevicePooled;
+
+    if (--sPoolNumDevices == 0)
+        devicePoolStop();
+    else
+        devicePoolWake();
+
+    pthread_mutex_unlock(&sPoolMutex);
+}
+
+static bool devicePoolIsRunning(const DeviceAudio* const dev)
+{
+    return __atomic_load_n(&sPoolSlots[dev->poolSlot].running, __ATOMIC_SEQ_CST);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,258 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-init.hpp"
+#include "audio-utils.hpp"
+
+// --------------------------------------------------------------------------------------------------------------------
+// Resampling split into channel groups, so very high channel counts can be spread over several threads.
+// All groups always get the same ratio and input count, so their phase stays identical and the output coherent.
+// Groups and their helper threads are set up front, but groups are processed serially at first,
+// the parked helpers take over some of them once the measured cost gets too high for a single thread.
+// Helpers belong to the resampler, so every device (pooled or not) with enough channels has its own.
+
+struct DeviceResampler;
+
+struct DeviceResamplerHelper {
+    DeviceResampler* owner;
+    pthread_t thread;
+    Notifier notifier;
+    uint8_t group;
+};
+
+struct DeviceResampler {
+    VResampler* groups[AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS];
+    uint16_t groupFirst[AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS];
+    uint8_t numGroups;
+
+    // helper N processes group N+1, created at init and only used once parallel is set
+    DeviceResamplerHelper helpers[AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS - 1];
+    uint8_t numHelpers;
+    bool parallel;
+    Notifier done;
+    int32_t pending;
+    bool quit;
+
+    // current job, shared by all groups
+    const float* const* inp;
+    float** out;
+    uint32_t inCount;
+    uint32_t outCount;
+
+    // serial cost measurement, for deciding when to start the helpers
+    DeviceAudio* dev;
+    uint64_t costNs;
+    uint64_t costFrames;
+    uint32_t costRuns;
+};
+
+static void deviceResamplerRunGroup(DeviceResampler& r, const uint8_t group)
+{
+    VResampler* const resampler = r.groups[group];
+
+    resampler->inp_count = r.inCount;
+    resampler->out_count = r.outCount;
+    resampler->inp_data = r.inp + r.groupFirst[group];
+    resampler->out_data = r.out + r.groupFirst[group];
+    resampler->process();
+}
+
+static void* deviceResamplerHelperThread(void* const arg)
+{
+    DeviceResamplerHelper* const helper = static_cast<DeviceResamplerHelper*>(arg);
+    DeviceResampler* const r = helper->owner;
+
+    simd::init();
+
+    while (! __atomic_load_n(&r->quit, __ATOMIC_SEQ_CST))
+    {
+        if (! notifierWait(&helper->notifier, 1000000000ULL))
+            continue;
+
+        if (__atomic_load_n(&r->quit, __ATOMIC_SEQ_CST))
+            break;
+
+        deviceResamplerRunGroup(*r, helper->group);
+
+        if (__atomic_sub_fetch(&r->pending, 1, __ATOMIC_SEQ_CST) == 0)
+            notifierPost(&r->done);
+    }
+
+    return nullptr;
+}
+
+// CPUs for the helper threads, the online ones not used by the device thread itself, or 0 for no restriction
+static uint64_t deviceResamplerHelperAffinity(const uint64_t cpuAffinity)
+{
+    if (cpuAffinity == 0)
+        return 0;
+
+    const long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint64_t online = numCpus >= 64 ? ~0ULL : numCpus > 0 ? (1ULL << numCpus) - 1 : 0;
+    const uint64_t others = online & ~cpuAffinity;
+
+    // no spare CPUs left, share the device ones
+    return others != 0 ? others : cpuAffinity;
+}
+
+// creates parked helper threads for all groups but the first, called at init and never from the audio path
+static void deviceResamplerCreateHelpers(DeviceResampler& r)
+{
+    DeviceAudio* const dev = r.dev;
+    const DeviceAudioOptions& options = dev->options;
+
+    // a single CPU has nowhere to run helpers in parallel
+    if (options.cpuAffinity != 0 && (options.cpuAffinity & (options.cpuAffinity - 1)) == 0)
+        return;
+
+    // SCHED_DEADLINE is set per thread with its own budget, helpers just use SCHED_FIFO
+    const uint8_t rtPolicy = options.rtPolicy == kDeviceSchedDeadline
+                             ? static_cast<uint8_t>(kDeviceSchedFIFO)
+                             : options.rtPolicy;
+    const uint64_t cpuAffinity = deviceResamplerHelperAffinity(options.cpuAffinity);
+
+    for (uint8_t g=1; g<r.numGroups; ++g)
+    {
+        DeviceResamplerHelper& helper(r.helpers[r.numHelpers]);
+        helper.owner = &r;
+        helper.group = g;
+        notifierInit(&helper.notifier);
+
+        pthread_attr_t attr;
+        deviceInitThreadAttr(&attr, rtPolicy, deviceThreadPriority(dev), cpuAffinity);
+
+        const bool ok = pthread_create(&helper.thread, &attr, deviceResamplerHelperThread, &helper) == 0;
+        pthread_attr_destroy(&attr);
+
+        // remaining groups keep running in the device thread
+        if (! ok)
+            break;
+
+        ++r.numHelpers;
+    }
+}
+
+static void deviceResamplerInit(DeviceResampler& r, DeviceAudio* const dev, const uint16_t channels)
+{
+    const uint32_t maxGroups = std::min<uint32_t>(dev->options.resampleThreads, AUDIO_BRIDGE_RESAMPLER_MAX_GROUPS);
+
+    r.numGroups = std::max<uint32_t>(1, std::min<uint32_t>(maxGroups,
+                                                           channels / AUDIO_BRIDGE_RESAMPLER_GROUP_MIN_CHANNELS));
+    r.numHelpers = 0;
+    r.parallel = false;
+    r.pending = 0;
+    r.quit = false;
+    r.dev = dev;
+    r.costNs = r.costFrames = 0;
+    r.costRuns = 0;
+    notifierInit(&r.done);
+
+    // spread channels as evenly as possible
+    uint16_t first = 0;
+    for (uint8_t g=0; g<r.numGroups; ++g)
+    {
+        const uint16_t groupChannels = channels / r.numGroups + (g < channels % r.numGroups ? 1 : 0);
+
+        r.groupFirst[g] = first;
+        r.groups[g] = new VResampler;
+        r.groups[g]->setup(1.0, groupChannels, 8);
+
+        first += groupChannels;
+    }
+
+    deviceResamplerCreateHelpers(r);
+}
+
+static void deviceResamplerCleanup(DeviceResampler& r)
+{
+    __atomic_store_n(&r.quit, true, __ATOMIC_SEQ_CST);
+
+    for (uint8_t h=0; h<r.numHelpers; ++h)
+    {
+        notifierPost(&r.helpers[h].notifier);
+        pthread_join(r.helpers[h].thread, nullptr);
+    }
+
+    for (uint8_t g=0; g<r.numGroups; ++g)
+        delete r.groups[g];
+
+    r.numHelpers = 0;
+    r.parallel = false;
+    r.numGroups = 0;
+}
+
+static void deviceResamplerSetRatio(DeviceResampler& r, const double ratio)
+{
+    for (uint8_t g=0; g<r.numGroups; ++g)
+        r.groups[g]->set_rratio(ratio);
+}
+
+// filter delay in input frames, the same for all groups
+static double deviceResamplerLatency(const DeviceResampler& r)
+{
+    return r.groups[0]->inpdist();
+}
+
+// resamples all channels, returning the number of output frames
+static uint32_t deviceResamplerProcess(DeviceResampler& r,
+                                       const float* const* const inp,
+                                       const uint32_t inCount,
+                                       float** const out,
+                                       const uint32_t outCount)
+{
+    const bool measure = ! r.parallel && r.numHelpers != 0;
+    const uint64_t start = measure ? getTimeNs() : 0;
+
+    r.inp = inp;
+    r.out = out;
+    r.inCount = inCount;
+    r.outCount = outCount;
+
+    if (r.parallel)
+    {
+        __atomic_store_n(&r.pending, r.numHelpers, __ATOMIC_SEQ_CST);
+
+        for (uint8_t h=0; h<r.numHelpers; ++h)
+            notifierPost(&r.helpers[h].notifier);
+
+        deviceResamplerRunGroup(r, 0);
+
+        for (uint8_t g=r.numHelpers + 1; g<r.numGroups; ++g)
+            deviceResamplerRunGroup(r, g);
+
+        // barrier, all groups must be done before the output is used
+        while (__atomic_load_n(&r.pending, __ATOMIC_SEQ_CST) != 0)
+            notifierWait(&r.done, 1000000ULL);
+    }
+    else
+    {
+        for (uint8_t g=0; g<r.numGroups; ++g)
+            deviceResamplerRunGroup(r, g);
+    }
+
+    if (measure)
+    {
+        r.costNs += getTimeNs() - start;
+        r.costFrames += inCount;
+
+        if (++r.costRuns == AUDIO_BRIDGE_RESAMPLER_MEASURE_RUNS)
+        {
+            const uint64_t budgetNs = r.costFrames * 1000000000ULL / r.dev->sampleRate;
+
+            if (r.costNs * 100 > budgetNs * AUDIO_BRIDGE_RESAMPLER_PARALLEL_PERCENT)
+            {
+                r.parallel = true;
+                DEBUGPRINT("%s | resampling %u channel groups with %u helper threads",
+                           r.dev->deviceID, r.numGroups, r.numHelpers);
+            }
+
+            r.costNs = r.costFrames = 0;
+            r.costRuns = 0;
+        }
+    }
+
+    // all groups run in lockstep, so any of them gives the output count
+    return outCount - r.groups[0]->out_count;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,282 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-init.hpp"
+#include "audio-utils.hpp"
+
+// --------------------------------------------------------------------------------------------------------------------
+// Synchronous mode, for devices running from the same clock as the host (same card or shared word clock).
+// Device I/O happens directly in the host audio callback, 1 device period per host cycle,
+// without ringbuffer, resampler or device thread in between.
+// The device buffer level is averaged over time to verify the clocks really are locked,
+// once it moves away the device is restarted and the (so far parked) device thread takes over.
+
+static bool deviceSyncSupported(const DeviceAudio* const dev)
+{
+    if (dev->hints & kDeviceDuplex)
+        return false;
+
+    if (dev->hwstatus.periodSize != dev->bufferSize)
+    {
+        DEBUGPRINT("%s | synchronous mode needs matching period size, got %u vs host %u",
+                   dev->deviceID, dev->hwstatus.periodSize, dev->bufferSize);
+        return false;
+    }
+
+    if (dev->hwstatus.periods < AUDIO_BRIDGE_SYNC_SAFETY_PERIODS + 2)
+    {
+        DEBUGPRINT("%s | synchronous mode needs at least %u periods, got %u",
+                   dev->deviceID, AUDIO_BRIDGE_SYNC_SAFETY_PERIODS + 2, dev->hwstatus.periods);
+        return false;
+    }
+
+    DEBUGPRINT("%s | using synchronous mode", dev->deviceID);
+    return true;
+}
+
+// parks the device thread while in synchronous mode, returns false if the device was closed meanwhile
+static bool deviceSyncWait(DeviceAudio* const dev)
+{
+    while (__atomic_load_n(&dev->hints, __ATOMIC_SEQ_CST) & kDeviceSync)
+    {
+        if (dev->hwstatus.channels == 0)
+            return false;
+
+        notifierWait(&dev->notifier, 1000000000ULL);
+    }
+
+    DEBUGPRINT("%08u | %s | leaving synchronous mode, device thread taking over",
+               dev->frame, dev->hints & kDeviceCapture ? "capture" : "playback");
+
+    return dev->hwstatus.channels != 0;
+}
+
+// restarts the device in a fresh state and wakes up the device thread, called from the host audio thread
+static void deviceSyncFallback(DeviceAudio* const dev, const char* const reason)
+{
+    DEBUGPRINT("%08u | %s | %s, switching to asynchronous mode",
+               dev->frame, dev->hints & kDeviceCapture ? "capture" : "playback", reason);
+
+    snd_pcm_drop(dev->pcm);
+    snd_pcm_prepare(dev->pcm);
+
+    deviceFailInitHints(dev);
+    dev->sync = {};
+
+    __atomic_and_fetch(&dev->hints, ~static_cast<uint32_t>(kDeviceSync), __ATOMIC_SEQ_CST);
+    notifierPost(&dev->notifier);
+}
+
+// accumulates the device buffer level, returns false once its average drifts away from the initial one
+static bool deviceSyncCheckLock(DeviceAudio* const dev, const uint32_t level)
+{
+    DeviceAudio::Sync& sync(dev->sync);
+
+    sync.windowLevel += level;
+    ++sync.windowCycles;
+
+    if ((sync.windowFrames += dev->bufferSize) < dev->sampleRate * AUDIO_BRIDGE_SYNC_LOCK_WINDOW_MS / 1000)
+        return true;
+
+    const double average = static_cast<double>(sync.windowLevel) / sync.windowCycles;
+    sync.windowCycles = sync.windowFrames = 0;
+    sync.windowLevel = 0;
+
+    // first window sets the reference level
+    if (deviceStartupStage(dev, kDeviceStartupDriftActive) == 0)
+    {
+        sync.baseLevel = average;
+        deviceMarkStartup(dev, kDeviceStartupDriftActive);
+        return true;
+    }
+
+    const double drift = average - sync.baseLevel;
+
+    if (std::abs(drift) * 100 > dev->hwstatus.periodSize * AUDIO_BRIDGE_SYNC_MAX_DRIFT_PERCENT)
+    {
+        DEBUGPRINT("%08u | %s | buffer level moved by %.1f frames, clocks are not locked",
+                   dev->frame, dev->hints & kDeviceCapture ? "capture" : "playback", drift);
+        return false;
+    }
+
+    deviceMarkStartup(dev, kDeviceStartupDriftLocked);
+    return true;
+}
+
+static bool runDeviceAudioSyncCapture(DeviceAudio* const dev, float* buffers[])
+{
+    const uint32_t bufferSize = dev->bufferSize;
+
+    if (dev->hints & kDeviceInitializing)
+    {
+        deviceMarkStartup(dev, kDeviceStartupHostPost);
+
+        if (snd_pcm_state(dev->pcm) == SND_PCM_STATE_PREPARED)
+            snd_pcm_start(dev->pcm);
+
+        dev->hints &= ~kDeviceInitializing;
+        deviceMarkStartup(dev, kDeviceStartupInitialized);
+    }
+
+    const snd_pcm_sframes_t avail = snd_pcm_avail_update(dev->pcm);
+
+    if (avail < 0)
+    {
+        ++dev->stats.xruns;
+        deviceSyncFallback(dev, snd_strerror(avail));
+        return false;
+    }
+
+    // let the safety margin fill up first, reads then always leave that much behind
+    if (dev->hints & kDeviceBuffering)
+    {
+        if (avail < bufferSize * (AUDIO_BRIDGE_SYNC_SAFETY_PERIODS + 1))
+        {
+            clearCaptureBuffers(dev, buffers);
+            return true;
+        }
+
+        dev->hints &= ~(kDeviceStarting|kDeviceBuffering);
+        deviceMarkStartup(dev, kDeviceStartupStarted);
+        deviceMarkStartup(dev, kDeviceStartupAudio);
+    }
+
+    if (avail < bufferSize)
+    {
+        deviceSyncFallback(dev, "device is late");
+        return false;
+    }
+
+    if (avail > dev->hwstatus.fullBufferSize - bufferSize)
+    {
+        deviceSyncFallback(dev, "device is early");
+        return false;
+    }
+
+    if (! deviceSyncCheckLock(dev, avail))
+    {
+        deviceSyncFallback(dev, "clock drift detected");
+        return false;
+    }
+
+    const snd_pcm_sframes_t err = deviceReadRaw(dev, 0, bufferSize);
+
+    if (err != bufferSize)
+    {
+        deviceSyncFallback(dev, err < 0 ? snd_strerror(err) : "short read");
+        return false;
+    }
+
+    if (dev->enabled)
+    {
+        // convert straight into the host buffers, there is no device thread using ours
+        float** const f32 = dev->buffers.f32;
+        dev->buffers.f32 = buffers;
+        deviceRawToFloat(dev, bufferSize);
+        dev->buffers.f32 = f32;
+    }
+    else
+    {
+        clearCaptureBuffers(dev, buffers);
+    }
+
+    dev->framesDone += bufferSize;
+    return true;
+}
+
+static bool runDeviceAudioSyncPlayback(DeviceAudio* const dev, float* buffers[])
+{
+    const uint32_t bufferSize = dev->bufferSize;
+    snd_pcm_sframes_t err;
+
+    if (dev->hints & kDeviceInitializing)
+    {
+        deviceMarkStartup(dev, kDeviceStartupHostPost);
+        dev->hints &= ~kDeviceInitializing;
+        deviceMarkStartup(dev, kDeviceStartupInitialized);
+    }
+
+    // prefill the safety margin with silence, this cycle's audio gets queued right after it
+    if (dev->hints & kDeviceBuffering)
+    {
+        deviceClearRaw(dev, bufferSize);
+
+        for (uint32_t i=0; i<AUDIO_BRIDGE_SYNC_SAFETY_PERIODS; ++i)
+        {
+            if ((err = deviceWriteRaw(dev, 0, bufferSize)) != bufferSize)
+            {
+                deviceSyncFallback(dev, err < 0 ? snd_strerror(err) : "short write");
+                return false;
+            }
+        }
+
+        dev->hints &= ~(kDeviceStarting|kDeviceBuffering);
+        deviceMarkStartup(dev, kDeviceStartupStarted);
+        deviceMarkStartup(dev, kDeviceStartupAudio);
+    }
+
+    const snd_pcm_sframes_t avail = snd_pcm_avail_update(dev->pcm);
+
+    if (avail < 0)
+    {
+        ++dev->stats.xruns;
+        deviceSyncFallback(dev, snd_strerror(avail));
+        return false;
+    }
+
+    if (avail < bufferSize)
+    {
+        deviceSyncFallback(dev, "device is late");
+        return false;
+    }
+
+    // stop threshold is disabled, so running out of data does not xrun and has to be checked here
+    const uint32_t queued = dev->hwstatus.fullBufferSize - std::min<uint32_t>(avail, dev->hwstatus.fullBufferSize);
+
+    if (queued == 0 && snd_pcm_state(dev->pcm) == SND_PCM_STATE_RUNNING)
+    {
+        deviceSyncFallback(dev, "device is early");
+        return false;
+    }
+
+    if (! deviceSyncCheckLock(dev, queued))
+    {
+        deviceSyncFallback(dev, "clock drift detected");
+        return false;
+    }
+
+    if (dev->enabled)
+    {
+        // convert straight from the host buffers, there is no device thread using ours
+        float** const f32 = dev->buffers.f32;
+        dev->buffers.f32 = buffers;
+        deviceFloatToRaw(dev, bufferSize);
+        dev->buffers.f32 = f32;
+    }
+    else
+    {
+        deviceClearRaw(dev, bufferSize);
+    }
+
+    if ((err = deviceWriteRaw(dev, 0, bufferSize)) != bufferSize)
+    {
+        deviceSyncFallback(dev, err < 0 ? snd_strerror(err) : "short write");
+        return false;
+    }
+
+    // low-latency start never starts by itself
+    if (snd_pcm_state(dev->pcm) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(dev->pcm);
+
+    dev->framesDone += bufferSize;
+    return true;
+}
+
+// returns false if the device had to fall back to the asynchronous path, nothing was processed in that case
+static bool runDeviceAudioSync(DeviceAudio* const dev, float* buffers[])
+{
+    return dev->hints & kDeviceCapture ? runDeviceAudioSyncCapture(dev, buffers)
+                                       : runDeviceAudioSyncPlayback(dev, buffers);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
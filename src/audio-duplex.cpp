@@ -0,0 +1,119 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "audio-device-init.hpp"
+#include "audio-utils.hpp"
+
+#include <poll.h>
+
+// waits once for both sides, whose steps never block in duplex mode.
+// polls capture for a full read and playback for space when it has frames pending,
+// with the same timeout as deviceTimedWait so that host posts are picked up in time
+static void deviceDuplexWait(DeviceCaptureState& cs, DevicePlaybackState& ps)
+{
+    DeviceAudio* const capture = cs.dev;
+    DeviceAudio* const playback = ps.dev;
+
+    struct pollfd fds[16];
+    nfds_t nfds = 0;
+    int count;
+
+    // a capture side waiting for ringbuffer space needs the host, not the device
+    if (cs.pendingFrames == 0 && (count = snd_pcm_poll_descriptors(capture->pcm, fds, 8)) > 0)
+        nfds += count;
+
+    if (ps.pendingFrames != 0 && (count = snd_pcm_poll_descriptors(playback->pcm, fds + nfds, 8)) > 0)
+        nfds += count;
+
+    if (nfds == 0)
+    {
+        deviceTimedWait(capture);
+        return;
+    }
+
+    const uint32_t frames = std::min(capture->bufferSize, capture->hwstatus.periodSize);
+    const uint64_t periodTime = static_cast<uint64_t>(frames) * 1000000000ULL / capture->sampleRate
+                              / AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(periodTime / 1000000000ULL);
+    ts.tv_nsec = static_cast<long>(periodTime % 1000000000ULL);
+
+    ppoll(fds, nfds, &ts, nullptr);
+}
+
+// services both sides of a linked duplex device, `arg` is the capture side
+static void* deviceDuplexThread(void* const arg)
+{
+    DeviceAudio* const capture = static_cast<DeviceAudio*>(arg);
+    DeviceAudio* const playback = capture->duplexPeer;
+
+    DeviceCaptureState captureState;
+    deviceCaptureInit(captureState, capture);
+
+    DevicePlaybackState playbackState;
+    devicePlaybackInit(playbackState, playback);
+
+    // both sides start out initializing
+    bool captureWasInitializing = true;
+    bool playbackWasInitializing = true;
+
+    simd::init();
+    deviceThreadInit(capture);
+
+    // wait for audio thread to post
+    if (! notifierWait(&capture->notifier, 15000000000ULL))
+    {
+        DEBUGPRINT("%08u | duplex | audio thread failed to post", capture->frame);
+        goto end;
+    }
+
+    deviceMarkStartup(capture, kDeviceStartupHostPost);
+    deviceMarkStartup(playback, kDeviceStartupHostPost);
+
+    while (capture->hwstatus.channels != 0 && playback->hwstatus.channels != 0)
+    {
+        devicePrintStartup(capture);
+        devicePrintStartup(playback);
+
+        const DeviceThreadStep captureStep = deviceCaptureStep(captureState);
+        if (captureStep == kDeviceStepClose)
+            break;
+
+        const DeviceThreadStep playbackStep = devicePlaybackStep(playbackState);
+        if (playbackStep == kDeviceStepClose)
+            break;
+
+        // a full restart on one side stops the linked stream on the other, so restart both together.
+        // playback then prefills and starts the linked streams, capture just waits for data
+        const bool captureInitializing = (capture->hints & kDeviceInitializing) != 0;
+        const bool playbackInitializing = (playback->hints & kDeviceInitializing) != 0;
+
+        if (captureInitializing && ! captureWasInitializing && ! playbackInitializing)
+        {
+            DEBUGPRINT("%08u | duplex | capture restarted, restarting playback", capture->frame);
+            devicePlaybackRestart(playbackState);
+        }
+        else if (playbackInitializing && ! playbackWasInitializing && ! captureInitializing)
+        {
+            DEBUGPRINT("%08u | duplex | playback restarted, restarting capture", capture->frame);
+            deviceCaptureRestart(captureState);
+        }
+
+        captureWasInitializing = (capture->hints & kDeviceInitializing) != 0;
+        playbackWasInitializing = (playback->hints & kDeviceInitializing) != 0;
+
+        // keep going while either side makes progress, then wait once for both
+        if (captureStep == kDeviceStepWait && playbackStep == kDeviceStepWait)
+            deviceDuplexWait(captureState, playbackState);
+    }
+
+end:
+    DEBUGPRINT("%08u | duplex | audio thread closed", capture->frame);
+
+    deviceCaptureCleanup(captureState);
+    devicePlaybackCleanup(playbackState);
+
+    capture->thread = 0;
+    return nullptr;
+}
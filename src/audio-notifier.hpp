@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// Single-waiter notifier, used by the audio thread to wake up the device thread.
+// Unlike a semaphore, posting only goes into the kernel when the waiter is actually sleeping,
+// so the common case of the device thread being busy costs a couple of atomic operations.
+// Any thread may post, the statistics counters are updated with relaxed atomics for that reason.
+struct Notifier {
+    int32_t signaled;
+    int32_t waiting;
+    uint32_t numPosts;
+    uint32_t numWakeups;
+    uint32_t numElided;
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static inline
+void notifierInit(Notifier* const n)
+{
+    n->signaled = 0;
+    n->waiting = 0;
+    n->numPosts = n->numWakeups = n->numElided = 0;
+}
+
+static inline
+void notifierPost(Notifier* const n)
+{
+    __atomic_store_n(&n->signaled, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&n->numPosts, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&n->waiting, __ATOMIC_SEQ_CST) == 0)
+    {
+        __atomic_add_fetch(&n->numElided, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&n->numWakeups, 1, __ATOMIC_RELAXED);
+    syscall(SYS_futex, &n->signaled, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+static inline
+bool notifierTryWait(Notifier* const n)
+{
+    return __atomic_exchange_n(&n->signaled, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+// returns true if signaled, false on timeout
+static inline
+bool notifierWait(Notifier* const n, const uint64_t timeoutNs)
+{
+    if (notifierTryWait(n))
+        return true;
+
+    __atomic_store_n(&n->waiting, 1, __ATOMIC_SEQ_CST);
+
+    // check again after announcing ourselves, poster might have missed the waiting flag
+    if (! notifierTryWait(n))
+    {
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(timeoutNs / 1000000000ULL);
+        ts.tv_nsec = static_cast<long>(timeoutNs % 1000000000ULL);
+
+        syscall(SYS_futex, &n->signaled, FUTEX_WAIT_PRIVATE, 0, &ts, nullptr, 0);
+
+        __atomic_store_n(&n->waiting, 0, __ATOMIC_SEQ_CST);
+        return notifierTryWait(n);
+    }
+
+    __atomic_store_n(&n->waiting, 0, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
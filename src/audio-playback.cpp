@@ -4,228 +4,421 @@
 #include "audio-device-init.hpp"
 #include "audio-utils.hpp"
 
-static void* devicePlaybackThread(void* const  arg)
-{
-    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+// per-thread playback state, kept outside the thread function so duplex mode can drive it too
+struct DevicePlaybackState {
+    DeviceAudio* dev;
 
-    const uint8_t hints = dev->hints;
-    const uint8_t channels = dev->hwstatus.channels;
-    const uint8_t sampleSize = getSampleSizeFromHints(hints);
-    const uint16_t bufferSize = dev->bufferSize;
+    uint16_t channels;
+    uint32_t periodSize;
 
-    float** buffers = new float*[channels];
-    for (uint8_t c=0; c<channels; ++c)
-        buffers[c] = new float[bufferSize];
-
-    simd::init();
+    float** buffers;
 
     // smooth initial volume to prevent clicks on start
     ExponentialValueSmoother gain;
-    gain.setSampleRate(dev->sampleRate);
-    gain.setTimeConstant(0.5f);
+    DeviceResampler resampler;
+    double rbRatio;
+    bool enabled;
+
+    // state for in-place xrun recovery
+    DeviceRecovery recovery;
+    uint32_t fadeIn;
+
+    // converted frames not yet written to the device, starting at pendingOffset in the raw buffer
+    uint32_t pendingFrames;
+    uint32_t pendingOffset;
+    // low-latency start prefill done, waiting for the host cycle to start on (pooled and duplex devices only)
+    bool startPrefilled;
+    // device buffer ran low while waiting for host data, counted once in stats.blockedWaits until data arrives
+    bool starving;
+};
+
+static void devicePlaybackInit(DevicePlaybackState& s, DeviceAudio* const dev)
+{
+    s.dev = dev;
+    s.channels = dev->hwstatus.channels;
+    s.periodSize = dev->hwstatus.periodSize;
 
-    VResampler* const resampler = new VResampler;
-    resampler->setup(1.0, channels, 8);
+    s.buffers = new float*[s.channels];
+    for (uint16_t c=0; c<s.channels; ++c)
+        s.buffers[c] = new float[s.periodSize];
 
-    snd_pcm_sframes_t err;
-    float xgain;
-    double rbRatio = 0.0;
-    bool enabled = true;
+    s.gain.setSampleRate(dev->sampleRate);
+    s.gain.setTimeConstant(0.5f);
 
-    auto restart = [&dev, &resampler, &gain, &enabled]()
-    {
-        deviceFailInitHints(dev);
-        gain.setTargetValue(0.f);
-        gain.clearToTargetValue();
-        if (enabled)
-            gain.setTargetValue(1.f);
-    };
+    deviceResamplerInit(s.resampler, dev, s.channels);
 
-    // wait for audio thread to post
-    {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 15;
+    s.rbRatio = 0.0;
+    s.enabled = true;
 
-        if (sem_timedwait(&dev->sem, &ts) != 0)
-        {
-            printf("%08u | playback | audio thread failed to post\n", dev->frame);
-            goto end;
-        }
-    }
+    s.recovery = {};
+    s.fadeIn = 0;
 
-    while (dev->hwstatus.channels != 0)
+    s.pendingFrames = 0;
+    s.pendingOffset = 0;
+    s.startPrefilled = false;
+    s.starving = false;
+}
+
+static void devicePlaybackCleanup(DevicePlaybackState& s)
+{
+    deviceResamplerCleanup(s.resampler);
+
+    for (uint16_t c=0; c<s.channels; ++c)
+        delete[] s.buffers[c];
+    delete[] s.buffers;
+}
+
+static void devicePlaybackRestart(DevicePlaybackState& s)
+{
+    deviceFailInitHints(s.dev);
+    s.gain.setTargetValue(0.f);
+    s.gain.clearToTargetValue();
+    if (s.enabled)
+        s.gain.setTargetValue(1.f);
+}
+
+// writes pending converted frames to the device.
+// dedicated threads wait here for device space, pooled and duplex devices return kDeviceStepWait and resume on the next step
+static DeviceThreadStep devicePlaybackFlush(DevicePlaybackState& s)
+{
+    DeviceAudio* const dev = s.dev;
+    const uint32_t frame = dev->frame;
+    const uint32_t periodSize = s.periodSize;
+
+    snd_pcm_sframes_t err;
+
+    while (dev->hwstatus.channels != 0 && s.pendingFrames != 0)
     {
-        const uint32_t frame = dev->frame;
+        err = deviceWriteRaw(dev, s.pendingOffset, s.pendingFrames);
+        // DEBUGPRINT("write %d of %u", err, s.pendingFrames);
 
-        if (dev->hints & kDeviceInitializing)
+        if (err < 0)
         {
-            // write silence until alsa buffers are full
-            bool started = false;
-            std::memset(dev->buffers.raw, 0, sampleSize * bufferSize * channels * 2);
-            while ((err = snd_pcm_mmap_writei(dev->pcm, dev->buffers.raw, bufferSize * 2)) > 0)
-                started = true;
-
-            if (err != -EAGAIN)
+            if (err == -EAGAIN)
             {
-                printf("%08u | playback | initial write error: %s\n", frame, snd_strerror(err));
-                goto end;
-            }
+                if (deviceNonBlockingSteps(dev))
+                    return kDeviceStepWait;
 
-            if (started)
-            {
-                DEBUGPRINT("%08u | playback | can write data? removing kDeviceInitializing", frame);
-                restart();
-                dev->hints &= ~kDeviceInitializing;
-            }
-            else
-            {
                 deviceTimedWait(dev);
                 continue;
             }
-        }
 
-        if (dev->hints & kDeviceStarting)
-        {
-            // try writing a single sample to see if device is running
-            std::memset(dev->buffers.raw, 0, sampleSize * channels);
-            err = snd_pcm_mmap_writei(dev->pcm, dev->buffers.raw, 1);
+            ++dev->stats.xruns;
+            s.pendingFrames = 0;
 
-            switch (err)
+            if (deviceRecoverInPlace(dev, s.recovery, err))
             {
-            case 1:
-                DEBUGPRINT("%08u | playback | wrote data, removing kDeviceStarting", frame);
-                dev->hints &= ~kDeviceStarting;
-                snd_pcm_rewind(dev->pcm, 1);
+                DEBUGPRINT("%08u | playback | recovered from %s", frame, snd_strerror(err));
+
+                // host kept writing while the device was stopped, drop the excess
+                const uint32_t rbfill = dev->ringbuffer->getNumReadableSamples();
+                const uint32_t rbtarget = getRingBufferFillTarget(dev);
+
+                if (rbfill > rbtarget)
+                    dev->ringbuffer->skip(rbfill - rbtarget);
+
+                // restart device with the target delay of silence, then fade in
+                deviceClearRaw(dev, periodSize);
+                if (dev->options.lowLatencyStart)
+                {
+                    for (uint32_t prefill = getPlaybackStartFrames(dev); prefill != 0; prefill -= periodSize)
+                        deviceWriteRaw(dev, 0, periodSize);
+                    snd_pcm_start(dev->pcm);
+                }
+                else
+                {
+                    deviceWriteRaw(dev, 0, periodSize);
+                }
+                s.fadeIn = AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES;
                 break;
-            case -EAGAIN:
-                deviceTimedWait(dev);
-                continue;
-            default:
-                printf("%08u | playback | initial write error: %s\n", frame, snd_strerror(err));
-                goto end;
             }
+
+            devicePlaybackRestart(s);
+
+            DEBUGPRINT("%08u | playback | Write error: %s", frame, snd_strerror(err));
+
+            if (xrun_recovery(dev->pcm, err) < 0)
+            {
+                DEBUGPRINT("playback | xrun_recovery error: %s", snd_strerror(err));
+                return kDeviceStepClose;
+            }
+
+            break;
+        }
+
+        if (dev->hints & kDeviceBuffering)
+        {
+            DEBUGPRINT("%08u | playback | wrote data, removing kDeviceBuffering", frame);
+            dev->hints &= ~kDeviceBuffering;
+            deviceMarkStartup(dev, kDeviceStartupAudio);
         }
 
-        if (dev->ringbuffer->getNumReadableSamples() < bufferSize)
+        // FIXME check against snd_pcm_sw_params_set_avail_min ??
+        if (static_cast<uint32_t>(err) != s.pendingFrames)
         {
+            DEBUGPRINT("%08u | playback | Incomplete write %ld of %u", frame, err, s.pendingFrames);
+
+            s.pendingOffset += err;
+            s.pendingFrames -= err;
+
+            if (deviceNonBlockingSteps(dev))
+                return kDeviceStepWait;
+
             deviceTimedWait(dev);
             continue;
         }
 
-        while (!dev->ringbuffer->read(buffers, bufferSize))
+        break;
+    }
+
+    s.pendingFrames = 0;
+    return kDeviceStepAgain;
+}
+
+// a single iteration of the playback thread
+static DeviceThreadStep devicePlaybackStep(DevicePlaybackState& s)
+{
+    DeviceAudio* const dev = s.dev;
+    const uint32_t frame = dev->frame;
+    const uint16_t channels = s.channels;
+    const uint32_t periodSize = s.periodSize;
+
+    snd_pcm_sframes_t err;
+    float xgain;
+
+    // previous step of a pooled or duplex device could not write everything yet, finish that before converting more
+    if (s.pendingFrames != 0 && devicePlaybackFlush(s) == kDeviceStepWait)
+        return kDeviceStepWait;
+
+    if ((dev->hints & kDeviceInitializing) && dev->options.lowLatencyStart)
+    {
+        // start from an empty device buffer
+        if (snd_pcm_state(dev->pcm) != SND_PCM_STATE_PREPARED)
         {
-            DEBUGPRINT("%08u | playback | WARNING | failed reading data", frame);
-            sched_yield();
+            snd_pcm_drop(dev->pcm);
+
+            if ((err = snd_pcm_prepare(dev->pcm)) != 0)
+            {
+                DEBUGPRINT("%08u | playback | prepare error: %s", frame, snd_strerror(err));
+                return kDeviceStepClose;
+            }
         }
 
-        if (dev->hwstatus.channels == 0)
-            break;
+        if (! s.startPrefilled)
+        {
+            // prefill exactly the target delay with silence
+            deviceClearRaw(dev, periodSize);
+            for (uint32_t prefill = getPlaybackStartFrames(dev); prefill != 0; prefill -= periodSize)
+            {
+                if ((err = deviceWriteRaw(dev, 0, periodSize)) < 0)
+                {
+                    DEBUGPRINT("%08u | playback | initial write error: %s", frame, snd_strerror(err));
+                    return kDeviceStepClose;
+                }
+            }
 
-        if (enabled != dev->enabled)
+            // align device start to the beginning of a host cycle
+            notifierTryWait(&dev->notifier);
+            s.startPrefilled = true;
+        }
+
+        // pooled and duplex devices check again on the next step instead of blocking their thread
+        if (deviceNonBlockingSteps(dev))
+        {
+            if (! notifierTryWait(&dev->notifier))
+                return kDeviceStepWait;
+        }
+        else
         {
-            enabled = dev->enabled;
-            gain.setTargetValue(enabled ? 1.f : 0.f);
+            notifierWait(&dev->notifier, 1000000000ULL);
         }
 
-        if (rbRatio != dev->rbRatio)
+        s.startPrefilled = false;
+
+        if (dev->hwstatus.channels == 0)
+            return kDeviceStepClose;
+
+        // in duplex mode this starts the linked capture stream too
+        if ((err = snd_pcm_start(dev->pcm)) != 0)
         {
-            rbRatio = dev->rbRatio;
-            resampler->set_rratio(rbRatio);
+            DEBUGPRINT("%08u | playback | start error: %s", dev->frame, snd_strerror(err));
+            return kDeviceStepClose;
         }
 
-        resampler->inp_count = bufferSize;
-        resampler->out_count = bufferSize * 2;
-        resampler->inp_data = buffers;
-        resampler->out_data = dev->buffers.f32;
-        resampler->process();
+        DEBUGPRINT("%08u | playback | started, removing kDeviceInitializing|kDeviceStarting", dev->frame);
+        devicePlaybackRestart(s);
+        dev->hints &= ~(kDeviceInitializing|kDeviceStarting);
+        deviceMarkStartup(dev, kDeviceStartupInitialized);
+        deviceMarkStartup(dev, kDeviceStartupStarted);
+    }
 
-        uint16_t frames = bufferSize * 2 - resampler->out_count;
+    if (dev->hints & kDeviceInitializing)
+    {
+        // write silence until alsa buffers are full
+        bool started = false;
+        deviceClearRaw(dev, periodSize * 2);
+        while ((err = deviceWriteRaw(dev, 0, periodSize * 2)) > 0)
+            started = true;
 
-        for (uint16_t i=0; i<frames; ++i)
+        if (err != -EAGAIN)
         {
-            xgain = gain.next();
-            for (uint8_t c=0; c<channels; ++c)
-                dev->buffers.f32[c][i] *= xgain;
+            DEBUGPRINT("%08u | playback | initial write error: %s", frame, snd_strerror(err));
+            return kDeviceStepClose;
         }
 
-        switch (hints & kDeviceSampleHints)
+        if (! started)
+            return kDeviceStepWait;
+
+        DEBUGPRINT("%08u | playback | can write data? removing kDeviceInitializing", frame);
+        devicePlaybackRestart(s);
+        dev->hints &= ~kDeviceInitializing;
+        deviceMarkStartup(dev, kDeviceStartupInitialized);
+    }
+
+    if (dev->hints & kDeviceStarting)
+    {
+        // try writing a single sample to see if device is running
+        deviceClearRaw(dev, 1);
+        err = deviceWriteRaw(dev, 0, 1);
+
+        switch (err)
         {
-        case kDeviceSample16:
-            float2int::s16(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        case kDeviceSample24:
-            float2int::s24(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        case kDeviceSample24LE3:
-            float2int::s24le3(dev->buffers.raw, dev->buffers.f32, channels, frames);
-            break;
-        case kDeviceSample32:
-            float2int::s32(dev->buffers.raw, dev->buffers.f32, channels, frames);
+        case 1:
+            DEBUGPRINT("%08u | playback | wrote data, removing kDeviceStarting", frame);
+            dev->hints &= ~kDeviceStarting;
+            deviceMarkStartup(dev, kDeviceStartupStarted);
+            snd_pcm_rewind(dev->pcm, 1);
             break;
+        case -EAGAIN:
+            return kDeviceStepWait;
         default:
-            DEBUGPRINT("unknown format");
-            break;
+            DEBUGPRINT("%08u | playback | initial write error: %s", frame, snd_strerror(err));
+            return kDeviceStepClose;
         }
+    }
 
-        int8_t* ptr = dev->buffers.raw;
+    deviceMeasureLatency(dev, deviceResamplerLatency(s.resampler));
 
-        while (dev->hwstatus.channels != 0 && frames != 0)
+    // host is not running in realtime, keep the device going on silence but leave the ringbuffer as-is
+    if (__atomic_load_n(&dev->freewheeling, __ATOMIC_ACQUIRE))
+    {
+        deviceClearRaw(dev, periodSize);
+        err = deviceWriteRaw(dev, 0, periodSize);
+
+        if (err == -EPIPE || err == -ESTRPIPE)
         {
-            err = snd_pcm_mmap_writei(dev->pcm, ptr, frames);
-            // DEBUGPRINT("write %d of %u", err, frames);
+            ++dev->stats.xruns;
+            xrun_recovery(dev->pcm, err);
+            return kDeviceStepAgain;
+        }
 
-            if (err < 0)
+        // low-latency start never starts by itself
+        if (err > 0 && snd_pcm_state(dev->pcm) == SND_PCM_STATE_PREPARED)
+            snd_pcm_start(dev->pcm);
+
+        return err == periodSize ? kDeviceStepAgain : kDeviceStepWait;
+    }
+
+    // wait for the host to give us more data, never spin here
+    if (dev->ringbuffer->getNumReadableSamples() < periodSize || ! dev->ringbuffer->read(s.buffers, periodSize))
+    {
+        // waiting for the host is the normal case, only count it once the device is about to run dry
+        if (! s.starving && (dev->hints & kDeviceBuffering) == 0)
+        {
+            const snd_pcm_sframes_t avail = snd_pcm_avail_update(dev->pcm);
+
+            if (avail >= 0 && dev->hwstatus.fullBufferSize - std::min<uint32_t>(avail, dev->hwstatus.fullBufferSize)
+                                  <= periodSize)
             {
-                if (err == -EAGAIN)
-                {
-                    deviceTimedWait(dev);
-                    continue;
-                }
+                s.starving = true;
+                ++dev->stats.blockedWaits;
+            }
+        }
 
-                restart();
+        return kDeviceStepWait;
+    }
 
-                printf("%08u | playback | Write error: %s\n", frame, snd_strerror(err));
+    s.starving = false;
 
-                if (xrun_recovery(dev->pcm, err) < 0)
-                {
-                    printf("playback | xrun_recovery error: %s\n", snd_strerror(err));
-                    goto end;
-                }
+    if (dev->hwstatus.channels == 0)
+        return kDeviceStepClose;
 
-                break;
-            }
+    if (s.enabled != dev->enabled)
+    {
+        s.enabled = dev->enabled;
+        s.gain.setTargetValue(s.enabled ? 1.f : 0.f);
+    }
 
-            if (dev->hints & kDeviceBuffering)
-            {
-                DEBUGPRINT("%08u | playback | wrote data, removing kDeviceBuffering", frame);
-                dev->hints &= ~kDeviceBuffering;
-            }
+    if (s.rbRatio != dev->rbRatio)
+    {
+        s.rbRatio = dev->rbRatio;
+        deviceResamplerSetRatio(s.resampler, s.rbRatio);
+    }
 
-            // FIXME check against snd_pcm_sw_params_set_avail_min ??
-            if (static_cast<uint16_t>(err) != frames)
-            {
-                DEBUGPRINT("%08u | playback | Incomplete write %ld of %u", frame, err, frames);
+    uint32_t frames = deviceResamplerProcess(s.resampler, s.buffers, periodSize, dev->buffers.f32, periodSize * 2);
 
-                ptr += err * channels * sampleSize;
-                frames -= err;
+    for (uint32_t i=0; i<frames; ++i)
+    {
+        xgain = s.gain.next();
 
-                deviceTimedWait(dev);
-                continue;
-            }
+        if (s.fadeIn != 0)
+            xgain *= 1.f - static_cast<float>(s.fadeIn--) / AUDIO_BRIDGE_XRUN_CROSSFADE_FRAMES;
+
+        for (uint16_t c=0; c<channels; ++c)
+            dev->buffers.f32[c][i] *= xgain;
+    }
+
+    deviceFloatToRaw(dev, frames);
 
+    s.pendingFrames = frames;
+    s.pendingOffset = 0;
+
+    return devicePlaybackFlush(s);
+}
+
+static void* devicePlaybackThread(void* const  arg)
+{
+    DeviceAudio* const dev = static_cast<DeviceAudio*>(arg);
+
+    DevicePlaybackState state;
+    devicePlaybackInit(state, dev);
+
+    simd::init();
+    deviceThreadInit(dev);
+
+    // stay parked while the host drives the device synchronously
+    if ((dev->hints & kDeviceSync) != 0 && ! deviceSyncWait(dev))
+        goto end;
+
+    // wait for audio thread to post
+    if (! notifierWait(&dev->notifier, 15000000000ULL))
+    {
+        DEBUGPRINT("%08u | playback | audio thread failed to post", dev->frame);
+        goto end;
+    }
+
+    deviceMarkStartup(dev, kDeviceStartupHostPost);
+
+    while (dev->hwstatus.channels != 0)
+    {
+        devicePrintStartup(dev);
+
+        switch (devicePlaybackStep(state))
+        {
+        case kDeviceStepAgain:
             break;
+        case kDeviceStepWait:
+            deviceTimedWait(dev);
+            break;
+        case kDeviceStepClose:
+            goto end;
         }
     }
 
 end:
     DEBUGPRINT("%08u | playback | audio thread closed", dev->frame);
 
-    delete resampler;
-
-    for (uint8_t c=0; c<channels; ++c)
-        delete[] buffers[c];
-    delete[] buffers;
+    devicePlaybackCleanup(state);
 
     dev->thread = 0;
     return nullptr;
@@ -233,9 +426,9 @@ end:
 
 static void runDeviceAudioPlayback(DeviceAudio* const dev, float* buffers[], const uint32_t frame)
 {
-    const uint16_t bufferSize = dev->bufferSize;
+    const uint32_t bufferSize = dev->bufferSize;
 
-    sem_post(&dev->sem);
+    notifierPost(&dev->notifier);
 
     if (dev->hints & kDeviceStarting)
     {
@@ -247,6 +440,7 @@ static void runDeviceAudioPlayback(DeviceAudio* const dev, float* buffers[], con
     if (dev->ringbuffer->getNumWritableSamples() < bufferSize)
     {
         DEBUGPRINT("%08u | playback | ringbuffer full, adding kDeviceInitializing|kDeviceStarting|kDeviceBuffering", frame);
+        ++dev->stats.rbFailures;
         deviceFailInitHints(dev);
         return;
     }
@@ -52,34 +52,34 @@ namespace float2int
 {
 
 static inline
-void s16(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s16(void* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
 {
     int16_t* const dstptr = static_cast<int16_t*>(dst);
 
-    for (uint16_t i=0; i<samples; ++i)
-        for (uint8_t c=0; c<channels; ++c)
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
             dstptr[i*channels+c] = float16(src[c][i]);
 }
 
 static inline
-void s24(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s24(void* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
 {
     int32_t* const dstptr = static_cast<int32_t*>(dst);
 
-    for (uint16_t i=0; i<samples; ++i)
-        for (uint8_t c=0; c<channels; ++c)
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
             dstptr[i*channels+c] = float24(src[c][i]);
 }
 
 static inline
-void s24le3(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s24le3(void* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
 {
     int8_t* dstptr = static_cast<int8_t*>(dst);
     int32_t z;
 
-    for (uint16_t i=0; i<samples; ++i)
+    for (uint32_t i=0; i<samples; ++i)
     {
-        for (uint8_t c=0; c<channels; ++c)
+        for (uint16_t c=0; c<channels; ++c)
         {
             z = float24(src[c][i]);
            #if __BYTE_ORDER == __BIG_ENDIAN
@@ -97,15 +97,152 @@ void s24le3(void* const dst, float* const* const src, const uint8_t channels, co
 }
 
 static inline
-void s32(void* const dst, float* const* const src, const uint8_t channels, const uint16_t samples)
+void s32(void* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
 {
     int32_t* const dstptr = static_cast<int32_t*>(dst);
 
-    for (uint16_t i=0; i<samples; ++i)
-        for (uint8_t c=0; c<channels; ++c)
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
             dstptr[i*channels+c] = float32(src[c][i]);
 }
 
+// non-interleaved variants, one destination buffer per channel
+
+namespace planar
+{
+
+static inline
+void s16(void* const* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        int16_t* const dstptr = static_cast<int16_t*>(dst[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+            dstptr[i] = float16(src[c][i]);
+    }
+}
+
+static inline
+void s24(void* const* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        int32_t* const dstptr = static_cast<int32_t*>(dst[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+            dstptr[i] = float24(src[c][i]);
+    }
+}
+
+static inline
+void s24le3(void* const* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    int32_t z;
+
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        int8_t* dstptr = static_cast<int8_t*>(dst[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+        {
+            z = float24(src[c][i]);
+           #if __BYTE_ORDER == __BIG_ENDIAN
+            dstptr[2] = static_cast<int8_t>(z);
+            dstptr[1] = static_cast<int8_t>(z >> 8);
+            dstptr[0] = static_cast<int8_t>(z >> 16);
+           #else
+            dstptr[0] = static_cast<int8_t>(z);
+            dstptr[1] = static_cast<int8_t>(z >> 8);
+            dstptr[2] = static_cast<int8_t>(z >> 16);
+           #endif
+            dstptr += 3;
+        }
+    }
+}
+
+static inline
+void s32(void* const* const dst, float* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        int32_t* const dstptr = static_cast<int32_t*>(dst[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+            dstptr[i] = float32(src[c][i]);
+    }
+}
+
+} // namespace planar
+
+// interleaved variants writing only some of the device channels, `map` has the device channel for each source one.
+// device frames are `stride` channels wide, unmapped channels are left untouched
+
+namespace mapped
+{
+
+static inline
+void s16(void* const dst, float* const* const src, const uint16_t* const map, const uint16_t channels,
+         const uint16_t stride, const uint32_t samples)
+{
+    int16_t* const dstptr = static_cast<int16_t*>(dst);
+
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
+            dstptr[i*stride+map[c]] = float16(src[c][i]);
+}
+
+static inline
+void s24(void* const dst, float* const* const src, const uint16_t* const map, const uint16_t channels,
+         const uint16_t stride, const uint32_t samples)
+{
+    int32_t* const dstptr = static_cast<int32_t*>(dst);
+
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
+            dstptr[i*stride+map[c]] = float24(src[c][i]);
+}
+
+static inline
+void s24le3(void* const dst, float* const* const src, const uint16_t* const map, const uint16_t channels,
+            const uint16_t stride, const uint32_t samples)
+{
+    int8_t* const dstptr = static_cast<int8_t*>(dst);
+    int8_t* ptr;
+    int32_t z;
+
+    for (uint32_t i=0; i<samples; ++i)
+    {
+        for (uint16_t c=0; c<channels; ++c)
+        {
+            z = float24(src[c][i]);
+            ptr = dstptr + (i*stride+map[c])*3;
+           #if __BYTE_ORDER == __BIG_ENDIAN
+            ptr[2] = static_cast<int8_t>(z);
+            ptr[1] = static_cast<int8_t>(z >> 8);
+            ptr[0] = static_cast<int8_t>(z >> 16);
+           #else
+            ptr[0] = static_cast<int8_t>(z);
+            ptr[1] = static_cast<int8_t>(z >> 8);
+            ptr[2] = static_cast<int8_t>(z >> 16);
+           #endif
+        }
+    }
+}
+
+static inline
+void s32(void* const dst, float* const* const src, const uint16_t* const map, const uint16_t channels,
+         const uint16_t stride, const uint32_t samples)
+{
+    int32_t* const dstptr = static_cast<int32_t*>(dst);
+
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
+            dstptr[i*stride+map[c]] = float32(src[c][i]);
+}
+
+} // namespace mapped
+
 } // namespace float2int
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -114,34 +251,34 @@ namespace int2float
 {
 
 static inline
-void s16(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s16(float* const* const dst, void* const src, const uint16_t channels, const uint32_t samples)
 {
     int16_t* const srcptr = static_cast<int16_t*>(src);
 
-    for (uint16_t i=0; i<samples; ++i)
-        for (uint8_t c=0; c<channels; ++c)
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
             dst[c][i] = static_cast<float>(srcptr[i*channels+c]) * (1.f / 32767.f);
 }
 
 static inline
-void s24(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s24(float* const* const dst, void* const src, const uint16_t channels, const uint32_t samples)
 {
     int32_t* const srcptr = static_cast<int32_t*>(src);
 
-    for (uint16_t i=0; i<samples; ++i)
-        for (uint8_t c=0; c<channels; ++c)
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
             dst[c][i] = static_cast<float>(srcptr[i*channels+c]) * (1.f / 8388607.f);
 }
 
 static inline
-void s24le3(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s24le3(float* const* const dst, void* const src, const uint16_t channels, const uint32_t samples)
 {
     uint8_t* srcptr = static_cast<uint8_t*>(src);
     int32_t z;
 
-    for (uint16_t i=0; i<samples; ++i)
+    for (uint32_t i=0; i<samples; ++i)
     {
-        for (uint8_t c=0; c<channels; ++c)
+        for (uint16_t c=0; c<channels; ++c)
         {
            #if __BYTE_ORDER == __BIG_ENDIAN
             z = (static_cast<int32_t>(srcptr[0]) << 16)
@@ -169,15 +306,171 @@ void s24le3(float* const* const dst, void* const src, const uint8_t channels, co
 }
 
 static inline
-void s32(float* const* const dst, void* const src, const uint8_t channels, const uint16_t samples)
+void s32(float* const* const dst, void* const src, const uint16_t channels, const uint32_t samples)
 {
     int32_t* const srcptr = static_cast<int32_t*>(src);
 
-    for (uint16_t i=0; i<samples; ++i)
-        for (uint8_t c=0; c<channels; ++c)
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
             dst[c][i] = static_cast<double>(srcptr[i*channels+c]) * (1.0 / 2147483647.0);
 }
 
+// non-interleaved variants, one source buffer per channel
+
+namespace planar
+{
+
+static inline
+void s16(float* const* const dst, void* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        const int16_t* const srcptr = static_cast<const int16_t*>(src[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+            dst[c][i] = static_cast<float>(srcptr[i]) * (1.f / 32767.f);
+    }
+}
+
+static inline
+void s24(float* const* const dst, void* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        const int32_t* const srcptr = static_cast<const int32_t*>(src[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+            dst[c][i] = static_cast<float>(srcptr[i]) * (1.f / 8388607.f);
+    }
+}
+
+static inline
+void s24le3(float* const* const dst, void* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    int32_t z;
+
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        const uint8_t* srcptr = static_cast<const uint8_t*>(src[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+        {
+           #if __BYTE_ORDER == __BIG_ENDIAN
+            z = (static_cast<int32_t>(srcptr[0]) << 16)
+              + (static_cast<int32_t>(srcptr[1]) << 8)
+              +  static_cast<int32_t>(srcptr[2]);
+
+            if (srcptr[0] & 0x80)
+                z |= 0xff000000;
+           #else
+            z = (static_cast<int32_t>(srcptr[2]) << 16)
+              + (static_cast<int32_t>(srcptr[1]) << 8)
+              +  static_cast<int32_t>(srcptr[0]);
+
+            if (srcptr[2] & 0x80)
+                z |= 0xff000000;
+           #endif
+
+            dst[c][i] = z <= -8388607 ? -1.f
+                      : z >= 8388607 ? 1.f
+                      : static_cast<float>(z) * (1.f / 8388607.f);
+
+            srcptr += 3;
+        }
+    }
+}
+
+static inline
+void s32(float* const* const dst, void* const* const src, const uint16_t channels, const uint32_t samples)
+{
+    for (uint16_t c=0; c<channels; ++c)
+    {
+        const int32_t* const srcptr = static_cast<const int32_t*>(src[c]);
+
+        for (uint32_t i=0; i<samples; ++i)
+            dst[c][i] = static_cast<double>(srcptr[i]) * (1.0 / 2147483647.0);
+    }
+}
+
+} // namespace planar
+
+// interleaved variants reading only some of the device channels, `map` has the device channel for each destination one.
+// device frames are `stride` channels wide
+
+namespace mapped
+{
+
+static inline
+void s16(float* const* const dst, void* const src, const uint16_t* const map, const uint16_t channels,
+         const uint16_t stride, const uint32_t samples)
+{
+    int16_t* const srcptr = static_cast<int16_t*>(src);
+
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
+            dst[c][i] = static_cast<float>(srcptr[i*stride+map[c]]) * (1.f / 32767.f);
+}
+
+static inline
+void s24(float* const* const dst, void* const src, const uint16_t* const map, const uint16_t channels,
+         const uint16_t stride, const uint32_t samples)
+{
+    int32_t* const srcptr = static_cast<int32_t*>(src);
+
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
+            dst[c][i] = static_cast<float>(srcptr[i*stride+map[c]]) * (1.f / 8388607.f);
+}
+
+static inline
+void s24le3(float* const* const dst, void* const src, const uint16_t* const map, const uint16_t channels,
+            const uint16_t stride, const uint32_t samples)
+{
+    const uint8_t* const srcptr = static_cast<const uint8_t*>(src);
+    const uint8_t* ptr;
+    int32_t z;
+
+    for (uint32_t i=0; i<samples; ++i)
+    {
+        for (uint16_t c=0; c<channels; ++c)
+        {
+            ptr = srcptr + (i*stride+map[c])*3;
+           #if __BYTE_ORDER == __BIG_ENDIAN
+            z = (static_cast<int32_t>(ptr[0]) << 16)
+              + (static_cast<int32_t>(ptr[1]) << 8)
+              +  static_cast<int32_t>(ptr[2]);
+
+            if (ptr[0] & 0x80)
+                z |= 0xff000000;
+           #else
+            z = (static_cast<int32_t>(ptr[2]) << 16)
+              + (static_cast<int32_t>(ptr[1]) << 8)
+              +  static_cast<int32_t>(ptr[0]);
+
+            if (ptr[2] & 0x80)
+                z |= 0xff000000;
+           #endif
+
+            dst[c][i] = z <= -8388607 ? -1.f
+                      : z >= 8388607 ? 1.f
+                      : static_cast<float>(z) * (1.f / 8388607.f);
+        }
+    }
+}
+
+static inline
+void s32(float* const* const dst, void* const src, const uint16_t* const map, const uint16_t channels,
+         const uint16_t stride, const uint32_t samples)
+{
+    int32_t* const srcptr = static_cast<int32_t*>(src);
+
+    for (uint32_t i=0; i<samples; ++i)
+        for (uint16_t c=0; c<channels; ++c)
+            dst[c][i] = static_cast<double>(srcptr[i*stride+map[c]]) * (1.0 / 2147483647.0);
+}
+
+} // namespace mapped
+
 } // namespace int2float
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,461 @@
+// SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+// Offline benchmark for the device pipeline, no soundcard or audio server needed.
+// Runs the real capture and playback steps against a simulated PCM, as fast as possible on simulated clocks:
+// the host side calls runDeviceAudioCapture/runDeviceAudioPlayback once per block at the nominal rate,
+// while the simulated soundcard runs at a rate that drifts away from it, changing direction halfway through,
+// so the drift filter has to steer the ringbuffer fill back both ways.
+// Steps run in their non-blocking pooled form, with the main loop below taking the place of the pool worker.
+// Fails if any step takes longer to process than its frames last in real-time, if the ringbuffer runs dry or full,
+// or if the soundcard buffer overruns (capture) or underruns (playback).
+//
+// usage: audio-bridge-benchmark [frames] [sample-rate] [channels] [seconds]
+
+#include "audio-device-init.cpp"
+
+// how far the simulated device clock drifts from the host one, in parts per million
+#define AUDIO_BRIDGE_BENCHMARK_DRIFT_PPM 100
+
+// --------------------------------------------------------------------------------------------------------------------
+// Simulated PCM, replacing the ALSA functions used by the device steps.
+// Follows the sw params set by initDeviceAudio: playback starts once a period is queued, capture on the first read,
+// and neither stops on xruns, which are counted here instead.
+
+// current host time in seconds, advanced by the benchmark loop
+static double sNow = 0.0;
+
+// device clock runs fast for the first half of the run and slow for the second one
+static double sDriftSwitchTime = 0.0;
+
+struct _snd_pcm {
+    DeviceAudio* dev;
+    snd_pcm_state_t state;
+    // device position in frames, advancing on the device clock while running
+    double hwPos;
+    double hwTime;
+    // application position in frames
+    uint64_t applPos;
+    // frames transferred by reads and writes, for measuring the load of each step
+    uint64_t transferred;
+    uint32_t xruns;
+};
+
+// device sample rate as seen from the host clock at a given time, in seconds
+static double benchmarkDeviceRate(const DeviceAudio* const dev, const double time)
+{
+    const double drift = AUDIO_BRIDGE_BENCHMARK_DRIFT_PPM * 1e-6;
+
+    return dev->sampleRate * (time < sDriftSwitchTime ? 1.0 + drift : 1.0 - drift);
+}
+
+static uint64_t benchmarkPcmUpdate(snd_pcm_t* const pcm)
+{
+    DeviceAudio* const dev = pcm->dev;
+
+    if (pcm->state != SND_PCM_STATE_RUNNING)
+        return static_cast<uint64_t>(pcm->hwPos);
+
+    pcm->hwPos += (sNow - pcm->hwTime) * benchmarkDeviceRate(dev, pcm->hwTime);
+    pcm->hwTime = sNow;
+
+    const uint64_t hwPos = static_cast<uint64_t>(pcm->hwPos);
+
+    if (dev->hints & kDeviceCapture)
+    {
+        // device overwrote data not read yet
+        if (hwPos - pcm->applPos > dev->hwstatus.fullBufferSize)
+        {
+            ++pcm->xruns;
+            pcm->applPos = hwPos - dev->hwstatus.fullBufferSize;
+        }
+    }
+    else
+    {
+        // device played past the written data
+        if (hwPos > pcm->applPos)
+        {
+            ++pcm->xruns;
+            pcm->applPos = hwPos;
+        }
+    }
+
+    return hwPos;
+}
+
+static snd_pcm_sframes_t benchmarkPcmAvail(snd_pcm_t* const pcm)
+{
+    const uint64_t hwPos = benchmarkPcmUpdate(pcm);
+
+    return pcm->dev->hints & kDeviceCapture ? hwPos - pcm->applPos
+                                            : pcm->dev->hwstatus.fullBufferSize - (pcm->applPos - hwPos);
+}
+
+// a different sine on each channel, as if read from the device
+static void benchmarkPcmRead(snd_pcm_t* const pcm, int32_t* const* const ptrs, const uint32_t frames)
+{
+    const uint16_t channels = pcm->dev->hwstatus.deviceChannels;
+    const bool interleaved = (pcm->dev->hints & kDeviceNonInterleaved) == 0;
+
+    for (uint32_t i=0; i<frames; ++i)
+    {
+        for (uint16_t c=0; c<channels; ++c)
+        {
+            const int32_t sample = float32(0.5 * std::sin((pcm->applPos + i) * (c + 1) * 0.001));
+
+            if (interleaved)
+                ptrs[0][i*channels+c] = sample;
+            else
+                ptrs[c][i] = sample;
+        }
+    }
+}
+
+static snd_pcm_sframes_t benchmarkPcmTransfer(snd_pcm_t* const pcm, int32_t* const* const ptrs,
+                                              const snd_pcm_uframes_t frames)
+{
+    const bool capture = pcm->dev->hints & kDeviceCapture;
+
+    switch (pcm->state)
+    {
+    case SND_PCM_STATE_PREPARED:
+        if (capture)
+            snd_pcm_start(pcm);
+        break;
+    case SND_PCM_STATE_RUNNING:
+        break;
+    default:
+        return -EBADFD;
+    }
+
+    const snd_pcm_sframes_t avail = benchmarkPcmAvail(pcm);
+    const uint32_t count = static_cast<uint32_t>(std::min<snd_pcm_sframes_t>(avail, frames));
+
+    if (count == 0)
+        return -EAGAIN;
+
+    if (capture)
+        benchmarkPcmRead(pcm, ptrs, count);
+
+    pcm->applPos += count;
+    pcm->transferred += count;
+
+    if (! capture && pcm->state == SND_PCM_STATE_PREPARED && ! pcm->dev->options.lowLatencyStart
+        && pcm->applPos - static_cast<uint64_t>(pcm->hwPos) >= pcm->dev->hwstatus.periodSize)
+        snd_pcm_start(pcm);
+
+    return count;
+}
+
+snd_pcm_state_t snd_pcm_state(snd_pcm_t* const pcm)
+{
+    benchmarkPcmUpdate(pcm);
+    return pcm->state;
+}
+
+snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t* const pcm)
+{
+    return benchmarkPcmAvail(pcm);
+}
+
+int snd_pcm_delay(snd_pcm_t* const pcm, snd_pcm_sframes_t* const delay)
+{
+    const uint64_t hwPos = benchmarkPcmUpdate(pcm);
+
+    *delay = pcm->dev->hints & kDeviceCapture ? hwPos - pcm->applPos : pcm->applPos - hwPos;
+    return 0;
+}
+
+int snd_pcm_start(snd_pcm_t* const pcm)
+{
+    if (pcm->state != SND_PCM_STATE_PREPARED)
+        return -EBADFD;
+
+    pcm->state = SND_PCM_STATE_RUNNING;
+    pcm->hwTime = sNow;
+    return 0;
+}
+
+int snd_pcm_prepare(snd_pcm_t* const pcm)
+{
+    pcm->state = SND_PCM_STATE_PREPARED;
+    pcm->hwPos = pcm->applPos;
+    return 0;
+}
+
+int snd_pcm_drop(snd_pcm_t* const pcm)
+{
+    pcm->state = SND_PCM_STATE_SETUP;
+    return 0;
+}
+
+int snd_pcm_resume(snd_pcm_t*)
+{
+    return 0;
+}
+
+snd_pcm_sframes_t snd_pcm_rewind(snd_pcm_t* const pcm, const snd_pcm_uframes_t frames)
+{
+    pcm->applPos -= frames;
+    return frames;
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_readi(snd_pcm_t* const pcm, void* const buffer, const snd_pcm_uframes_t frames)
+{
+    int32_t* const ptrs[1] = { static_cast<int32_t*>(buffer) };
+    return benchmarkPcmTransfer(pcm, ptrs, frames);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_readn(snd_pcm_t* const pcm, void** const bufs, const snd_pcm_uframes_t frames)
+{
+    return benchmarkPcmTransfer(pcm, reinterpret_cast<int32_t* const*>(bufs), frames);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_writei(snd_pcm_t* const pcm, const void*, const snd_pcm_uframes_t frames)
+{
+    return benchmarkPcmTransfer(pcm, nullptr, frames);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_writen(snd_pcm_t* const pcm, void**, const snd_pcm_uframes_t frames)
+{
+    return benchmarkPcmTransfer(pcm, nullptr, frames);
+}
+
+// only used for the avail_min of pooled capture, which has no meaning without poll
+int snd_pcm_sw_params_current(snd_pcm_t*, snd_pcm_sw_params_t*)
+{
+    return 0;
+}
+
+int snd_pcm_sw_params_set_avail_min(snd_pcm_t*, snd_pcm_sw_params_t*, snd_pcm_uframes_t)
+{
+    return 0;
+}
+
+int snd_pcm_sw_params(snd_pcm_t*, snd_pcm_sw_params_t*)
+{
+    return 0;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+// CPU time of the calling thread, so steps are not charged for the benchmark itself getting preempted
+static uint64_t benchmarkCpuTimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+struct BenchmarkStats {
+    uint64_t totalNs;
+    uint64_t totalFrames;
+    double maxLoad;
+    uint32_t steps;
+    uint32_t xruns;
+    uint32_t rbFailures;
+    uint32_t droppedFrames;
+    uint32_t minFill;
+    uint32_t maxFill;
+    double minRatio;
+    double maxRatio;
+};
+
+// sets up a device as initDeviceAudio would, with the simulated PCM instead of a real one
+static DeviceAudio* benchmarkInitDevice(const bool playback,
+                                        const uint32_t frames,
+                                        const uint32_t sampleRate,
+                                        const uint16_t channels)
+{
+    DeviceAudio* const dev = new DeviceAudio();
+    initDeviceAudioOptions(&dev->options);
+    loadDeviceAudioOptionsFromEnv(&dev->options);
+
+    dev->deviceID = strdup(playback ? "benchmark-playback" : "benchmark-capture");
+    dev->sampleRate = sampleRate;
+    dev->bufferSize = frames;
+    dev->hints = kDeviceInitializing|kDeviceStarting|kDeviceBuffering|kDeviceSample32|kDevicePooled
+               | (playback ? 0 : kDeviceCapture);
+    dev->enabled = true;
+    dev->hwstatus.channels = dev->hwstatus.deviceChannels = channels;
+    dev->hwstatus.periods = 3;
+    dev->hwstatus.periodSize = frames;
+    dev->hwstatus.fullBufferSize = frames * 3;
+
+    if (! playback)
+        deviceLimitCaptureBlocks(dev->options, dev->hwstatus.periods);
+
+    dev->pcm = new snd_pcm_t();
+    dev->pcm->dev = dev;
+    snd_pcm_prepare(dev->pcm);
+
+    deviceAllocBuffers(*dev);
+    notifierInit(&dev->notifier);
+    return dev;
+}
+
+static void benchmarkCloseDevice(DeviceAudio* const dev)
+{
+    delete dev->pcm;
+    std::free(dev->deviceID);
+    deviceFreeBuffers(dev, dev->hwstatus.channels);
+    delete dev;
+}
+
+// checks the host side after each block
+static void benchmarkAddHostBlock(BenchmarkStats& stats, const DeviceAudio* const dev)
+{
+    if (dev->hints & kDeviceBuffering)
+        return;
+
+    const uint32_t fill = dev->ringbuffer->getNumReadableSamples();
+
+    stats.minFill = std::min(stats.minFill, fill);
+    stats.maxFill = std::max(stats.maxFill, fill);
+
+    // only once the drift filter is active, see setDeviceTimings
+    if (dev->framesDone >= dev->sampleRate * AUDIO_BRIDGE_CLOCK_DRIFT_WAIT_DELAY_MS / 1000)
+    {
+        stats.minRatio = std::min(stats.minRatio, dev->rbRatio);
+        stats.maxRatio = std::max(stats.maxRatio, dev->rbRatio);
+    }
+}
+
+// host calls runDeviceAudioCapture/runDeviceAudioPlayback once per block on the host clock, waking up the device.
+// device runs its steps until they have to wait, then sleeps until woken up or for the deviceTimedWait timeout
+template <class State, void (*Init)(State&, DeviceAudio*), void (*Cleanup)(State&),
+          DeviceThreadStep (*Step)(State&), void (*Run)(DeviceAudio*, float*[], uint32_t)>
+static BenchmarkStats benchmarkRun(DeviceAudio* const dev, float* hostBuffers[], const uint32_t seconds)
+{
+    State s;
+    Init(s, dev);
+
+    BenchmarkStats stats = { 0, 0, 0.0, 0, 0, 0, 0, UINT32_MAX, 0, 2.0, 0.0 };
+    snd_pcm_t* const pcm = dev->pcm;
+    const double hostPeriod = static_cast<double>(dev->bufferSize) / dev->sampleRate;
+    const double waitTime = std::min(dev->bufferSize, dev->hwstatus.periodSize)
+                          / static_cast<double>(dev->sampleRate) / AUDIO_BRIDGE_CAPTURE_BLOCK_SIZE_MULT;
+
+    double hostTime = 0.0;
+    double deviceTime = 0.0;
+
+    sNow = 0.0;
+
+    while (sNow < seconds)
+    {
+        if (hostTime <= deviceTime)
+        {
+            sNow = hostTime;
+
+            Run(dev, hostBuffers, dev->frame);
+            dev->frame += dev->bufferSize;
+
+            benchmarkAddHostBlock(stats, dev);
+            hostTime += hostPeriod;
+
+            // woken up by the host post
+            deviceTime = sNow;
+            continue;
+        }
+
+        sNow = deviceTime;
+
+        for (DeviceThreadStep step = kDeviceStepAgain; step == kDeviceStepAgain;)
+        {
+            const uint64_t transferred = pcm->transferred;
+            const uint64_t start = benchmarkCpuTimeNs();
+
+            step = Step(s);
+
+            const uint64_t ns = benchmarkCpuTimeNs() - start;
+            const uint64_t frames = pcm->transferred - transferred;
+
+            if (step == kDeviceStepClose)
+            {
+                printf("%s | device step closed the device\n", dev->deviceID);
+                ++stats.xruns;
+                sNow = seconds;
+                break;
+            }
+
+            if (frames == 0)
+                continue;
+
+            // a real device thread gets woken once per period, so short partial transfers still have a period of time
+            const uint64_t budget = std::max<uint64_t>(frames, dev->hwstatus.periodSize);
+
+            stats.totalNs += ns;
+            stats.totalFrames += frames;
+            stats.maxLoad = std::max(stats.maxLoad, ns * 1e-9 * dev->sampleRate / budget);
+            ++stats.steps;
+        }
+
+        deviceTime = sNow + waitTime;
+    }
+
+    stats.xruns += pcm->xruns + dev->stats.xruns;
+    stats.rbFailures = dev->stats.rbFailures;
+    stats.droppedFrames = dev->stats.droppedFrames;
+
+    Cleanup(s);
+    return stats;
+}
+
+static bool benchmarkReport(const char* const name, const BenchmarkStats& stats, const DeviceAudio* const dev)
+{
+    const double avgLoad = stats.totalFrames != 0
+                         ? stats.totalNs * 1e-9 * dev->sampleRate / stats.totalFrames * 100.0
+                         : 0.0;
+    const double maxLoad = stats.maxLoad * 100.0;
+    const bool ok = stats.xruns == 0 && stats.rbFailures == 0 && stats.droppedFrames == 0 && maxLoad < 100.0;
+
+    printf("%s | %u steps | load avg %.2f%% max %.2f%% | ringbuffer fill %u..%u of %u, target %u"
+           " | ratio %.6f..%.6f | %u xruns, %u ringbuffer failures, %u dropped frames | %s\n",
+           name, stats.steps, avgLoad, maxLoad,
+           stats.minFill, stats.maxFill, dev->ringbuffer->getNumSamples(), getRingBufferFillTarget(dev),
+           stats.minRatio, stats.maxRatio, stats.xruns, stats.rbFailures, stats.droppedFrames, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, const char* argv[])
+{
+    const uint32_t frames = argc > 1 ? std::max(16, std::atoi(argv[1])) : 16384;
+    const uint32_t sampleRate = argc > 2 ? std::max(8000, std::atoi(argv[2])) : 384000;
+    const uint16_t channels = argc > 3 ? std::max(1, std::min(AUDIO_BRIDGE_MAX_CHANNELS, std::atoi(argv[3]))) : 2;
+    const uint32_t seconds = argc > 4 ? std::max(1, std::atoi(argv[4])) : 60;
+
+    sDriftSwitchTime = seconds / 2.0;
+
+    printf("benchmarking %u frames at %u Hz, %u channels, %u seconds of audio\n", frames, sampleRate, channels, seconds);
+
+    simd::init();
+
+    float** const hostBuffers = new float*[channels];
+    for (uint16_t c=0; c<channels; ++c)
+        hostBuffers[c] = new float[frames]();
+
+    bool ok = true;
+
+    {
+        DeviceAudio* const dev = benchmarkInitDevice(false, frames, sampleRate, channels);
+        const BenchmarkStats stats = benchmarkRun<DeviceCaptureState, deviceCaptureInit, deviceCaptureCleanup,
+                                                  deviceCaptureStep, runDeviceAudioCapture>(dev, hostBuffers, seconds);
+        ok &= benchmarkReport("capture", stats, dev);
+        benchmarkCloseDevice(dev);
+    }
+
+    {
+        DeviceAudio* const dev = benchmarkInitDevice(true, frames, sampleRate, channels);
+        const BenchmarkStats stats = benchmarkRun<DevicePlaybackState, devicePlaybackInit, devicePlaybackCleanup,
+                                                  devicePlaybackStep, runDeviceAudioPlayback>(dev, hostBuffers, seconds);
+        ok &= benchmarkReport("playback", stats, dev);
+        benchmarkCloseDevice(dev);
+    }
+
+    for (uint16_t c=0; c<channels; ++c)
+        delete[] hostBuffers[c];
+    delete[] hostBuffers;
+
+    return ok ? 0 : 1;
+}
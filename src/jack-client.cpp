@@ -2,9 +2,11 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
 #include "audio-device-init.hpp"
 
 #include <jack/jack.h>
+#include <algorithm>
 #include <cstring>
 #include <unistd.h>
 
@@ -12,94 +14,327 @@
 # define MOD_AUDIO_USB_BRIDGE
 #endif
 
+// maximum number of soundcards a single client can aggregate
+#define AUDIO_BRIDGE_MAX_DEVICES 8
+
+// how many milliseconds the measured latency of a device needs to change by before JACK recomputes latencies
+#define AUDIO_BRIDGE_LATENCY_UPDATE_MS 1
+
 struct ClientData;
-static bool activate_capture(ClientData* d);
-static bool activate_playback(ClientData* d);
+static bool activate_capture(ClientData* d, uint8_t index);
+static bool activate_playback(ClientData* d, uint8_t index);
+static bool activate_duplex(ClientData* d, uint8_t index);
 
-struct ClientData {
+// a single soundcard within the client, each with its own drift-compensated pipeline
+struct ClientDevice {
+    char* deviceID = nullptr;
     DeviceAudio* dev = nullptr;
-    jack_client_t* client = nullptr;
     float** buffers = {};
     jack_port_t** ports = {};
-    uint8_t channels = 0;
-    bool playback = false;
+    uint16_t channels = 0;
+    // duplex mode has capture ports first, then playback ports
+    uint16_t captureChannels = 0;
     bool active = true;
+    // ports are registered and safe to use from the process callback
+    bool registered = false;
+    // pipeline handover to the process callback, see ClientData::swapDevice
+    DeviceAudio* next = nullptr;
+    // pipeline being replaced, kept open until the process callback acknowledged the swap
+    DeviceAudio* prev = nullptr;
+    bool swapRequested = false;
+    // latency in frames last reported to JACK, see ClientData::updateLatency
+    uint32_t captureLatency = 0;
+    uint32_t playbackLatency = 0;
+};
+
+struct ClientData {
+    ClientDevice devices[AUDIO_BRIDGE_MAX_DEVICES];
+    uint8_t numDevices = 0;
+    DeviceAudioOptions options = {};
+    jack_client_t* client = nullptr;
+    // current JACK settings, updated by the buffer size and sample rate callbacks
+    uint32_t bufferSize = 0;
+    uint32_t sampleRate = 0;
+    bool playback = false;
+    bool duplex = false;
+    bool activated = false;
+    // JACK is running in freewheel mode, set from the freewheel callback
+    bool freewheel = false;
+    // align all devices to the latency of the slowest one
+    bool groupLatency = false;
     bool running = true;
+    // posted by hotplug, JACK setting changes and the process callback, see ClientData::run
+    Notifier events = {};
 
-   #ifdef AUDIO_BRIDGE_INTERNAL_JACK_CLIENT
-    char* deviceID = nullptr;
-    pthread_t thread = {};
+    // "channels=1,2,5-8" style arguments select which device channels are bridged
+    bool parseChannelMapArg(const char* const arg, const size_t len)
+    {
+        static constexpr const size_t prefixlen = sizeof("channels=") - 1;
+
+        if (len < prefixlen || std::strncmp(arg, "channels=", prefixlen) != 0)
+            return false;
 
-    void runInternal()
+        char map[128] = {};
+        std::memcpy(map, arg + prefixlen, std::min(len - prefixlen, sizeof(map) - 1));
+
+        if (! parseDeviceChannelMap(&options, map))
+            printf("invalid channel map %s, bridging all channels\n", map);
+
+        return true;
+    }
+
+    bool addDevice(const char* const id, const size_t len)
     {
-        const uint16_t bufferSize = jack_get_buffer_size(client);
-        const uint32_t sampleRate = jack_get_sample_rate(client);
+        if (numDevices == AUDIO_BRIDGE_MAX_DEVICES)
+        {
+            printf("too many devices, ignoring %.*s\n", static_cast<int>(len), id);
+            return false;
+        }
 
-        while (running && dev == nullptr)
+        char* const deviceID = static_cast<char*>(std::malloc(len + 1));
+        std::memcpy(deviceID, id, len);
+        deviceID[len] = '\0';
+
+        devices[numDevices++].deviceID = deviceID;
+        return true;
+    }
+
+    DeviceAudio* createDevice(const uint8_t index)
+    {
+        const ClientDevice& cd(devices[index]);
+        const uint32_t devBufferSize = __atomic_load_n(&bufferSize, __ATOMIC_SEQ_CST);
+        const uint32_t devSampleRate = __atomic_load_n(&sampleRate, __ATOMIC_SEQ_CST);
+
+        if (duplex)
+            return initDeviceAudioDuplex(cd.deviceID, devBufferSize, devSampleRate, &options);
+
+        return initDeviceAudio(cd.deviceID, playback, devBufferSize, devSampleRate, &options);
+    }
+
+    bool openDevice(const uint8_t index)
+    {
+        ClientDevice& cd(devices[index]);
+
+        cd.dev = createDevice(index);
+
+        if (cd.dev == nullptr)
+            return false;
+
+        cd.active = true;
+
+        // ports are only registered once, so they stay around if the device goes away and comes back
+        if (! cd.registered)
+        {
+            if (duplex)
+                activate_duplex(this, index);
+            else if (playback)
+                activate_playback(this, index);
+            else
+                activate_capture(this, index);
+        }
+
+        return true;
+    }
+
+    // hands a new pipeline (or none) over to the process callback, waiting up to 1 second for it to be picked up.
+    // returns false if JACK is not processing, the swap then stays pending and is completed by a later call to
+    // finishSwap, the previous pipeline is never closed before that as the process callback might still use it
+    bool swapDevice(const uint8_t index, DeviceAudio* const dev)
+    {
+        ClientDevice& cd(devices[index]);
+
+        cd.prev = cd.dev;
+        cd.next = dev;
+        __atomic_store_n(&cd.swapRequested, true, __ATOMIC_RELEASE);
+
+        for (int i = 0; i < 1000 && __atomic_load_n(&cd.swapRequested, __ATOMIC_ACQUIRE); ++i)
+            usleep(1000);
+
+        return finishSwap(index);
+    }
+
+    // closes the replaced pipeline once the process callback acknowledged the swap, returns false while still pending
+    bool finishSwap(const uint8_t index)
+    {
+        ClientDevice& cd(devices[index]);
+
+        if (__atomic_load_n(&cd.swapRequested, __ATOMIC_ACQUIRE))
+            return false;
+
+        if (cd.prev != nullptr)
         {
-            dev = initDeviceAudio(deviceID, playback, bufferSize, sampleRate);
+            closeDeviceAudio(cd.prev);
+            cd.prev = nullptr;
+        }
+
+        return true;
+    }
+
+    // replaces pipelines set up for a previous buffer size or sample rate, keeping ports and connections as-is
+    void rebuildDevices()
+    {
+        const uint32_t devBufferSize = __atomic_load_n(&bufferSize, __ATOMIC_SEQ_CST);
+        const uint32_t devSampleRate = __atomic_load_n(&sampleRate, __ATOMIC_SEQ_CST);
 
-            if (dev != nullptr)
+        for (uint8_t i = 0; i < numDevices; ++i)
+        {
+            ClientDevice& cd(devices[i]);
+
+            // JACK was stalled during a previous swap, retry until the process callback picks it up
+            if (! finishSwap(i))
+                continue;
+
+            if (cd.dev == nullptr || ! cd.active)
+                continue;
+            if (cd.dev->bufferSize == devBufferSize && cd.dev->sampleRate == devSampleRate)
+                continue;
+
+            DEBUGPRINT("%s | rebuilding for buffer size %u, sample rate %u", cd.deviceID, devBufferSize, devSampleRate);
+
+            // build the new pipeline while the old one is still open, only possible if the device can be shared
+            if (! swapDevice(i, createDevice(i)))
             {
-                channels = dev->hwstatus.channels;
+                DEBUGPRINT("%s | JACK is not processing, swap left pending", cd.deviceID);
+                continue;
+            }
+
+            // exclusive device, open it again now that the old pipeline is gone
+            if (cd.dev == nullptr)
+                openDevice(i);
+        }
+    }
+
+    // latency of a device without the extra latency it was raised by, synchronous devices do not report the extra
+    static uint32_t getOwnLatency(const DeviceAudio* const dev)
+    {
+        const uint32_t latency = getDeviceAudioLatency(dev);
+        return latency > dev->rbExtraLatency ? latency - dev->rbExtraLatency : 0;
+    }
+
+    // raise all devices to the latency of the slowest one, so their streams line up in the JACK graph.
+    // capture and playback sides of duplex devices are aligned separately, as they are separate paths in the graph
+    void alignLatency()
+    {
+        if (! groupLatency || numDevices < 2)
+            return;
+
+        uint32_t maxLatency[2] = { 0, 0 };
 
-                if (playback)
-                    activate_playback(this);
-                else
-                    activate_capture(this);
+        for (uint8_t i = 0; i < numDevices; ++i)
+        {
+            if (DeviceAudio* const dev = devices[i].dev)
+            {
+                maxLatency[0] = std::max(maxLatency[0], getOwnLatency(dev));
 
-                break;
+                if (DeviceAudio* const peer = dev->duplexPeer)
+                    maxLatency[1] = std::max(maxLatency[1], getOwnLatency(peer));
             }
+        }
+
+        for (uint8_t i = 0; i < numDevices; ++i)
+        {
+            if (DeviceAudio* const dev = devices[i].dev)
+            {
+                setDeviceAudioExtraLatency(dev, maxLatency[0] - getOwnLatency(dev));
 
-            usleep(250000); // 250ms
+                if (DeviceAudio* const peer = dev->duplexPeer)
+                    setDeviceAudioExtraLatency(peer, maxLatency[1] - getOwnLatency(peer));
+            }
         }
+    }
 
-        running = false;
+    // checks if a device latency moved noticeably from the value reported to JACK, also used by the process callback
+    bool latencyMoved(const ClientDevice& cd, uint32_t& captureLatency, uint32_t& playbackLatency) const
+    {
+        const uint32_t threshold = __atomic_load_n(&sampleRate, __ATOMIC_RELAXED) * AUDIO_BRIDGE_LATENCY_UPDATE_MS / 1000;
+
+        DeviceAudio* const capture = duplex || ! playback ? cd.dev : nullptr;
+        DeviceAudio* const playbackDev = duplex ? cd.dev->duplexPeer : playback ? cd.dev : nullptr;
+
+        captureLatency = capture != nullptr ? getDeviceAudioLatency(capture) : 0;
+        playbackLatency = playbackDev != nullptr ? getDeviceAudioLatency(playbackDev) : 0;
+
+        return std::abs(static_cast<int>(captureLatency - __atomic_load_n(&cd.captureLatency, __ATOMIC_RELAXED)))
+                   > static_cast<int>(threshold) ||
+               std::abs(static_cast<int>(playbackLatency - __atomic_load_n(&cd.playbackLatency, __ATOMIC_RELAXED)))
+                   > static_cast<int>(threshold);
     }
 
-    static void* threadRunInternal(void* const arg)
+    // tells JACK to recompute latencies once any device latency moved noticeably from the reported value
+    void updateLatency()
     {
-        ClientData* const d = static_cast<ClientData*>(arg);
-        d->runInternal();
-        return nullptr;
+        uint32_t captureLatency, playbackLatency;
+        bool changed = false;
+
+        for (uint8_t i = 0; i < numDevices; ++i)
+        {
+            ClientDevice& cd(devices[i]);
+
+            if (cd.dev == nullptr || ! cd.active)
+                continue;
+
+            if (latencyMoved(cd, captureLatency, playbackLatency))
+            {
+                __atomic_store_n(&cd.captureLatency, captureLatency, __ATOMIC_SEQ_CST);
+                __atomic_store_n(&cd.playbackLatency, playbackLatency, __ATOMIC_SEQ_CST);
+                changed = true;
+            }
+        }
+
+        if (changed && activated)
+            jack_recompute_total_latencies(client);
     }
-   #else
-    void runExternal(const char* const deviceID)
+
+    // device management loop, only waking up on hotplug events, JACK setting changes,
+    // devices going away or their latency moving (as noticed by the process callback)
+    void run()
     {
-        const uint16_t bufferSize = jack_get_buffer_size(client);
-        const uint32_t sampleRate = jack_get_sample_rate(client);
-        bool needsToInitialise = true;
+        hotplugMonitorInit();
+        hotplugMonitorAddListener(&events);
 
         while (running)
         {
-            if (dev == nullptr)
+            for (uint8_t i = 0; i < numDevices; ++i)
             {
-                dev = initDeviceAudio(deviceID, playback, bufferSize, sampleRate);
+                ClientDevice& cd(devices[i]);
 
-                if (dev != nullptr)
+                // pipelines are left alone while a swap is pending, see ClientData::rebuildDevices
+                if (__atomic_load_n(&cd.swapRequested, __ATOMIC_ACQUIRE))
+                    continue;
+
+                if (cd.dev != nullptr && ! cd.active)
                 {
-                    active = true;
-
-                    if (needsToInitialise)
-                    {
-                        needsToInitialise = false;
-                        channels = dev->hwstatus.channels;
-
-                        if (playback)
-                            activate_playback(this);
-                        else
-                            activate_capture(this);
-                    }
+                    closeDeviceAudio(cd.dev);
+                    cd.dev = nullptr;
                 }
+
+                if (cd.dev == nullptr)
+                    openDevice(i);
             }
-            else if (! active)
-            {
-                closeDeviceAudio(dev);
-                dev = nullptr;
-            }
 
-            usleep(250000); // 250ms
+            rebuildDevices();
+
+            // capture read sizes adapt at runtime, so keep the group aligned and JACK informed
+            alignLatency();
+            updateLatency();
+
+            // retry regularly in case some event was missed, polling only without hotplug events
+            notifierWait(&events, (hotplugMonitorIsActive() ? AUDIO_BRIDGE_HOTPLUG_FALLBACK_MS
+                                                             : AUDIO_BRIDGE_HOTPLUG_POLL_MS) * 1000000ULL);
         }
+
+        hotplugMonitorRemoveListener(&events);
+        hotplugMonitorClose();
+    }
+
+   #ifdef AUDIO_BRIDGE_INTERNAL_JACK_CLIENT
+    pthread_t thread = {};
+
+    static void* threadRunInternal(void* const arg)
+    {
+        ClientData* const d = static_cast<ClientData*>(arg);
+        d->run();
+        return nullptr;
     }
    #endif
 };
@@ -107,25 +342,162 @@ struct ClientData {
 static int jack_process(const unsigned frames, void* const arg)
 {
     ClientData* const d = static_cast<ClientData*>(arg);
+    const uint32_t sampleRate = __atomic_load_n(&d->sampleRate, __ATOMIC_RELAXED);
+    const bool freewheel = __atomic_load_n(&d->freewheel, __ATOMIC_RELAXED);
+
+    for (uint8_t i = 0; i < d->numDevices; ++i)
+    {
+        ClientDevice& cd(d->devices[i]);
+
+        if (__atomic_load_n(&cd.swapRequested, __ATOMIC_ACQUIRE))
+        {
+            cd.dev = cd.next;
+            cd.active = true;
+            __atomic_store_n(&cd.swapRequested, false, __ATOMIC_RELEASE);
 
-    for (uint8_t c = 0; c < d->channels; ++c)
-        d->buffers[c] = static_cast<float*>(jack_port_get_buffer(d->ports[c], frames));
+            // let the device management loop close the previous pipeline, in case it stopped waiting for us
+            notifierPost(&d->events);
+        }
+
+        if (! __atomic_load_n(&cd.registered, __ATOMIC_ACQUIRE))
+            continue;
+
+        for (uint16_t c = 0; c < cd.channels; ++c)
+            cd.buffers[c] = static_cast<float*>(jack_port_get_buffer(cd.ports[c], frames));
+
+        // pipelines set up for previous JACK settings are bypassed until rebuilt, see ClientData::rebuildDevices
+        if (cd.dev != nullptr && cd.active && cd.dev->bufferSize == frames && cd.dev->sampleRate == sampleRate)
+        {
+            // applied on every cycle, so devices opened or rebuilt meanwhile pick it up too
+            setDeviceAudioFreewheel(cd.dev, freewheel);
+
+            const bool running = d->duplex ? runDeviceAudioDuplex(cd.dev, cd.buffers, cd.buffers + cd.captureChannels)
+                                           : runDeviceAudio(cd.dev, cd.buffers);
+
+            if (running)
+            {
+                uint32_t captureLatency, playbackLatency;
 
-    if (d->dev != nullptr && d->active)
+                if (d->latencyMoved(cd, captureLatency, playbackLatency))
+                    notifierPost(&d->events);
+
+                continue;
+            }
+
+            // device went away, let the device management loop close it
+            cd.active = false;
+            notifierPost(&d->events);
+        }
+
+        if (!d->playback)
+        {
+            for (uint16_t c = 0; c < cd.captureChannels; ++c)
+                std::memset(cd.buffers[c], 0, sizeof(float)*frames);
+        }
+    }
+
+    return 0;
+}
+
+// buffer size and sample rate changes wake up the device thread, which rebuilds the device pipelines
+static int jack_buffer_size(const jack_nframes_t frames, void* const arg)
+{
+    ClientData* const d = static_cast<ClientData*>(arg);
+
+    if (__atomic_exchange_n(&d->bufferSize, frames, __ATOMIC_SEQ_CST) != frames)
+        notifierPost(&d->events);
+
+    return 0;
+}
+
+static int jack_sample_rate(const jack_nframes_t rate, void* const arg)
+{
+    ClientData* const d = static_cast<ClientData*>(arg);
+
+    if (__atomic_exchange_n(&d->sampleRate, rate, __ATOMIC_SEQ_CST) != rate)
+        notifierPost(&d->events);
+
+    return 0;
+}
+
+static void jack_freewheel(const int starting, void* const arg)
+{
+    ClientData* const d = static_cast<ClientData*>(arg);
+
+    __atomic_store_n(&d->freewheel, starting != 0, __ATOMIC_RELAXED);
+}
+
+// devices are terminal ports, so there is no latency to propagate, only the device latency to report
+static void jack_latency(const jack_latency_callback_mode_t mode, void* const arg)
+{
+    ClientData* const d = static_cast<ClientData*>(arg);
+
+    for (uint8_t i = 0; i < d->numDevices; ++i)
     {
-        if (runDeviceAudio(d->dev, d->buffers))
-            return 0;
+        ClientDevice& cd(d->devices[i]);
+
+        if (! __atomic_load_n(&cd.registered, __ATOMIC_ACQUIRE))
+            continue;
 
-        d->active = false;
+        jack_latency_range_t range;
+
+        // capture ports come first, then playback ones
+        if (mode == JackCaptureLatency)
+        {
+            range.min = range.max = __atomic_load_n(&cd.captureLatency, __ATOMIC_SEQ_CST);
+
+            for (uint16_t c = 0; c < cd.captureChannels; ++c)
+                jack_port_set_latency_range(cd.ports[c], JackCaptureLatency, &range);
+        }
+        else
+        {
+            range.min = range.max = __atomic_load_n(&cd.playbackLatency, __ATOMIC_SEQ_CST);
+
+            for (uint16_t c = cd.captureChannels; c < cd.channels; ++c)
+                jack_port_set_latency_range(cd.ports[c], JackPlaybackLatency, &range);
+        }
     }
+}
+
+static void init_callbacks(ClientData* const d)
+{
+    d->bufferSize = jack_get_buffer_size(d->client);
+    d->sampleRate = jack_get_sample_rate(d->client);
+
+    jack_set_process_callback(d->client, jack_process, d);
+    jack_set_buffer_size_callback(d->client, jack_buffer_size, d);
+    jack_set_sample_rate_callback(d->client, jack_sample_rate, d);
+    jack_set_latency_callback(d->client, jack_latency, d);
+    jack_set_freewheel_callback(d->client, jack_freewheel, d);
+}
 
-    if (!d->playback)
+static void init_options(ClientData* const d)
+{
+    initDeviceAudioOptions(&d->options);
+
+    // run device threads right below JACK's own realtime priority
+    if (jack_is_realtime(d->client))
     {
-        for (uint8_t c = 0; c < d->channels; ++c)
-            std::memset(d->buffers[c], 0, sizeof(float)*frames);
+        const int priority = jack_client_real_time_priority(d->client);
+
+        if (priority > 2)
+            d->options.rtPriority = priority - 1;
     }
 
-    return 0;
+    loadDeviceAudioOptionsFromEnv(&d->options);
+
+    if (const char* const group = std::getenv("AUDIO_BRIDGE_GROUP_LATENCY"))
+        d->groupLatency = std::atoi(group) != 0;
+}
+
+// port names get a device prefix when aggregating several devices, like "d2_p1"
+static void get_port_name(ClientData* const d, const uint8_t index, const char* const prefix, const uint16_t c,
+                          char name[32])
+{
+    if (d->numDevices > 1)
+        std::snprintf(name, 31, "d%u_%s%d", index + 1, prefix, c + 1);
+    else
+        std::snprintf(name, 31, "%s%d", prefix, c + 1);
 }
 
 static ClientData* init_capture(jack_client_t* client = nullptr)
@@ -145,7 +517,8 @@ static ClientData* init_capture(jack_client_t* client = nullptr)
     d->client = client;
     d->playback = false;
 
-    jack_set_process_callback(client, jack_process, d);
+    init_options(d);
+    init_callbacks(d);
 
     return d;
 }
@@ -162,29 +535,58 @@ static ClientData* init_playback(jack_client_t* client = nullptr)
     d->client = client;
     d->playback = true;
 
-    jack_set_process_callback(client, jack_process, d);
+    init_options(d);
+    init_callbacks(d);
 
     return d;
 }
 
-static bool activate_capture(ClientData* const d)
+static ClientData* init_duplex(jack_client_t* client = nullptr)
 {
-    if (d->dev == nullptr || d->dev->hwstatus.channels == 0)
+    if (client == nullptr)
+        client = jack_client_open("audio-bridge-duplex", JackNoStartServer, nullptr);
+
+    if (client == nullptr)
+        return nullptr;
+
+    ClientData* const d = new ClientData;
+    d->client = client;
+    d->playback = false;
+    d->duplex = true;
+
+    init_options(d);
+    init_callbacks(d);
+
+    return d;
+}
+
+static bool activate_capture(ClientData* const d, const uint8_t index)
+{
+    ClientDevice& cd(d->devices[index]);
+
+    if (cd.dev == nullptr || cd.dev->hwstatus.channels == 0)
         return false;
 
-    const uint8_t channels = d->dev->hwstatus.channels;
+    const uint16_t channels = cd.dev->hwstatus.channels;
     jack_client_t* const client = d->client;
 
-    d->buffers = new float* [channels];
-    d->ports = new jack_port_t* [channels];
+    cd.channels = cd.captureChannels = channels;
+    cd.buffers = new float* [channels];
+    cd.ports = new jack_port_t* [channels];
 
-    for (uint8_t c = 0; c < channels; ++c)
+    for (uint16_t c = 0; c < channels; ++c)
     {
-        char name[16] = {};
-        std::snprintf(name, sizeof(name)-1, "p%d", c + 1);
-        d->ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput|JackPortIsTerminal, 0);
+        char name[32] = {};
+        get_port_name(d, index, "p", c, name);
+        cd.ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput|JackPortIsTerminal, 0);
     }
 
+    __atomic_store_n(&cd.registered, true, __ATOMIC_RELEASE);
+
+    if (d->activated)
+        return true;
+
+    d->activated = true;
     jack_activate(client);
 
   #ifdef MOD_AUDIO_USB_BRIDGE
@@ -225,24 +627,33 @@ static bool activate_capture(ClientData* const d)
     return true;
 }
 
-static bool activate_playback(ClientData* const d)
+static bool activate_playback(ClientData* const d, const uint8_t index)
 {
-    if (d->dev == nullptr || d->dev->hwstatus.channels == 0)
+    ClientDevice& cd(d->devices[index]);
+
+    if (cd.dev == nullptr || cd.dev->hwstatus.channels == 0)
         return false;
 
-    const uint8_t channels = d->dev->hwstatus.channels;
+    const uint16_t channels = cd.dev->hwstatus.channels;
     jack_client_t* const client = d->client;
 
-    d->buffers = new float* [channels];
-    d->ports = new jack_port_t* [channels];
+    cd.channels = channels;
+    cd.buffers = new float* [channels];
+    cd.ports = new jack_port_t* [channels];
 
-    for (uint8_t c = 0; c < channels; ++c)
+    for (uint16_t c = 0; c < channels; ++c)
     {
-        char name[16] = {};
-        std::snprintf(name, sizeof(name)-1, "p%d", c + 1);
-        d->ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput|JackPortIsTerminal, 0);
+        char name[32] = {};
+        get_port_name(d, index, "p", c, name);
+        cd.ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput|JackPortIsTerminal, 0);
     }
 
+    __atomic_store_n(&cd.registered, true, __ATOMIC_RELEASE);
+
+    if (d->activated)
+        return true;
+
+    d->activated = true;
     jack_activate(client);
 
    #ifdef MOD_AUDIO_USB_BRIDGE
@@ -260,6 +671,48 @@ static bool activate_playback(ClientData* const d)
     return true;
 }
 
+static bool activate_duplex(ClientData* const d, const uint8_t index)
+{
+    ClientDevice& cd(d->devices[index]);
+
+    if (cd.dev == nullptr || cd.dev->hwstatus.channels == 0 || cd.dev->duplexPeer == nullptr)
+        return false;
+
+    const uint16_t captureChannels = cd.dev->hwstatus.channels;
+    const uint16_t playbackChannels = cd.dev->duplexPeer->hwstatus.channels;
+    jack_client_t* const client = d->client;
+
+    cd.captureChannels = captureChannels;
+    cd.channels = captureChannels + playbackChannels;
+    cd.buffers = new float* [cd.channels];
+    cd.ports = new jack_port_t* [cd.channels];
+
+    for (uint16_t c = 0; c < captureChannels; ++c)
+    {
+        char name[32] = {};
+        get_port_name(d, index, "c", c, name);
+        cd.ports[c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput|JackPortIsTerminal, 0);
+    }
+
+    for (uint16_t c = 0; c < playbackChannels; ++c)
+    {
+        char name[32] = {};
+        get_port_name(d, index, "p", c, name);
+        cd.ports[captureChannels + c] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE,
+                                                           JackPortIsInput|JackPortIsTerminal, 0);
+    }
+
+    __atomic_store_n(&cd.registered, true, __ATOMIC_RELEASE);
+
+    if (! d->activated)
+    {
+        d->activated = true;
+        jack_activate(client);
+    }
+
+    return true;
+}
+
 static void close(ClientData* const d)
 {
     if (d->client != nullptr)
@@ -268,10 +721,29 @@ static void close(ClientData* const d)
         jack_client_close(d->client);
     }
 
-    closeDeviceAudio(d->dev);
+    for (uint8_t i = 0; i < d->numDevices; ++i)
+    {
+        ClientDevice& cd(d->devices[i]);
+
+        if (cd.dev != nullptr)
+            closeDeviceAudio(cd.dev);
+
+        // JACK is deactivated by now, also close whichever side of an unfinished swap is not in cd.dev
+        if (__atomic_load_n(&cd.swapRequested, __ATOMIC_ACQUIRE))
+        {
+            if (cd.next != nullptr)
+                closeDeviceAudio(cd.next);
+        }
+        else if (cd.prev != nullptr)
+        {
+            closeDeviceAudio(cd.prev);
+        }
+
+        std::free(cd.deviceID);
+        delete[] cd.buffers;
+        delete[] cd.ports;
+    }
 
-    delete[] d->buffers;
-    delete[] d->ports;
     delete d;
 }
 
@@ -295,15 +767,21 @@ int jack_initialize(jack_client_t* const client, const char* const load_init)
     if (const char* const ctype = std::strrchr(load_init, ' '))
     {
         const bool playback = std::strcmp(ctype + 1, "playback") == 0;
+        const bool duplex = std::strcmp(ctype + 1, "duplex") == 0;
 
-        if (ClientData* const d = playback ? init_playback(client) : init_capture(client))
+        if (ClientData* const d = duplex ? init_duplex(client) : playback ? init_playback(client) : init_capture(client))
         {
-            const size_t devlen = ctype - load_init;
-            d->deviceID = static_cast<char*>(std::malloc(devlen + 1));
-            std::memcpy(d->deviceID, load_init, devlen);
-            d->deviceID[devlen] = '\0';
+            // one or more space-separated device ids before the mode
+            for (const char* id = load_init; id < ctype;)
+            {
+                const char* const sep = static_cast<const char*>(std::memchr(id, ' ', ctype - id));
+                const size_t devlen = (sep != nullptr ? sep : ctype) - id;
+
+                if (devlen != 0 && ! d->parseChannelMapArg(id, devlen) && d->addDevice(id, devlen))
+                    printf("deviceID %s || %d %d\n", d->devices[d->numDevices - 1].deviceID, d->playback, playback);
 
-            printf("deviceID %s || %d %d\n", d->deviceID, d->playback, playback);
+                id += devlen + 1;
+            }
 
             if (pthread_create(&d->thread, nullptr, ClientData::threadRunInternal, d) == 0)
                 return 0;
@@ -322,43 +800,70 @@ void jack_finish(void* const arg)
     if (d->running)
     {
         d->running = false;
+        notifierPost(&d->events);
         pthread_join(d->thread, nullptr);
     }
 
     d->client = nullptr;
-    std::free(d->deviceID);
     close(d);
 }
 #else
 int main(int argc, const char* argv[])
 {
-    std::vector<DeviceID> inputs, outputs;
-    enumerateSoundcards(inputs, outputs);
+    std::vector<DeviceIndexEntry> devices;
 
     ClientData* d;
-    const char* deviceID;
+    int numDeviceArgs = argc - 1;
 
-    if (argc > 2 && std::strcmp(argv[2], "capture") == 0)
+    // last argument selects the mode, all others are soundcards or a channel map
+    if (argc > 2 && std::strcmp(argv[argc - 1], "capture") == 0)
     {
-        deviceID = argv[1];
+        --numDeviceArgs;
         d = init_capture();
     }
-    else if (argc > 1)
+    else if (argc > 2 && std::strcmp(argv[argc - 1], "duplex") == 0)
     {
-        deviceID = argv[1];
-        d = init_playback();
+        --numDeviceArgs;
+        d = init_duplex();
     }
     else
     {
-        deviceID = outputs[outputs.size() - 1].id.c_str();
+        if (argc > 2 && std::strcmp(argv[argc - 1], "playback") == 0)
+            --numDeviceArgs;
+
         d = init_playback();
     }
 
     if (d == nullptr)
     {
+        printf("failed to create JACK client\n");
+        return 1;
+    }
+
+    for (int i = 1; i <= numDeviceArgs; ++i)
+    {
+        const size_t len = std::strlen(argv[i]);
+
+        if (! d->parseChannelMapArg(argv[i], len))
+            d->addDevice(argv[i], len);
+    }
+
+    if (d->numDevices == 0)
+    {
+        // pick the best playback device for the current JACK sample rate
+        getRankedSoundcards(true, jack_get_sample_rate(d->client), devices);
+
+        if (devices.empty())
+        {
+            printf("no playback devices available\n");
+            close(d);
+            return 1;
+        }
+
+        d->addDevice(devices.front().device.id.c_str(), devices.front().device.id.size());
     }
 
-    d->runExternal(deviceID);
+    d->run();
     close(d);
 
     cleanup();
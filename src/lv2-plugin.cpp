@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
 #include "audio-device-discovery.hpp"
+#include "audio-device-hotplug.hpp"
 #include "audio-device-init.hpp"
 
 #include <lv2/core/lv2.h>
@@ -16,11 +17,10 @@
 #endif
 
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
 
-static constexpr const uint8_t kMaxIO = 32;
-
-typedef std::vector<DeviceID>::const_reverse_iterator cri;
+static constexpr const uint16_t kMaxIO = AUDIO_BRIDGE_MAX_CHANNELS;
 
 enum {
     kWorkerLoadLastAvailableDevice = 1,
@@ -40,6 +40,8 @@ enum {
     kControlBufferSize,
     kControlRatio,
     kControlBufferFill,
+    kControlLatency,
+    kControlFreewheel,
     kControlCount,
 };
 
@@ -50,14 +52,19 @@ struct WorkerDevice {
 
 struct PluginData {
     DeviceAudio* dev = nullptr;
-    uint16_t bufferSize = 0;
+    uint32_t bufferSize = 0;
     uint32_t sampleRate = 0;
     uint32_t maxRingBufferSize = 0;
+    uint16_t numChannels = 2;
     bool playback = false;
     bool activated = false;
     uint32_t numSamplesUntilWorkerIdle = 0;
+    uint32_t numSamplesForWorkerRetry = 0;
+    uint32_t hotplugGeneration = 0;
    #ifndef __MOD_DEVICES__
     char* deviceID = nullptr;
+    // soundcard channels to bridge as given by the user, saved with the instance state next to deviceID
+    char* channelMap = nullptr;
    #endif
 
     struct Features {
@@ -76,31 +83,55 @@ struct PluginData {
 
     float* controlports[kControlCount] = {};
 
+    DeviceAudioOptions deviceOptions;
+
     struct URIs {
         const LV2_URID atom_Int;
         const LV2_URID bufsize_maxBlockLength;
        #ifndef __MOD_DEVICES__
         const LV2_URID atom_String;
         const LV2_URID deviceid;
+        const LV2_URID channelmap;
        #endif
 
         URIs(const LV2_URID_Map* const uridMap)
             : atom_Int(uridMap->map(uridMap->handle, LV2_ATOM__Int)),
               bufsize_maxBlockLength(uridMap->map(uridMap->handle, LV2_BUF_SIZE__maxBlockLength))
            #ifndef __MOD_DEVICES__
-            , deviceid(uridMap->map(uridMap->handle,"https://falktx.com/plugins/audio-bridge#deviceid")),
-            , atom_String(uridMap->map(uridMap->handle, LV2_ATOM__String))
+            , atom_String(uridMap->map(uridMap->handle, LV2_ATOM__String)),
+              deviceid(uridMap->map(uridMap->handle, "https://falktx.com/plugins/audio-bridge#deviceid")),
+              channelmap(uridMap->map(uridMap->handle, "https://falktx.com/plugins/audio-bridge#channelmap"))
            #endif
         {}
     } uris;
 
-    PluginData(const uint32_t sampleRate_, const LV2_Feature* const* const featuresPtr)
+    PluginData(const uint32_t sampleRate_, const uint16_t numChannels_, const LV2_Feature* const* const featuresPtr)
         : sampleRate(sampleRate_),
+          numChannels(numChannels_),
           features(featuresPtr),
           uris(features.uridMap)
     {
+        // device options, asking for as many channels as we have audio ports
+        initDeviceAudioOptions(&deviceOptions);
+        loadDeviceAudioOptionsFromEnv(&deviceOptions);
+        deviceOptions.channels = numChannels;
+        setImplicitChannelMap();
+
+       #ifndef __MOD_DEVICES__
+        // the environment only provides the default, restored instance state takes precedence
+        if (const char* const map = std::getenv("AUDIO_BRIDGE_CHANNEL_MAP"))
+            channelMap = strdup(map);
+       #endif
+
         // set initial options
         optionsSet(static_cast<const LV2_Options_Option*>(lv2_features_data(featuresPtr, LV2_OPTIONS__options)));
+
+        // with hotplug events only retry rarely, in case some event was missed
+        numSamplesForWorkerRetry = hotplugMonitorInit() ? sampleRate / 1000 * AUDIO_BRIDGE_HOTPLUG_FALLBACK_MS
+                                                        : sampleRate;
+
+        // try loading a device on the first run
+        numSamplesUntilWorkerIdle = numSamplesForWorkerRetry;
     }
 
     ~PluginData()
@@ -110,7 +141,26 @@ struct PluginData {
         if (dev != nullptr)
             closeDeviceAudio(dev);
 
+        hotplugMonitorClose();
+
         delete[] buffers.dummy;
+
+       #ifndef __MOD_DEVICES__
+        std::free(channelMap);
+       #endif
+    }
+
+    // without a user channel map only bridge the device channels that have an audio port,
+    // devices that cannot match the requested channel count would otherwise convert and resample unused channels
+    void setImplicitChannelMap()
+    {
+        if (deviceOptions.numMappedChannels != 0)
+            return;
+
+        for (uint16_t c=0; c<numChannels; ++c)
+            deviceOptions.channelMap[c] = c;
+
+        deviceOptions.numMappedChannels = numChannels;
     }
 
     void activate()
@@ -125,19 +175,18 @@ struct PluginData {
 
     void connectPort(const uint32_t index, void* const data)
     {
-        switch (index)
-        {
-        case 0 ... 1:
+        // audio ports come first, followed by the control ports
+        if (index < numChannels)
             buffers.pointers[index] = static_cast<float*>(data);
-            break;
-        case 2 ... kControlCount + 2:
-            controlports[index - 2] = static_cast<float*>(data);
-            break;
-        }
+        else if (index - numChannels < kControlCount)
+            controlports[index - numChannels] = static_cast<float*>(data);
     }
 
     void run(const uint32_t frames)
     {
+        if (dev != nullptr)
+            setDeviceAudioFreewheel(dev, *controlports[kControlFreewheel] > 0.5f);
+
         if (dev != nullptr && ! runDeviceAudio(dev, buffers.pointers))
         {
             DeviceAudio* const olddev = dev;
@@ -170,7 +219,17 @@ struct PluginData {
                 *controlports[kControlRatio] = *controlports[kControlBufferFill] = 0.f;
             }
 
+            // follows the measured device delay and the fill target, hosts pick up changes on their own
+            *controlports[kControlLatency] = getDeviceAudioLatency(dev);
+
             dev->enabled = *controlports[kControlEnabled] > 0.5f;
+
+            // device might bridge fewer channels than we have ports, see AUDIO_BRIDGE_CHANNEL_MAP
+            if (!playback)
+            {
+                for (uint16_t i=dev->hwstatus.channels; i<numChannels; ++i)
+                    std::memset(buffers.pointers[i], 0, sizeof(float)*frames);
+            }
         }
         else
         {
@@ -178,17 +237,21 @@ struct PluginData {
             *controlports[kControlNumChannels] = *controlports[kControlNumPeriods] = 0.f;
             *controlports[kControlPeriodSize] = *controlports[kControlBufferSize] = 0.f;
             *controlports[kControlRatio] = *controlports[kControlBufferFill] = 0.f;
+            *controlports[kControlLatency] = 0.f;
 
             if (!playback)
             {
-                std::memset(buffers.pointers[0], 0, sizeof(float)*frames);
-                std::memset(buffers.pointers[1], 0, sizeof(float)*frames);
+                for (uint16_t i=0; i<numChannels; ++i)
+                    std::memset(buffers.pointers[i], 0, sizeof(float)*frames);
             }
 
             numSamplesUntilWorkerIdle += frames;
 
-            if (numSamplesUntilWorkerIdle >= sampleRate)
+            const uint32_t generation = hotplugMonitorGetGeneration(playback);
+
+            if (generation != hotplugGeneration || numSamplesUntilWorkerIdle >= numSamplesForWorkerRetry)
             {
+                hotplugGeneration = generation;
                 numSamplesUntilWorkerIdle = 0;
                 const uint32_t r = kWorkerLoadLastAvailableDevice;
                 features.workerSchedule->schedule_work(features.workerSchedule->handle, sizeof(r), &r);
@@ -227,7 +290,7 @@ struct PluginData {
         buffers.dummy = new float[newBufferSize];
         std::memset(buffers.dummy, 0, sizeof(float) * bufferSize);
 
-        for (uint8_t i=2; i<kMaxIO; ++i)
+        for (uint16_t i=numChannels; i<kMaxIO; ++i)
             buffers.pointers[i] = buffers.dummy;
     }
 
@@ -252,6 +315,11 @@ struct PluginData {
                   uris.atom_String, LV2_STATE_IS_POD|LV2_STATE_IS_PORTABLE);
         }
 
+        // empty means the first channels of the device, one per audio port
+        const char* const map = channelMap != nullptr ? channelMap : "";
+        store(handle, uris.channelmap, map, std::strlen(map) + 1,
+              uris.atom_String, LV2_STATE_IS_POD|LV2_STATE_IS_PORTABLE);
+
         return LV2_STATE_SUCCESS;
     }
 
@@ -270,13 +338,39 @@ struct PluginData {
         std::free(deviceID);
         deviceID = strdup(static_cast<const char*>(data));
 
-        void* const msg = std::malloc(sizeof(uint32_t) + size);
+        // optional, states saved by older versions only have the device id
+        size_t storedsize = 0;
+        const void* const mapdata = retrieve(handle, uris.channelmap, &storedsize, &type, &flags);
+
+        if (mapdata != nullptr && storedsize != 0 && type == uris.atom_String)
+        {
+            DeviceAudioOptions check;
+            initDeviceAudioOptions(&check);
+
+            if (parseDeviceChannelMap(&check, static_cast<const char*>(mapdata)))
+            {
+                std::free(channelMap);
+                channelMap = strdup(static_cast<const char*>(mapdata));
+            }
+            else
+            {
+                d_stderr2("invalid saved channel map '%s'", static_cast<const char*>(mapdata));
+            }
+        }
+
+        // device id followed by the channel map, both null-terminated
+        const char* const map = channelMap != nullptr ? channelMap : "";
+        const size_t mapsize = std::strlen(map) + 1;
+
+        void* const msg = std::malloc(sizeof(uint32_t) + size + mapsize);
         DISTRHO_SAFE_ASSERT_RETURN(msg != nullptr, LV2_STATE_ERR_NO_SPACE);
 
         *static_cast<uint32_t*>(msg) = kWorkerLoadDeviceWithKnownId;
         std::memcpy(static_cast<uint32_t*>(msg) + 1, data, size);
+        std::memcpy(static_cast<char*>(msg) + sizeof(uint32_t) + size, map, mapsize);
 
-        features.workerSchedule->schedule_work(features.workerSchedule->handle, sizeof(uint32_t) + size, msg);
+        features.workerSchedule->schedule_work(features.workerSchedule->handle,
+                                               sizeof(uint32_t) + size + mapsize, msg);
 
         std::free(msg);
 
@@ -302,18 +396,20 @@ struct PluginData {
            #ifndef __MOD_DEVICES__
             if (deviceID != nullptr)
             {
-                devptr = initDeviceAudio(deviceID, playback, bufferSize, sampleRate);
+                devptr = initDeviceAudio(deviceID, playback, bufferSize, sampleRate, &deviceOptions);
             }
             else
            #endif
             {
-                std::vector<DeviceID> inputs, outputs;
-                enumerateSoundcards(inputs, outputs);
-
-                const std::vector<DeviceID>& devices(playback ? outputs : inputs);
-
-                for (cri it = devices.rbegin(); it != devices.rend() && devptr == nullptr; ++it)
-                    devptr = initDeviceAudio((*it).id.c_str(), playback, bufferSize, sampleRate);
+                std::vector<DeviceIndexEntry> devices;
+                getRankedSoundcards(playback, sampleRate, devices);
+
+                for (const DeviceIndexEntry& entry : devices)
+                {
+                    if ((devptr = initDeviceAudio(entry.device.id.c_str(), playback, bufferSize, sampleRate,
+                                                  &deviceOptions)) != nullptr)
+                        break;
+                }
             }
 
             if (devptr == nullptr)
@@ -326,8 +422,14 @@ struct PluginData {
         case kWorkerLoadDeviceWithKnownId:
         {
             const char* const nextDeviceID = reinterpret_cast<const char*>(udata + 1);
+            const char* const nextChannelMap = nextDeviceID + std::strlen(nextDeviceID) + 1;
+
+            // only the worker opens devices, so deviceOptions is safe to change here
+            parseDeviceChannelMap(&deviceOptions, nextChannelMap);
+            setImplicitChannelMap();
+
             DeviceAudio* const devptr = nextDeviceID[0] != '\0'
-                                      ? initDeviceAudio(nextDeviceID, playback, bufferSize, sampleRate)
+                                      ? initDeviceAudio(nextDeviceID, playback, bufferSize, sampleRate, &deviceOptions)
                                       : nullptr;
             respond(handle, sizeof(devptr), &devptr);
             break;
@@ -363,12 +465,23 @@ struct PluginData {
     }
 };
 
-PluginData* lv2_instantiate(const double sampleRate, const LV2_Feature* const* const features)
+// channel count comes from the plugin URI, "#capture" is stereo while "#capture_8" has 8 channels
+static uint16_t lv2_channels_from_uri(const char* const uri)
+{
+    const char* const suffix = std::strrchr(uri, '_');
+    const int channels = suffix != nullptr ? std::atoi(suffix + 1) : 0;
+
+    return channels > 0 && channels <= kMaxIO ? static_cast<uint16_t>(channels) : 2;
+}
+
+PluginData* lv2_instantiate(const LV2_Descriptor* const descriptor,
+                            const double sampleRate,
+                            const LV2_Feature* const* const features)
 {
     if (std::fmod(sampleRate, 1.0) != 0.0)
         return nullptr;
 
-    PluginData* const p = new PluginData(sampleRate, features);
+    PluginData* const p = new PluginData(sampleRate, lv2_channels_from_uri(descriptor->URI), features);
     if (p->bufferSize != 0)
         return p;
 
@@ -376,12 +489,12 @@ PluginData* lv2_instantiate(const double sampleRate, const LV2_Feature* const* c
     return nullptr;
 }
 
-LV2_Handle lv2_instantiate_capture(const LV2_Descriptor*,
+LV2_Handle lv2_instantiate_capture(const LV2_Descriptor* const descriptor,
                                    const double sampleRate,
                                    const char*,
                                    const LV2_Feature* const* const features)
 {
-    if (PluginData* const p = lv2_instantiate(sampleRate, features))
+    if (PluginData* const p = lv2_instantiate(descriptor, sampleRate, features))
     {
         p->playback = false;
         return p;
@@ -389,12 +502,12 @@ LV2_Handle lv2_instantiate_capture(const LV2_Descriptor*,
     return nullptr;
 }
 
-LV2_Handle lv2_instantiate_playback(const LV2_Descriptor*,
+LV2_Handle lv2_instantiate_playback(const LV2_Descriptor* const descriptor,
                                     const double sampleRate,
                                     const char*,
                                     const LV2_Feature* const* const features)
 {
-    if (PluginData* const p = lv2_instantiate(sampleRate, features))
+    if (PluginData* const p = lv2_instantiate(descriptor, sampleRate, features))
     {
         p->playback = true;
         return p;
@@ -525,6 +638,66 @@ const LV2_Descriptor* lv2_descriptor(const uint32_t index)
         lv2_cleanup,
         lv2_extension_data
     };
+    static const LV2_Descriptor descriptor_capture_4 = {
+        "https://falktx.com/plugins/audio-bridge#capture_4",
+        lv2_instantiate_capture,
+        lv2_connect_port,
+        lv2_activate,
+        lv2_run,
+        lv2_deactivate,
+        lv2_cleanup,
+        lv2_extension_data
+    };
+    static const LV2_Descriptor descriptor_playback_4 = {
+        "https://falktx.com/plugins/audio-bridge#playback_4",
+        lv2_instantiate_playback,
+        lv2_connect_port,
+        lv2_activate,
+        lv2_run,
+        lv2_deactivate,
+        lv2_cleanup,
+        lv2_extension_data
+    };
+    static const LV2_Descriptor descriptor_capture_8 = {
+        "https://falktx.com/plugins/audio-bridge#capture_8",
+        lv2_instantiate_capture,
+        lv2_connect_port,
+        lv2_activate,
+        lv2_run,
+        lv2_deactivate,
+        lv2_cleanup,
+        lv2_extension_data
+    };
+    static const LV2_Descriptor descriptor_playback_8 = {
+        "https://falktx.com/plugins/audio-bridge#playback_8",
+        lv2_instantiate_playback,
+        lv2_connect_port,
+        lv2_activate,
+        lv2_run,
+        lv2_deactivate,
+        lv2_cleanup,
+        lv2_extension_data
+    };
+    static const LV2_Descriptor descriptor_capture_16 = {
+        "https://falktx.com/plugins/audio-bridge#capture_16",
+        lv2_instantiate_capture,
+        lv2_connect_port,
+        lv2_activate,
+        lv2_run,
+        lv2_deactivate,
+        lv2_cleanup,
+        lv2_extension_data
+    };
+    static const LV2_Descriptor descriptor_playback_16 = {
+        "https://falktx.com/plugins/audio-bridge#playback_16",
+        lv2_instantiate_playback,
+        lv2_connect_port,
+        lv2_activate,
+        lv2_run,
+        lv2_deactivate,
+        lv2_cleanup,
+        lv2_extension_data
+    };
 
     switch (index)
     {
@@ -532,6 +705,18 @@ const LV2_Descriptor* lv2_descriptor(const uint32_t index)
         return &descriptor_capture;
     case 1:
         return &descriptor_playback;
+    case 2:
+        return &descriptor_capture_4;
+    case 3:
+        return &descriptor_playback_4;
+    case 4:
+        return &descriptor_capture_8;
+    case 5:
+        return &descriptor_playback_8;
+    case 6:
+        return &descriptor_capture_16;
+    case 7:
+        return &descriptor_playback_16;
     default:
         return nullptr;
     }
@@ -1,10 +1,370 @@
 // SPDX-FileCopyrightText: 2021-2024 Filipe Coelho <falktx@falktx.com>
 // SPDX-License-Identifier: AGPL-3.0-or-later
 
+// Table-driven checks of the device code that needs no soundcard, followed by a listing of the available ones.
+// Exits with a non-zero status if any check failed.
+
+#include "audio-device-init.cpp"
 #include "audio-device-discovery.hpp"
 
+#include <unistd.h>
+
+static uint32_t gNumFailures = 0;
+
+#define TEST_CHECK(cond, ...)                                       \
+    do {                                                            \
+        if (! (cond)) {                                             \
+            ++gNumFailures;                                         \
+            printf("FAIL %s:%d | %s | ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            puts("");                                               \
+        }                                                           \
+    } while (0)
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void testChannelMap()
+{
+    static const struct {
+        const char* str;
+        bool valid;
+        uint16_t numMapped;
+        uint16_t map[4];
+    } kCases[] = {
+        { "", true, 0, {} },
+        { "1", true, 1, { 0 } },
+        { "1,2", true, 2, { 0, 1 } },
+        { "3-6", true, 4, { 2, 3, 4, 5 } },
+        { "8,1,3-4", true, 4, { 7, 0, 2, 3 } },
+        { "5-5", true, 1, { 4 } },
+        { "0", false, 0, {} },
+        { "2-1", false, 0, {} },
+        { "1-", false, 0, {} },
+        { "a", false, 0, {} },
+        { "1;2", false, 0, {} },
+        { "1,,2", false, 0, {} },
+        { "1-129", false, 0, {} },
+        { "70000", false, 0, {} },
+    };
+
+    for (const auto& test : kCases)
+    {
+        DeviceAudioOptions options;
+        initDeviceAudioOptions(&options);
+
+        const bool valid = parseDeviceChannelMap(&options, test.str);
+        TEST_CHECK(valid == test.valid, "'%s'", test.str);
+
+        if (! valid)
+        {
+            TEST_CHECK(options.numMappedChannels == 0, "'%s' changed the map on failure", test.str);
+            continue;
+        }
+
+        TEST_CHECK(options.numMappedChannels == test.numMapped, "'%s' gives %u", test.str, options.numMappedChannels);
+
+        for (uint16_t c=0; c<test.numMapped && c<options.numMappedChannels; ++c)
+            TEST_CHECK(options.channelMap[c] == test.map[c], "'%s' channel %u is %u", test.str, c, options.channelMap[c]);
+    }
+
+    // requested device channels cover the highest mapped one
+    DeviceAudioOptions options;
+    initDeviceAudioOptions(&options);
+    options.channels = 2;
+    parseDeviceChannelMap(&options, "7,3");
+    TEST_CHECK(deviceRequestedChannels(options) == 7, "%u", deviceRequestedChannels(options));
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void testCpuList()
+{
+    static const struct {
+        const char* str;
+        uint64_t mask;
+    } kCases[] = {
+        { "", 0 },
+        { "0", 0x1 },
+        { "0,2", 0x5 },
+        { "1-3", 0xe },
+        { "0,4-5,7", 0xb1 },
+        { "63", 1ULL << 63 },
+        { "60-70", 0xfULL << 60 },
+        { "64", 0 },
+        { "x", 0 },
+        // parsing stops at the first invalid entry
+        { "2,x,3", 0x4 },
+        { "1-x", 0 },
+    };
+
+    for (const auto& test : kCases)
+    {
+        const uint64_t mask = parseCpuList(test.str);
+        TEST_CHECK(mask == test.mask, "'%s' gives 0x%llx", test.str, static_cast<unsigned long long>(mask));
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void testRingBufferSkip()
+{
+    static constexpr const uint32_t kSize = 64;
+
+    static const struct {
+        // frames written and read beforehand, moving the read position
+        uint32_t start;
+        uint32_t write;
+        uint32_t skip;
+        bool valid;
+    } kCases[] = {
+        { 0, 10, 4, true },
+        { 0, 10, 10, true },
+        { 0, 10, 11, false },
+        // read position right before the end, skip wraps around
+        { 60, 10, 6, true },
+        { 60, 10, 4, true },
+        { 60, 10, 10, true },
+        { 60, 10, 11, false },
+        // read position exactly at the end
+        { 64 - 8, 8, 8, true },
+        { 63, 20, 19, true },
+        { 0, 0, 1, false },
+    };
+
+    float data[kSize] = {};
+    float* ptrs[1] = { data };
+
+    for (const auto& test : kCases)
+    {
+        AudioRingBuffer rb;
+        rb.createBuffer(1, kSize);
+
+        if (test.start != 0)
+        {
+            rb.write(ptrs, test.start);
+            rb.read(ptrs, test.start);
+        }
+
+        // frame index as value, so the read position can be checked after skipping
+        for (uint32_t i=0; i<test.write; ++i)
+            data[i] = i;
+
+        if (test.write != 0)
+            rb.write(ptrs, test.write);
+
+        const bool valid = rb.skip(test.skip);
+        TEST_CHECK(valid == test.valid, "start %u, write %u, skip %u", test.start, test.write, test.skip);
+
+        const uint32_t remaining = test.write - (valid ? test.skip : 0);
+        TEST_CHECK(rb.getNumReadableSamples() == remaining, "start %u, write %u, skip %u, %u readable",
+                   test.start, test.write, test.skip, rb.getNumReadableSamples());
+
+        if (remaining != 0)
+        {
+            float value = -1.f;
+            float* valueptrs[1] = { &value };
+            rb.read(valueptrs, 1);
+            TEST_CHECK(value == static_cast<float>(test.write - remaining), "start %u, write %u, skip %u, read %f",
+                       test.start, test.write, test.skip, value);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void testConverters()
+{
+    static const struct {
+        uint32_t hints;
+        float tolerance;
+    } kFormats[] = {
+        { kDeviceSample16, 2.f / 0x8000 },
+        { kDeviceSample24, 2.f / 0x800000 },
+        { kDeviceSample24LE3, 2.f / 0x800000 },
+        { kDeviceSample32, 1e-6f },
+    };
+
+    static const struct {
+        uint32_t hints;
+        const char* map;
+    } kLayouts[] = {
+        { 0, nullptr },
+        { kDeviceNonInterleaved, nullptr },
+        { kDeviceChannelMap, "4,2" },
+        { kDeviceNonInterleaved|kDeviceChannelMap, "4,2" },
+    };
+
+    static const float kValues[] = { 0.f, 0.5f, -0.5f, 0.25f, -0.999f, 0.999f, 0.001f, -0.001f };
+    static constexpr const uint32_t kFrames = sizeof(kValues) / sizeof(kValues[0]);
+    static constexpr const uint16_t kDeviceChannels = 4;
+
+    for (const auto& format : kFormats)
+    {
+        for (const auto& layout : kLayouts)
+        {
+            DeviceAudio dev = {};
+            initDeviceAudioOptions(&dev.options);
+
+            dev.deviceID = strdup("test");
+            dev.sampleRate = 48000;
+            dev.bufferSize = kFrames;
+            dev.hints = format.hints|layout.hints;
+            dev.hwstatus.channels = kDeviceChannels;
+            dev.hwstatus.deviceChannels = kDeviceChannels;
+            dev.hwstatus.periods = 3;
+            dev.hwstatus.periodSize = kFrames;
+            dev.hwstatus.fullBufferSize = kFrames * 3;
+
+            if (layout.map != nullptr)
+            {
+                parseDeviceChannelMap(&dev.options, layout.map);
+                dev.hwstatus.channels = dev.options.numMappedChannels;
+            }
+
+            deviceAllocBuffers(dev);
+
+            const uint16_t channels = dev.hwstatus.channels;
+
+            for (uint16_t c=0; c<channels; ++c)
+                for (uint32_t i=0; i<kFrames; ++i)
+                    dev.buffers.f32[c][i] = kValues[i] * (c % 2 ? -1.f : 1.f);
+
+            deviceFloatToRaw(&dev, kFrames);
+
+            for (uint16_t c=0; c<channels; ++c)
+                std::memset(dev.buffers.f32[c], 0, sizeof(float) * kFrames);
+
+            deviceRawToFloat(&dev, kFrames);
+
+            for (uint16_t c=0; c<channels; ++c)
+            {
+                for (uint32_t i=0; i<kFrames; ++i)
+                {
+                    const float expected = kValues[i] * (c % 2 ? -1.f : 1.f);
+                    TEST_CHECK(std::abs(dev.buffers.f32[c][i] - expected) <= format.tolerance,
+                               "hints 0x%x, channel %u, frame %u, %f instead of %f",
+                               dev.hints, c, i, dev.buffers.f32[c][i], expected);
+                }
+            }
+
+            // unmapped device channels must stay silent
+            if (layout.map != nullptr)
+            {
+                const uint8_t sampleSize = getSampleSizeFromHints(dev.hints);
+                void* ptrs[kDeviceChannels];
+                deviceRawPointers(&dev, 0, ptrs);
+
+                for (uint32_t i=0; i<kFrames; ++i)
+                {
+                    for (uint16_t dc : { 0, 2 })
+                    {
+                        const int8_t* const raw = dev.hints & kDeviceNonInterleaved
+                                                ? static_cast<int8_t*>(ptrs[dc]) + i * sampleSize
+                                                : dev.buffers.raw + (i * kDeviceChannels + dc) * sampleSize;
+
+                        for (uint8_t b=0; b<sampleSize; ++b)
+                            TEST_CHECK(raw[b] == 0, "hints 0x%x, device channel %u, frame %u", dev.hints, dc, i);
+                    }
+                }
+            }
+
+            deviceFreeBuffers(&dev, channels);
+            std::free(dev.deviceID);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
+static void testParamsCacheKeys()
+{
+    static const struct {
+        const char* key;
+        // keys that would break the line-based file format are only kept in memory
+        bool persisted;
+    } kCases[] = {
+        { "hw:CARD=PCH,0|-|playback|48000|128|0|0|1|2", true },
+        { "hw:CARD=Device,0|0d8c:0014|capture|44100|256|0|0|1|2", true },
+        { "plug:'dmix:CARD=My Card'|-|playback|48000|64|0|0|0|8", true },
+        { "  leading and trailing spaces  ", true },
+        { "tab\tin key", true },
+        { "newline\nin key", false },
+    };
+
+    char path[] = "/tmp/audio-bridge-test-XXXXXX";
+    const int fd = mkstemp(path);
+    TEST_CHECK(fd >= 0, "mkstemp failed");
+    if (fd < 0)
+        return;
+    close(fd);
+
+    setenv("AUDIO_BRIDGE_PARAMS_CACHE", path, 1);
+
+    pthread_mutex_lock(&sParamsCacheMutex);
+    sParamsCacheLoaded = false;
+    sParamsCacheCount = 0;
+    pthread_mutex_unlock(&sParamsCacheMutex);
+
+    uint32_t index = 0;
+    for (const auto& test : kCases)
+    {
+        DeviceParamsCacheEntry entry = {};
+        std::strncpy(entry.key, test.key, sizeof(entry.key) - 1);
+        entry.format = SND_PCM_FORMAT_S24_3LE;
+        entry.access = SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+        entry.periodSize = 128 + index;
+        entry.periods = 3;
+        entry.channels = 2 + index;
+        storeDeviceParamsCache(entry);
+        ++index;
+    }
+
+    // start over from the file, as a new process would
+    pthread_mutex_lock(&sParamsCacheMutex);
+    sParamsCacheLoaded = false;
+    sParamsCacheCount = 0;
+    pthread_mutex_unlock(&sParamsCacheMutex);
+
+    index = 0;
+    for (const auto& test : kCases)
+    {
+        DeviceParamsCacheEntry entry = {};
+        const bool found = lookupDeviceParamsCache(test.key, entry);
+        TEST_CHECK(found == test.persisted, "'%s'", test.key);
+
+        if (found)
+        {
+            TEST_CHECK(entry.format == SND_PCM_FORMAT_S24_3LE && entry.access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+                       "'%s' format %d access %d", test.key, entry.format, entry.access);
+            TEST_CHECK(entry.periodSize == 128 + index && entry.periods == 3 && entry.channels == 2 + index,
+                       "'%s' period size %u periods %u channels %u",
+                       test.key, entry.periodSize, entry.periods, entry.channels);
+        }
+
+        ++index;
+    }
+
+    unsetenv("AUDIO_BRIDGE_PARAMS_CACHE");
+    unlink(path);
+
+    pthread_mutex_lock(&sParamsCacheMutex);
+    sParamsCacheLoaded = false;
+    sParamsCacheCount = 0;
+    pthread_mutex_unlock(&sParamsCacheMutex);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+
 int main()
 {
+    testChannelMap();
+    testCpuList();
+    testRingBufferSkip();
+    testConverters();
+    testParamsCacheKeys();
+
+    printf("%u failed checks\n", gNumFailures);
+
     std::vector<DeviceID> inputs, outputs;
     enumerateSoundcards(inputs, outputs);
 
@@ -23,5 +383,5 @@ int main()
 
     cleanup();
 
-    return 0;
+    return gNumFailures != 0 ? 1 : 0;
 }